@@ -0,0 +1,66 @@
+/* bench.h: common bits for the keyutils benchmarks
+ *
+ * Copyright (C) 2026 Red Hat, Inc. All Rights Reserved.
+ * Written by agent (agent@local)
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version
+ * 2 of the License, or (at your option) any later version.
+ */
+
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+
+/*
+ * a set of latency samples, in nanoseconds
+ */
+struct bench_lat {
+	uint64_t	*ns;
+	unsigned	nr;
+	unsigned	max;
+	uint64_t	total;		/* sum of the samples held */
+};
+
+/*
+ * what's reported for a set of samples
+ */
+struct bench_summary {
+	unsigned	nr;
+	double		ops_per_sec;	/* derived from the sum of the samples */
+	uint64_t	p50;
+	uint64_t	p99;
+	uint64_t	p999;
+	uint64_t	max;
+};
+
+static inline uint64_t bench_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+extern int bench_lat_init(struct bench_lat *lat, unsigned max);
+extern void bench_lat_free(struct bench_lat *lat);
+extern int bench_lat_merge(struct bench_lat *to, const struct bench_lat *from);
+extern void bench_summarise(struct bench_lat *lat, struct bench_summary *sum);
+
+static inline void bench_lat_add(struct bench_lat *lat, uint64_t ns)
+{
+	if (lat->nr < lat->max) {
+		lat->ns[lat->nr++] = ns;
+		lat->total += ns;
+	}
+}
+
+extern const char *bench_backend(void);
+extern void bench_json_string(FILE *f, const char *s);
+extern void bench_json_summary(FILE *f, const struct bench_summary *sum);
+
+#endif /* BENCH_H */
@@ -0,0 +1,539 @@
+/* keyutils-bench.c: microbenchmarks for libkeyutils
+ *
+ * Copyright (C) 2026 Red Hat, Inc. All Rights Reserved.
+ * Written by agent (agent@local)
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version
+ * 2 of the License, or (at your option) any later version.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/utsname.h>
+#include "keyutils.h"
+#include "bench.h"
+
+/*
+ * a benchmark
+ * - op() is timed once per iteration, i being the iteration number
+ * - reset(), if given, is called untimed before every batch iterations so
+ *   that ops that consume resources (such as add_key) don't run into the
+ *   quota
+ */
+struct bench {
+	char		name[64];
+	int		(*op)(struct bench *b, unsigned i);
+	int		(*reset)(struct bench *b);
+	unsigned	batch;
+	unsigned	divisor;	/* run iterations/divisor times */
+	key_serial_t	ring;
+	key_serial_t	key;
+	const char	*desc;
+	unsigned	count;
+};
+
+static unsigned iterations = 10000;
+static const char *filter;
+static FILE *json;
+static int nr_results;
+
+static void format(void) __attribute__((noreturn));
+static void error(const char *msg) __attribute__((noreturn));
+
+static void format(void)
+{
+	fprintf(stderr,
+		"Format: keyutils-bench [-n <iterations>] [-j <jsonfile>] [-f <prefix>]\n");
+	exit(2);
+}
+
+static void error(const char *msg)
+{
+	perror(msg);
+	exit(1);
+}
+
+/*****************************************************************************/
+/*
+ * create a keyring for a benchmark to work in, attached to our session
+ */
+static key_serial_t bench_ring(const char *name)
+{
+	key_serial_t ring;
+
+	ring = add_key("keyring", name, NULL, 0, KEY_SPEC_SESSION_KEYRING);
+	if (ring == -1)
+		error("add_key");
+	return ring;
+}
+
+static void bench_discard_ring(key_serial_t ring)
+{
+	keyctl_clear(ring);
+	keyctl_unlink(ring, KEY_SPEC_SESSION_KEYRING);
+}
+
+/*
+ * fill a keyring with nr user keys, the last of which is named desc
+ */
+static int bench_fill(key_serial_t ring, unsigned nr, const char *desc)
+{
+	char name[32];
+	unsigned i;
+
+	for (i = 0; i < nr; i++) {
+		if (i == nr - 1 && desc)
+			strcpy(name, desc);
+		else
+			sprintf(name, "bench:fill:%u", i);
+		if (add_key("user", name, "x", 1, ring) == -1)
+			return -1;
+	}
+	return 0;
+}
+
+/*****************************************************************************/
+/*
+ * time a benchmark and report on it
+ */
+static void bench_run(struct bench *b)
+{
+	struct bench_summary sum;
+	struct bench_lat lat;
+	uint64_t t0, t1;
+	unsigned nr, warmup, i;
+	int err = 0;
+
+	nr = iterations / (b->divisor ?: 1);
+	if (nr == 0)
+		nr = 1;
+	warmup = nr / 10 < 100 ? nr / 10 : 100;
+
+	if (bench_lat_init(&lat, nr) < 0)
+		error("malloc");
+
+	for (i = 0; i < warmup + nr; i++) {
+		if (b->reset && i % b->batch == 0 && b->reset(b) < 0) {
+			err = errno;
+			break;
+		}
+
+		t0 = bench_now();
+		if (b->op(b, i) < 0) {
+			err = errno;
+			break;
+		}
+		t1 = bench_now();
+
+		if (i >= warmup)
+			bench_lat_add(&lat, t1 - t0);
+	}
+
+	bench_summarise(&lat, &sum);
+
+	if (err)
+		printf("%-32s %s\n", b->name, strerror(err));
+	else
+		printf("%-32s %9u %12.0f %9llu %9llu %9llu\n",
+		       b->name, sum.nr, sum.ops_per_sec,
+		       (unsigned long long)sum.p50,
+		       (unsigned long long)sum.p99,
+		       (unsigned long long)sum.p999);
+	fflush(stdout);
+
+	if (json) {
+		fprintf(json, "%s\n    { \"name\": ", nr_results ? "," : "");
+		bench_json_string(json, b->name);
+		fprintf(json, ", ");
+		if (err) {
+			fprintf(json, "\"error\": ");
+			bench_json_string(json, strerror(err));
+		} else {
+			bench_json_summary(json, &sum);
+		}
+		fprintf(json, " }");
+	}
+	nr_results++;
+
+	bench_lat_free(&lat);
+}
+
+/*
+ * see whether a benchmark has been selected
+ */
+static int bench_wanted(const char *name)
+{
+	return !filter || strncmp(name, filter, strlen(filter)) == 0;
+}
+
+/*****************************************************************************/
+/*
+ * add_key() of a new key
+ */
+static int op_add_key(struct bench *b, unsigned i)
+{
+	char desc[32];
+
+	sprintf(desc, "bench:add:%u", i);
+	return add_key("user", desc, "payload", 7, b->ring);
+}
+
+static int reset_clear(struct bench *b)
+{
+	return keyctl_clear(b->ring);
+}
+
+static void bench_add_key(void)
+{
+	struct bench b = {
+		.name	= "add_key",
+		.op	= op_add_key,
+		.reset	= reset_clear,
+		.batch	= 100,
+	};
+
+	if (!bench_wanted(b.name))
+		return;
+	b.ring = bench_ring("bench:add");
+	bench_run(&b);
+	bench_discard_ring(b.ring);
+}
+
+/*****************************************************************************/
+/*
+ * request_key() of a key that is or isn't in the session keyring
+ * - there's no callout info, so a miss won't cause an upcall
+ */
+static int op_request_key(struct bench *b, unsigned i)
+{
+	key_serial_t id = request_key("user", b->desc, NULL, 0);
+
+	if (id == -1 && errno == ENOKEY && !b->key)
+		return 0;
+	return id;
+}
+
+static int op_search(struct bench *b, unsigned i)
+{
+	return keyctl_search(b->ring, "user", b->desc, 0);
+}
+
+static void bench_lookups(void)
+{
+	struct bench b = {
+		.name	= "request_key/hit",
+		.op	= op_request_key,
+		.desc	= "bench:hit",
+	};
+
+	b.ring = bench_ring("bench:lookup");
+	b.key = add_key("user", "bench:hit", "x", 1, b.ring);
+	if (b.key == -1)
+		error("add_key");
+
+	if (bench_wanted(b.name))
+		bench_run(&b);
+
+	strcpy(b.name, "keyctl_search");
+	b.op = op_search;
+	if (bench_wanted(b.name))
+		bench_run(&b);
+
+	strcpy(b.name, "request_key/miss");
+	b.op = op_request_key;
+	b.desc = "bench:miss";
+	b.key = 0;
+	if (bench_wanted(b.name))
+		bench_run(&b);
+
+	bench_discard_ring(b.ring);
+}
+
+/*****************************************************************************/
+/*
+ * keyctl_read_alloc() and keyctl_describe_alloc() of a user key
+ */
+static int op_read_alloc(struct bench *b, unsigned i)
+{
+	void *p;
+	int ret;
+
+	ret = keyctl_read_alloc(b->key, &p);
+	if (ret >= 0)
+		free(p);
+	return ret;
+}
+
+static int op_describe_alloc(struct bench *b, unsigned i)
+{
+	char *p;
+	int ret;
+
+	ret = keyctl_describe_alloc(b->key, &p);
+	if (ret >= 0)
+		free(p);
+	return ret;
+}
+
+static void bench_read(void)
+{
+	static const size_t sizes[] = { 16, 256, 4096, 32767 };
+	struct bench b = {
+		.op	= op_read_alloc,
+	};
+	unsigned i;
+	char *payload;
+
+	payload = malloc(sizes[3]);
+	if (!payload)
+		error("malloc");
+	memset(payload, 'x', sizes[3]);
+
+	b.ring = bench_ring("bench:read");
+	for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		sprintf(b.name, "keyctl_read_alloc/%zu", sizes[i]);
+		if (!bench_wanted(b.name))
+			continue;
+		b.key = add_key("user", "bench:read", payload, sizes[i], b.ring);
+		if (b.key == -1)
+			error("add_key");
+		bench_run(&b);
+	}
+
+	strcpy(b.name, "keyctl_describe_alloc");
+	if (bench_wanted(b.name)) {
+		b.op = op_describe_alloc;
+		b.key = add_key("user", "bench:read", payload, 16, b.ring);
+		if (b.key == -1)
+			error("add_key");
+		bench_run(&b);
+	}
+
+	bench_discard_ring(b.ring);
+	free(payload);
+}
+
+/*****************************************************************************/
+/*
+ * recursive_key_scan() over a tree of keyrings, each with fanout members and
+ * user keys at the bottom
+ */
+static int bench_build_tree(key_serial_t ring, unsigned fanout, unsigned depth)
+{
+	key_serial_t child;
+	char desc[32];
+	unsigned i;
+
+	for (i = 0; i < fanout; i++) {
+		if (depth > 1) {
+			sprintf(desc, "bench:tree:%u", i);
+			child = add_key("keyring", desc, NULL, 0, ring);
+			if (child == -1 ||
+			    bench_build_tree(child, fanout, depth - 1) < 0)
+				return -1;
+		} else {
+			sprintf(desc, "bench:leaf:%u", i);
+			if (add_key("user", desc, "x", 1, ring) == -1)
+				return -1;
+		}
+	}
+	return 0;
+}
+
+static int bench_count_key(key_serial_t parent, key_serial_t key,
+			   char *desc, int desc_len, void *data)
+{
+	return 1;
+}
+
+static int op_scan(struct bench *b, unsigned i)
+{
+	int n;
+
+	n = recursive_key_scan(b->ring, bench_count_key, NULL);
+	if (n != b->count) {
+		errno = EIO;
+		return -1;
+	}
+	return 0;
+}
+
+static void bench_scan(void)
+{
+	static const unsigned trees[][2] = {
+		{ 4, 3 }, { 8, 3 }, { 16, 3 },
+	};
+	struct bench b = {
+		.op	= op_scan,
+	};
+	unsigned i, fanout, depth, nodes, level;
+
+	for (i = 0; i < sizeof(trees) / sizeof(trees[0]); i++) {
+		fanout = trees[i][0];
+		depth = trees[i][1];
+		sprintf(b.name, "recursive_key_scan/%ux%u", fanout, depth);
+		if (!bench_wanted(b.name))
+			continue;
+
+		nodes = 0;
+		for (level = 1, b.count = 1; level <= depth; level++) {
+			nodes += b.count * fanout;
+			b.count *= fanout;
+		}
+		b.count = nodes + 1;	/* the scan includes the root */
+		b.divisor = nodes / 10 ?: 1;
+
+		b.ring = bench_ring("bench:scan");
+		if (bench_build_tree(b.ring, fanout, depth) == 0)
+			bench_run(&b);
+		else
+			printf("%-32s %s\n", b.name, strerror(errno));
+		bench_discard_ring(b.ring);
+	}
+}
+
+/*****************************************************************************/
+/*
+ * find_key_by_type_and_desc() with nr keys about
+ * - "proc" puts the target in a keyring that can't be searched, so it can
+ *   only be found by walking /proc/keys
+ * - "miss" looks for something that isn't there at all
+ */
+static int op_find_key(struct bench *b, unsigned i)
+{
+	key_serial_t id;
+
+	id = find_key_by_type_and_desc("user", b->desc, 0);
+	if (id == -1 && errno == ENOKEY && !b->key)
+		return 0;
+	if (b->key && id != b->key) {
+		errno = id == -1 ? errno : EIO;
+		return -1;
+	}
+	return 0;
+}
+
+static void bench_find_key(void)
+{
+	static const unsigned counts[] = { 10, 100, 1000 };
+	struct bench b = {
+		.op	= op_find_key,
+	};
+	unsigned i;
+
+	for (i = 0; i < sizeof(counts) / sizeof(counts[0]); i++) {
+		char proc_name[64], miss_name[64], desc[32];
+
+		sprintf(proc_name, "find_key_by_type_and_desc/%u/proc", counts[i]);
+		sprintf(miss_name, "find_key_by_type_and_desc/%u/miss", counts[i]);
+		if (!bench_wanted(proc_name) && !bench_wanted(miss_name))
+			continue;
+
+		/* the kernel may not have garbage collected the last round's
+		 * keys yet, so each round needs its own target */
+		sprintf(desc, "bench:find:%u", counts[i]);
+
+		b.divisor = counts[i] / 10 ?: 1;
+		b.ring = bench_ring("bench:find");
+		if (bench_fill(b.ring, counts[i], desc) < 0) {
+			printf("%-32s %s\n", proc_name, strerror(errno));
+			bench_discard_ring(b.ring);
+			continue;
+		}
+		b.key = keyctl_search(b.ring, "user", desc, 0);
+		if (b.key == -1)
+			error("keyctl_search");
+		if (keyctl_setperm(b.ring, KEY_POS_ALL & ~KEY_POS_SEARCH) < 0)
+			error("keyctl_setperm");
+
+		if (bench_wanted(proc_name)) {
+			strcpy(b.name, proc_name);
+			b.desc = desc;
+			bench_run(&b);
+		}
+
+		if (bench_wanted(miss_name)) {
+			strcpy(b.name, miss_name);
+			b.desc = "bench:miss";
+			b.key = 0;
+			bench_run(&b);
+		}
+
+		bench_discard_ring(b.ring);
+	}
+}
+
+/*****************************************************************************/
+/*
+ * run the benchmarks
+ */
+int main(int argc, char *argv[])
+{
+	struct utsname uts;
+	const char *jsonfile = NULL;
+	char *p;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "n:j:f:")) != -1) {
+		switch (opt) {
+		case 'n':
+			iterations = strtoul(optarg, &p, 0);
+			if (*p || iterations == 0)
+				format();
+			break;
+		case 'j':
+			jsonfile = optarg;
+			break;
+		case 'f':
+			filter = optarg;
+			break;
+		default:
+			format();
+		}
+	}
+	if (optind != argc)
+		format();
+
+	/* work in an anonymous session keyring so that we don't disturb or
+	 * get disturbed by anything else */
+	if (keyctl_join_session_keyring(NULL) == -1)
+		error("keyctl_join_session_keyring");
+
+	if (uname(&uts) < 0)
+		error("uname");
+
+	if (jsonfile) {
+		json = fopen(jsonfile, "w");
+		if (!json)
+			error(jsonfile);
+		fprintf(json, "{\n  \"backend\": ");
+		bench_json_string(json, bench_backend());
+		fprintf(json, ",\n  \"kernel\": ");
+		bench_json_string(json, uts.release);
+		fprintf(json, ",\n  \"iterations\": %u,\n  \"results\": [", iterations);
+	}
+
+	printf("# backend %s, kernel %s, %u iterations\n",
+	       bench_backend(), uts.release, iterations);
+	printf("%-32s %9s %12s %9s %9s %9s\n",
+	       "BENCHMARK", "OPS", "OPS/S", "P50(ns)", "P99(ns)", "P999(ns)");
+
+	bench_add_key();
+	bench_lookups();
+	bench_read();
+	bench_scan();
+	bench_find_key();
+
+	if (json) {
+		fprintf(json, "\n  ]\n}\n");
+		if (fclose(json) == EOF)
+			error(jsonfile);
+	}
+	return 0;
+}
@@ -0,0 +1,360 @@
+/* keyutils-scale.c: time keyctl commands against very large keyrings
+ *
+ * Copyright (C) 2026 Red Hat, Inc. All Rights Reserved.
+ * Written by agent (agent@local)
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version
+ * 2 of the License, or (at your option) any later version.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/utsname.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include "keyutils.h"
+#include "bench.h"
+
+static unsigned sizes[32] = { 1000, 10000, 100000 };
+static unsigned nr_sizes = 3;
+static unsigned depths[8] = { 1, 2, 3 };
+static unsigned nr_depths = 3;
+static unsigned repeats = 3;
+static const char *keyctl_prog = "keyctl";
+
+static void format(void) __attribute__((noreturn));
+static void error(const char *msg) __attribute__((noreturn));
+
+static void format(void)
+{
+	fprintf(stderr,
+		"Format: keyutils-scale [-n <keys>[,<keys>...]] [-d <depth>[,<depth>...]]\n"
+		"                       [-r <repeats>] [-k <keyctl>] [-j <jsonfile>]\n");
+	exit(2);
+}
+
+static void error(const char *msg)
+{
+	perror(msg);
+	exit(1);
+}
+
+/*
+ * parse a comma-separated list of numbers
+ */
+static unsigned parse_list(char *arg, unsigned *list, unsigned max)
+{
+	unsigned nr = 0;
+	char *p;
+
+	for (;;) {
+		if (nr >= max)
+			format();
+		list[nr++] = strtoul(arg, &p, 0);
+		if (p == arg || list[nr - 1] == 0)
+			format();
+		if (!*p)
+			return nr;
+		if (*p != ',')
+			format();
+		arg = p + 1;
+	}
+}
+
+/*****************************************************************************/
+/*
+ * populate a tree of the given depth with nr user keys
+ * - the keyrings each have fanout members, the keys being at the bottom
+ * - the last key added is named "scale:last" so that it can be searched for
+ */
+struct scale_tree {
+	unsigned	nr;
+	unsigned	added;
+	unsigned	fanout;
+};
+
+static int scale_populate(struct scale_tree *tree, key_serial_t ring,
+			  unsigned depth)
+{
+	key_serial_t child;
+	unsigned i;
+	char desc[32];
+
+	for (i = 0; i < tree->fanout && tree->added < tree->nr; i++) {
+		if (depth > 1) {
+			sprintf(desc, "scale:ring:%u", i);
+			child = add_key("keyring", desc, NULL, 0, ring);
+			if (child == -1 ||
+			    scale_populate(tree, child, depth - 1) < 0)
+				return -1;
+		} else {
+			tree->added++;
+			if (tree->added == tree->nr)
+				strcpy(desc, "scale:last");
+			else
+				sprintf(desc, "scale:%u", tree->added);
+			if (add_key("user", desc, "x", 1, ring) == -1)
+				return -1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * work out the smallest fanout that holds nr keys at the given depth
+ */
+static unsigned scale_fanout(unsigned nr, unsigned depth)
+{
+	unsigned long long cap;
+	unsigned fanout, i;
+
+	for (fanout = 1;; fanout++) {
+		cap = 1;
+		for (i = 0; i < depth && cap < nr; i++)
+			cap *= fanout;
+		if (cap >= nr)
+			return fanout;
+	}
+}
+
+/*****************************************************************************/
+/*
+ * run a keyctl command with its output discarded, returning the elapsed time
+ * and the child's peak RSS
+ */
+static int scale_exec(char *const argv[], uint64_t *_ns, long *_maxrss)
+{
+	struct rusage ru;
+	uint64_t t0;
+	pid_t pid;
+	int status, fd;
+
+	t0 = bench_now();
+	pid = fork();
+	if (pid == -1)
+		error("fork");
+	if (pid == 0) {
+		fd = open("/dev/null", O_WRONLY);
+		if (fd != -1) {
+			dup2(fd, 1);
+			close(fd);
+		}
+		execvp(argv[0], argv);
+		perror(argv[0]);
+		_exit(127);
+	}
+
+	if (wait4(pid, &status, 0, &ru) == -1)
+		error("wait4");
+	*_ns = bench_now() - t0;
+	*_maxrss = ru.ru_maxrss;
+
+	if (!WIFEXITED(status))
+		return -1;
+	return WEXITSTATUS(status);
+}
+
+struct scale_cmd {
+	const char	*name;
+	const char	*args[5];	/* "%r" is replaced with the keyring ID */
+	unsigned	once;		/* destroys the tree, so only run once */
+};
+
+static const struct scale_cmd scale_cmds[] = {
+	{ "list",	{ "list", "%r" } },
+	{ "rlist",	{ "rlist", "%r" } },
+	{ "show",	{ "show", "%r" } },
+	{ "search",	{ "search", "%r", "user", "scale:last" } },
+	{ "purge",	{ "purge", "user" }, 1 },
+};
+
+/*
+ * time one command against a tree
+ */
+static void scale_cmd(const struct scale_cmd *cmd, key_serial_t ring,
+		      FILE *json, int first)
+{
+	struct bench_summary sum;
+	struct bench_lat lat;
+	uint64_t ns;
+	char ringid[16], *argv[8];
+	long maxrss, peak = 0;
+	unsigned i, nr;
+	int ret = 0;
+
+	sprintf(ringid, "%d", ring);
+	argv[0] = (char *)keyctl_prog;
+	for (i = 0; cmd->args[i]; i++)
+		argv[i + 1] = strcmp(cmd->args[i], "%r") == 0 ?
+			ringid : (char *)cmd->args[i];
+	argv[i + 1] = NULL;
+
+	nr = cmd->once ? 1 : repeats;
+	if (bench_lat_init(&lat, nr) < 0)
+		error("malloc");
+	for (i = 0; i < nr; i++) {
+		ret = scale_exec(argv, &ns, &maxrss);
+		if (ret != 0)
+			break;
+		bench_lat_add(&lat, ns);
+		if (maxrss > peak)
+			peak = maxrss;
+	}
+	bench_summarise(&lat, &sum);
+	bench_lat_free(&lat);
+
+	if (ret != 0)
+		printf("  %-8s failed (%d)\n", cmd->name, ret);
+	else
+		printf("  %-8s %12.3f %12.3f %10ld\n",
+		       cmd->name, sum.p50 / 1e6, sum.max / 1e6, peak);
+	fflush(stdout);
+
+	if (json) {
+		fprintf(json, "%s\n        { \"command\": \"%s\", ",
+			first ? "" : ",", cmd->name);
+		if (ret != 0)
+			fprintf(json, "\"exit_status\": %d }", ret);
+		else
+			fprintf(json, "\"runs\": %u, \"median_ns\": %llu, "
+				"\"max_ns\": %llu, \"maxrss_kb\": %ld }",
+				sum.nr, (unsigned long long)sum.p50,
+				(unsigned long long)sum.max, peak);
+	}
+}
+
+/*
+ * build a tree of the given size and depth and time the commands against it
+ */
+static void scale_run(unsigned nr, unsigned depth, FILE *json, int first)
+{
+	struct scale_tree tree = {
+		.nr	= nr,
+		.fanout	= scale_fanout(nr, depth),
+	};
+	key_serial_t ring;
+	uint64_t t0, t1;
+	unsigned i;
+	int ret;
+
+	ring = add_key("keyring", "scale:root", NULL, 0, KEY_SPEC_SESSION_KEYRING);
+	if (ring == -1)
+		error("add_key");
+
+	t0 = bench_now();
+	ret = scale_populate(&tree, ring, depth);
+	t1 = bench_now();
+
+	printf("%u keys, depth %u, fanout %u: ", nr, depth, tree.fanout);
+	if (json)
+		fprintf(json, "%s\n    { \"keys\": %u, \"depth\": %u, \"fanout\": %u, ",
+			first ? "" : ",", nr, depth, tree.fanout);
+
+	if (ret < 0) {
+		printf("populate failed after %u keys: %m\n", tree.added);
+		if (json) {
+			fprintf(json, "\"populate_error\": ");
+			bench_json_string(json, strerror(errno));
+			fprintf(json, ", \"populated\": %u }", tree.added);
+		}
+	} else {
+		printf("populated in %.3fms\n", (t1 - t0) / 1e6);
+		printf("  %-8s %12s %12s %10s\n",
+		       "COMMAND", "MEDIAN(ms)", "MAX(ms)", "MAXRSS(kB)");
+		if (json)
+			fprintf(json, "\"populate_ns\": %llu, \"commands\": [",
+				(unsigned long long)(t1 - t0));
+		for (i = 0; i < sizeof(scale_cmds) / sizeof(scale_cmds[0]); i++)
+			scale_cmd(&scale_cmds[i], ring, json, i == 0);
+		if (json)
+			fprintf(json, "\n      ] }");
+	}
+
+	keyctl_clear(ring);
+	keyctl_unlink(ring, KEY_SPEC_SESSION_KEYRING);
+}
+
+/*****************************************************************************/
+/*
+ * run the scaling benchmark
+ */
+int main(int argc, char *argv[])
+{
+	struct utsname uts;
+	struct rusage ru;
+	const char *jsonfile = NULL;
+	FILE *json = NULL;
+	unsigned i, j;
+	char *p;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "n:d:r:k:j:")) != -1) {
+		switch (opt) {
+		case 'n':
+			nr_sizes = parse_list(optarg, sizes, 32);
+			break;
+		case 'd':
+			nr_depths = parse_list(optarg, depths, 8);
+			break;
+		case 'r':
+			repeats = strtoul(optarg, &p, 0);
+			if (*p || !repeats)
+				format();
+			break;
+		case 'k':
+			keyctl_prog = optarg;
+			break;
+		case 'j':
+			jsonfile = optarg;
+			break;
+		default:
+			format();
+		}
+	}
+	if (optind != argc)
+		format();
+
+	/* the keyctl commands we run will inherit this */
+	if (keyctl_join_session_keyring(NULL) == -1)
+		error("keyctl_join_session_keyring");
+
+	if (uname(&uts) < 0)
+		error("uname");
+
+	if (jsonfile) {
+		json = fopen(jsonfile, "w");
+		if (!json)
+			error(jsonfile);
+		fprintf(json, "{\n  \"backend\": ");
+		bench_json_string(json, bench_backend());
+		fprintf(json, ",\n  \"kernel\": ");
+		bench_json_string(json, uts.release);
+		fprintf(json, ",\n  \"repeats\": %u,\n  \"trees\": [", repeats);
+	}
+
+	printf("# backend %s, kernel %s, %u runs per command\n",
+	       bench_backend(), uts.release, repeats);
+
+	for (i = 0; i < nr_sizes; i++)
+		for (j = 0; j < nr_depths; j++)
+			scale_run(sizes[i], depths[j], json, i == 0 && j == 0);
+
+	if (getrusage(RUSAGE_SELF, &ru) < 0)
+		error("getrusage");
+	printf("# keyutils-scale maxrss %ldkB\n", ru.ru_maxrss);
+
+	if (json) {
+		fprintf(json, "\n  ],\n  \"self_maxrss_kb\": %ld\n}\n",
+			ru.ru_maxrss);
+		if (fclose(json) == EOF)
+			error(jsonfile);
+	}
+	return 0;
+}
@@ -0,0 +1,525 @@
+/* keyutils-stress.c: multithreaded keyring contention stress test
+ *
+ * Copyright (C) 2026 Red Hat, Inc. All Rights Reserved.
+ * Written by agent (agent@local)
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version
+ * 2 of the License, or (at your option) any later version.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/utsname.h>
+#include "keyutils.h"
+#include "bench.h"
+
+enum stress_op {
+	STRESS_ADD,
+	STRESS_SEARCH,
+	STRESS_READ,
+	STRESS_UPDATE,
+	STRESS_UNLINK,
+	STRESS_NR_OPS
+};
+
+static const char *const stress_op_names[STRESS_NR_OPS] = {
+	[STRESS_ADD]	= "add",
+	[STRESS_SEARCH]	= "search",
+	[STRESS_READ]	= "read",
+	[STRESS_UPDATE]	= "update",
+	[STRESS_UNLINK]	= "unlink",
+};
+
+/* the mix of operations, in parts per hundred */
+static unsigned mix[STRESS_NR_OPS] = {
+	[STRESS_ADD]	= 20,
+	[STRESS_SEARCH]	= 40,
+	[STRESS_READ]	= 30,
+	[STRESS_UPDATE]	= 5,
+	[STRESS_UNLINK]	= 5,
+};
+
+static unsigned thread_counts[64] = { 1, 2, 4, 8, 16 };
+static unsigned nr_thread_counts = 5;
+static unsigned duration = 5;
+static unsigned nr_shards = 1;
+static unsigned nr_keys = 100;
+static unsigned payload_size = 32;
+static unsigned max_samples = 1000000;
+static key_serial_t anchor = KEY_SPEC_PROCESS_KEYRING;
+
+static key_serial_t *shards;
+static key_serial_t *serials;	/* last known serial of each key, or 0 */
+static char *payload;
+static volatile int stop;
+
+/*
+ * what each thread accumulates
+ */
+struct stress_thread {
+	pthread_t		thread;
+	unsigned		seed;
+	unsigned long		ops[STRESS_NR_OPS];
+	unsigned long		misses;
+	unsigned long		errors;
+	int			last_error;
+	struct bench_lat	lat[STRESS_NR_OPS];
+};
+
+static pthread_barrier_t start_barrier;
+
+static void format(void) __attribute__((noreturn));
+static void error(const char *msg) __attribute__((noreturn));
+
+static void format(void)
+{
+	fprintf(stderr,
+		"Format: keyutils-stress [-t <threads>[,<threads>...]] [-d <secs>]\n"
+		"                        [-s <shards>] [-k <keys>] [-p <payload-size>]\n"
+		"                        [-m <op>=<pct>[,...]] [-a process|session]\n"
+		"                        [-j <jsonfile>]\n");
+	exit(2);
+}
+
+static void error(const char *msg)
+{
+	perror(msg);
+	exit(1);
+}
+
+/*
+ * parse a comma-separated list of numbers
+ */
+static unsigned parse_list(char *arg, unsigned *list, unsigned max)
+{
+	unsigned nr = 0;
+	char *p;
+
+	for (;;) {
+		if (nr >= max)
+			format();
+		list[nr++] = strtoul(arg, &p, 0);
+		if (p == arg || list[nr - 1] == 0)
+			format();
+		if (!*p)
+			return nr;
+		if (*p != ',')
+			format();
+		arg = p + 1;
+	}
+}
+
+/*
+ * parse an operation mix, eg. "add=10,search=90"; unmentioned ops get 0
+ */
+static void parse_mix(char *arg)
+{
+	unsigned total = 0, i;
+	char *tok, *p, *save;
+
+	memset(mix, 0, sizeof(mix));
+	for (tok = strtok_r(arg, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+		p = strchr(tok, '=');
+		if (!p)
+			format();
+		*p++ = 0;
+		for (i = 0; i < STRESS_NR_OPS; i++)
+			if (strcmp(tok, stress_op_names[i]) == 0)
+				break;
+		if (i >= STRESS_NR_OPS)
+			format();
+		mix[i] = strtoul(p, &p, 0);
+		if (*p)
+			format();
+	}
+
+	for (i = 0; i < STRESS_NR_OPS; i++)
+		total += mix[i];
+	if (total != 100) {
+		fprintf(stderr, "The operation mix must add up to 100\n");
+		exit(2);
+	}
+}
+
+static unsigned stress_rand(unsigned *seed)
+{
+	unsigned x = *seed;
+
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	return *seed = x;
+}
+
+/*****************************************************************************/
+/*
+ * perform one operation on key n
+ * - keys are spread over the shards by number
+ */
+static long stress_do_op(enum stress_op op, unsigned n, char *buf)
+{
+	key_serial_t shard = shards[n % nr_shards], id;
+	char desc[32];
+
+	switch (op) {
+	case STRESS_ADD:
+		sprintf(desc, "stress:%u", n);
+		id = add_key("user", desc, payload, payload_size, shard);
+		if (id != -1)
+			__atomic_store_n(&serials[n], id, __ATOMIC_RELAXED);
+		return id;
+
+	case STRESS_SEARCH:
+		sprintf(desc, "stress:%u", n);
+		return keyctl_search(shard, "user", desc, 0);
+
+	case STRESS_READ:
+		id = __atomic_load_n(&serials[n], __ATOMIC_RELAXED);
+		if (!id) {
+			errno = ENOKEY;
+			return -1;
+		}
+		return keyctl_read(id, buf, payload_size);
+
+	case STRESS_UPDATE:
+		id = __atomic_load_n(&serials[n], __ATOMIC_RELAXED);
+		if (!id) {
+			errno = ENOKEY;
+			return -1;
+		}
+		return keyctl_update(id, payload, payload_size);
+
+	case STRESS_UNLINK:
+		id = __atomic_exchange_n(&serials[n], 0, __ATOMIC_RELAXED);
+		if (!id) {
+			errno = ENOKEY;
+			return -1;
+		}
+		return keyctl_unlink(id, shard);
+
+	default:
+		errno = EINVAL;
+		return -1;
+	}
+}
+
+/*
+ * stress thread
+ */
+static void *stress_thread(void *_st)
+{
+	struct stress_thread *st = _st;
+	enum stress_op op;
+	uint64_t t0, t1;
+	unsigned r, n;
+	char *buf;
+
+	buf = malloc(payload_size ?: 1);
+	if (!buf)
+		error("malloc");
+
+	pthread_barrier_wait(&start_barrier);
+
+	while (!stop) {
+		n = stress_rand(&st->seed) % nr_keys;
+		r = stress_rand(&st->seed) % 100;
+		for (op = 0; op < STRESS_NR_OPS - 1; op++) {
+			if (r < mix[op])
+				break;
+			r -= mix[op];
+		}
+
+		t0 = bench_now();
+		if (stress_do_op(op, n, buf) == -1) {
+			switch (errno) {
+			case ENOKEY:
+			case EKEYREVOKED:
+			case EKEYEXPIRED:
+			case EACCES:	/* raced with unlink: no longer possessed */
+				st->misses++;
+				break;
+			default:
+				st->errors++;
+				st->last_error = errno;
+				break;
+			}
+		}
+		t1 = bench_now();
+
+		st->ops[op]++;
+		bench_lat_add(&st->lat[op], t1 - t0);
+	}
+
+	free(buf);
+	return NULL;
+}
+
+/*****************************************************************************/
+/*
+ * empty the shards and then half fill them
+ */
+static void stress_prepare(void)
+{
+	unsigned i;
+	char buf[1];
+
+	for (i = 0; i < nr_shards; i++)
+		if (keyctl_clear(shards[i]) < 0)
+			error("keyctl_clear");
+	memset(serials, 0, nr_keys * sizeof(serials[0]));
+
+	for (i = 0; i < nr_keys; i += 2)
+		if (stress_do_op(STRESS_ADD, i, buf) == -1)
+			error("add_key");
+}
+
+/*
+ * run the stress test with the given number of threads
+ */
+static void stress_run(unsigned nr_threads, FILE *json, int first)
+{
+	struct stress_thread *threads;
+	struct bench_summary sum[STRESS_NR_OPS], all_sum;
+	struct bench_lat all;
+	unsigned long ops = 0, misses = 0, errors = 0;
+	uint64_t t0, t1;
+	double ops_per_sec;
+	unsigned per_thread, i, op;
+	int last_error = 0;
+
+	stress_prepare();
+
+	threads = calloc(nr_threads, sizeof(threads[0]));
+	if (!threads)
+		error("calloc");
+
+	/* bound the memory used by the latency samples */
+	per_thread = max_samples / nr_threads / STRESS_NR_OPS ?: 1;
+
+	if (pthread_barrier_init(&start_barrier, NULL, nr_threads + 1) != 0)
+		error("pthread_barrier_init");
+
+	stop = 0;
+	for (i = 0; i < nr_threads; i++) {
+		threads[i].seed = 0x9e3779b9 * (i + 1);
+		for (op = 0; op < STRESS_NR_OPS; op++)
+			if (bench_lat_init(&threads[i].lat[op], per_thread) < 0)
+				error("malloc");
+		errno = pthread_create(&threads[i].thread, NULL,
+				       stress_thread, &threads[i]);
+		if (errno)
+			error("pthread_create");
+	}
+
+	pthread_barrier_wait(&start_barrier);
+	t0 = bench_now();
+	sleep(duration);
+	stop = 1;
+	for (i = 0; i < nr_threads; i++)
+		pthread_join(threads[i].thread, NULL);
+	t1 = bench_now();
+	pthread_barrier_destroy(&start_barrier);
+
+	/* gather up the results */
+	if (bench_lat_init(&all, 0) < 0)
+		error("malloc");
+	for (op = 0; op < STRESS_NR_OPS; op++) {
+		struct bench_lat lat;
+
+		if (bench_lat_init(&lat, 0) < 0)
+			error("malloc");
+		for (i = 0; i < nr_threads; i++)
+			if (bench_lat_merge(&lat, &threads[i].lat[op]) < 0 ||
+			    bench_lat_merge(&all, &threads[i].lat[op]) < 0)
+				error("realloc");
+		bench_summarise(&lat, &sum[op]);
+		sum[op].nr = 0;
+		for (i = 0; i < nr_threads; i++)
+			sum[op].nr += threads[i].ops[op];
+		sum[op].ops_per_sec = sum[op].nr * 1e9 / (t1 - t0);
+		bench_lat_free(&lat);
+	}
+
+	for (i = 0; i < nr_threads; i++) {
+		for (op = 0; op < STRESS_NR_OPS; op++) {
+			ops += threads[i].ops[op];
+			bench_lat_free(&threads[i].lat[op]);
+		}
+		misses += threads[i].misses;
+		errors += threads[i].errors;
+		if (threads[i].last_error)
+			last_error = threads[i].last_error;
+	}
+	free(threads);
+
+	bench_summarise(&all, &all_sum);
+	bench_lat_free(&all);
+	ops_per_sec = ops * 1e9 / (t1 - t0);
+	all_sum.nr = ops;
+	all_sum.ops_per_sec = ops_per_sec;
+
+	printf("%7u %12.0f %9llu %9llu %9llu %9lu %9lu\n",
+	       nr_threads, ops_per_sec,
+	       (unsigned long long)all_sum.p50,
+	       (unsigned long long)all_sum.p99,
+	       (unsigned long long)all_sum.p999,
+	       misses, errors);
+	for (op = 0; op < STRESS_NR_OPS; op++) {
+		if (!mix[op])
+			continue;
+		printf("%7s %12.0f %9llu %9llu %9llu\n",
+		       stress_op_names[op], sum[op].ops_per_sec,
+		       (unsigned long long)sum[op].p50,
+		       (unsigned long long)sum[op].p99,
+		       (unsigned long long)sum[op].p999);
+	}
+	if (last_error)
+		printf("  last error: %s\n", strerror(last_error));
+	fflush(stdout);
+
+	if (json) {
+		fprintf(json, "%s\n    { \"threads\": %u, ", first ? "" : ",",
+			nr_threads);
+		bench_json_summary(json, &all_sum);
+		fprintf(json, ", \"misses\": %lu, \"errors\": %lu, \"by_op\": {",
+			misses, errors);
+		for (op = 0; op < STRESS_NR_OPS; op++) {
+			fprintf(json, "%s\n        ", op ? "," : "");
+			bench_json_string(json, stress_op_names[op]);
+			fprintf(json, ": { ");
+			bench_json_summary(json, &sum[op]);
+			fprintf(json, " }");
+		}
+		fprintf(json, "\n      } }");
+	}
+}
+
+/*****************************************************************************/
+/*
+ * run the stress test
+ */
+int main(int argc, char *argv[])
+{
+	struct utsname uts;
+	const char *jsonfile = NULL;
+	FILE *json = NULL;
+	unsigned i;
+	char desc[32], *p;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "t:d:s:k:p:m:a:j:")) != -1) {
+		switch (opt) {
+		case 't':
+			nr_thread_counts = parse_list(optarg, thread_counts, 64);
+			break;
+		case 'd':
+			duration = strtoul(optarg, &p, 0);
+			if (*p || !duration)
+				format();
+			break;
+		case 's':
+			nr_shards = strtoul(optarg, &p, 0);
+			if (*p || !nr_shards)
+				format();
+			break;
+		case 'k':
+			nr_keys = strtoul(optarg, &p, 0);
+			if (*p || !nr_keys)
+				format();
+			break;
+		case 'p':
+			payload_size = strtoul(optarg, &p, 0);
+			if (*p || payload_size > 32767)
+				format();
+			break;
+		case 'm':
+			parse_mix(optarg);
+			break;
+		case 'a':
+			if (strcmp(optarg, "process") == 0)
+				anchor = KEY_SPEC_PROCESS_KEYRING;
+			else if (strcmp(optarg, "session") == 0)
+				anchor = KEY_SPEC_SESSION_KEYRING;
+			else
+				format();
+			break;
+		case 'j':
+			jsonfile = optarg;
+			break;
+		default:
+			format();
+		}
+	}
+	if (optind != argc)
+		format();
+
+	/* keep our keys out of the caller's session keyring */
+	if (keyctl_join_session_keyring(NULL) == -1)
+		error("keyctl_join_session_keyring");
+
+	shards = calloc(nr_shards, sizeof(shards[0]));
+	serials = calloc(nr_keys, sizeof(serials[0]));
+	payload = malloc(payload_size ?: 1);
+	if (!shards || !serials || !payload)
+		error("malloc");
+	memset(payload, 'x', payload_size);
+
+	for (i = 0; i < nr_shards; i++) {
+		sprintf(desc, "stress:shard:%u", i);
+		shards[i] = add_key("keyring", desc, NULL, 0, anchor);
+		if (shards[i] == -1)
+			error("add_key");
+	}
+
+	if (uname(&uts) < 0)
+		error("uname");
+
+	if (jsonfile) {
+		json = fopen(jsonfile, "w");
+		if (!json)
+			error(jsonfile);
+		fprintf(json, "{\n  \"backend\": ");
+		bench_json_string(json, bench_backend());
+		fprintf(json, ",\n  \"kernel\": ");
+		bench_json_string(json, uts.release);
+		fprintf(json, ",\n  \"anchor\": \"%s\", \"shards\": %u, "
+			"\"keys\": %u, \"payload_size\": %u, \"duration\": %u,\n"
+			"  \"mix\": {",
+			anchor == KEY_SPEC_PROCESS_KEYRING ? "process" : "session",
+			nr_shards, nr_keys, payload_size, duration);
+		for (i = 0; i < STRESS_NR_OPS; i++)
+			fprintf(json, "%s \"%s\": %u", i ? "," : "",
+				stress_op_names[i], mix[i]);
+		fprintf(json, " },\n  \"runs\": [");
+	}
+
+	printf("# backend %s, kernel %s, %s keyring, %u shards, %u keys, %us per run\n",
+	       bench_backend(), uts.release,
+	       anchor == KEY_SPEC_PROCESS_KEYRING ? "process" : "session",
+	       nr_shards, nr_keys, duration);
+	printf("%7s %12s %9s %9s %9s %9s %9s\n",
+	       "THREADS", "OPS/S", "P50(ns)", "P99(ns)", "P999(ns)",
+	       "MISSES", "ERRORS");
+
+	for (i = 0; i < nr_thread_counts; i++)
+		stress_run(thread_counts[i], json, i == 0);
+
+	for (i = 0; i < nr_shards; i++) {
+		keyctl_clear(shards[i]);
+		keyctl_unlink(shards[i], anchor);
+	}
+
+	if (json) {
+		fprintf(json, "\n  ]\n}\n");
+		if (fclose(json) == EOF)
+			error(jsonfile);
+	}
+	return 0;
+}
@@ -0,0 +1,153 @@
+/* stats.c: latency sample handling for the keyutils benchmarks
+ *
+ * Copyright (C) 2026 Red Hat, Inc. All Rights Reserved.
+ * Written by agent (agent@local)
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version
+ * 2 of the License, or (at your option) any later version.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "bench.h"
+
+/*****************************************************************************/
+/*
+ * allocate space for up to max samples
+ */
+int bench_lat_init(struct bench_lat *lat, unsigned max)
+{
+	memset(lat, 0, sizeof(*lat));
+	lat->ns = malloc((max ?: 1) * sizeof(lat->ns[0]));
+	if (!lat->ns)
+		return -1;
+	lat->max = max;
+	return 0;
+
+} /* end bench_lat_init() */
+
+/*****************************************************************************/
+/*
+ * release a set of samples
+ */
+void bench_lat_free(struct bench_lat *lat)
+{
+	free(lat->ns);
+	memset(lat, 0, sizeof(*lat));
+
+} /* end bench_lat_free() */
+
+/*****************************************************************************/
+/*
+ * append one set of samples to another, expanding the destination as needed
+ */
+int bench_lat_merge(struct bench_lat *to, const struct bench_lat *from)
+{
+	uint64_t *ns;
+
+	if (to->nr + from->nr > to->max) {
+		ns = realloc(to->ns, (to->nr + from->nr) * sizeof(ns[0]));
+		if (!ns)
+			return -1;
+		to->ns = ns;
+		to->max = to->nr + from->nr;
+	}
+
+	memcpy(to->ns + to->nr, from->ns, from->nr * sizeof(ns[0]));
+	to->nr += from->nr;
+	to->total += from->total;
+	return 0;
+
+} /* end bench_lat_merge() */
+
+static int bench_cmp_ns(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y ? 1 : 0;
+}
+
+/*
+ * nearest-rank percentile of a sorted set of samples, p being in thousandths
+ */
+static uint64_t bench_percentile(const struct bench_lat *lat, unsigned p)
+{
+	unsigned long long rank;
+
+	if (lat->nr == 0)
+		return 0;
+	rank = ((unsigned long long)lat->nr * p + 999) / 1000;
+	return lat->ns[rank ? rank - 1 : 0];
+}
+
+/*****************************************************************************/
+/*
+ * sort the samples and work out the throughput and latency percentiles
+ */
+void bench_summarise(struct bench_lat *lat, struct bench_summary *sum)
+{
+	qsort(lat->ns, lat->nr, sizeof(lat->ns[0]), bench_cmp_ns);
+
+	sum->nr = lat->nr;
+	sum->ops_per_sec = lat->total ? lat->nr * 1e9 / lat->total : 0;
+	sum->p50 = bench_percentile(lat, 500);
+	sum->p99 = bench_percentile(lat, 990);
+	sum->p999 = bench_percentile(lat, 999);
+	sum->max = lat->nr ? lat->ns[lat->nr - 1] : 0;
+
+} /* end bench_summarise() */
+
+/*****************************************************************************/
+/*
+ * say whether we're running against the kernel or the userspace emulation
+ */
+const char *bench_backend(void)
+{
+	const char *preload = getenv("LD_PRELOAD");
+
+	if (preload && strstr(preload, "keyutils-fake"))
+		return "fake";
+	return "kernel";
+
+} /* end bench_backend() */
+
+/*****************************************************************************/
+/*
+ * write a string to a JSON file
+ */
+void bench_json_string(FILE *f, const char *s)
+{
+	fputc('"', f);
+	for (; *s; s++) {
+		unsigned char c = *s;
+
+		if (c == '"' || c == '\\')
+			fprintf(f, "\\%c", c);
+		else if (c < 0x20)
+			fprintf(f, "\\u%04x", c);
+		else
+			fputc(c, f);
+	}
+	fputc('"', f);
+
+} /* end bench_json_string() */
+
+/*****************************************************************************/
+/*
+ * write the members describing a summary to a JSON object
+ */
+void bench_json_summary(FILE *f, const struct bench_summary *sum)
+{
+	fprintf(f, "\"ops\": %u, \"ops_per_sec\": %.1f, "
+		"\"p50_ns\": %llu, \"p99_ns\": %llu, \"p999_ns\": %llu, "
+		"\"max_ns\": %llu",
+		sum->nr, sum->ops_per_sec,
+		(unsigned long long)sum->p50,
+		(unsigned long long)sum->p99,
+		(unsigned long long)sum->p999,
+		(unsigned long long)sum->max);
+
+} /* end bench_json_summary() */
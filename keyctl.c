@@ -393,8 +393,6 @@ static void act_keyctl_add(int argc, char *argv[])
 static void act_keyctl_padd(int argc, char *argv[])
 {
 	key_serial_t dest;
-	size_t datalen;
-	void *data;
 	int ret;
 
 
@@ -403,9 +401,7 @@ static void act_keyctl_padd(int argc, char *argv[])
 
 	dest = get_key_id(argv[3]);
 
-	data = grab_stdin(&datalen);
-
-	ret = add_key(argv[1], argv[2], data, datalen, dest);
+	ret = add_key_from_fd(argv[1], argv[2], 0, dest);
 	if (ret < 0)
 		error("add_key");
 
@@ -518,16 +514,13 @@ static void act_keyctl_update(int argc, char *argv[])
 static void act_keyctl_pupdate(int argc, char *argv[])
 {
 	key_serial_t key;
-	size_t datalen;
-	void *data;
 
 	if (argc != 2)
 		format();
 
 	key = get_key_id(argv[1]);
-	data = grab_stdin(&datalen);
 
-	if (keyctl_update(key, data, datalen) < 0)
+	if (keyctl_update_from_fd(key, 0) < 0)
 		error("keyctl_update");
 
 	exit(0);
@@ -649,7 +642,10 @@ static void act_keyctl_unlink(int argc, char *argv[])
 		if (keyctl_unlink(key, keyring) < 0)
 			error("keyctl_unlink");
 	} else {
-		n = recursive_session_key_scan(act_keyctl_unlink_func, &key);
+		n = keyctl_scan_tree(KEY_SPEC_SESSION_KEYRING, 0,
+				     act_keyctl_unlink_func, &key);
+		if (n < 0)
+			error("keyctl_scan_tree");
 		printf("%d links removed\n", n);
 	}
 
@@ -746,8 +742,6 @@ static void act_keyctl_read(int argc, char *argv[])
 static void act_keyctl_pipe(int argc, char *argv[])
 {
 	key_serial_t key;
-	void *buffer;
-	int ret;
 
 	if (argc != 2)
 		format();
@@ -755,12 +749,8 @@ static void act_keyctl_pipe(int argc, char *argv[])
 	key = get_key_id(argv[1]);
 
 	/* read the key payload data */
-	ret = keyctl_read_alloc(key, &buffer);
-	if (ret < 0)
-		error("keyctl_read_alloc");
-
-	if (ret > 0 && write(1, buffer, ret) < 0)
-		error("write");
+	if (keyctl_read_to_fd(key, 1, 0) < 0)
+		error("keyctl_read_to_fd");
 	exit(0);
 
 } /* end act_keyctl_pipe() */
@@ -813,13 +803,12 @@ not_printable:
  */
 static void act_keyctl_list(int argc, char *argv[])
 {
+	struct keyctl_key_desc parsed;
 	key_serial_t keyring, key, *pk;
-	key_perm_t perm;
 	void *keylist;
-	char *buffer, pretty_mask[9];
-	uid_t uid;
-	gid_t gid;
-	int count, tlen, dpos, n, ret;
+	char *buffer = NULL, pretty_mask[9];
+	size_t buflen = 0;
+	int count, ret;
 
 	if (argc != 2)
 		format();
@@ -848,39 +837,30 @@ static void act_keyctl_list(int argc, char *argv[])
 	do {
 		key = *pk++;
 
-		ret = keyctl_describe_alloc(key, &buffer);
+		ret = keyctl_describe_reuse(key, &buffer, &buflen);
 		if (ret < 0) {
 			printf("%9d: key inaccessible (%m)\n", key);
 			continue;
 		}
 
-		uid = 0;
-		gid = 0;
-		perm = 0;
-
-		tlen = -1;
-		dpos = -1;
-
-		n = sscanf((char *) buffer, "%*[^;]%n;%d;%d;%x;%n",
-			   &tlen, &uid, &gid, &perm, &dpos);
-		if (n != 3) {
+		if (keyctl_parse_description(buffer, ret, &parsed) < 0) {
 			fprintf(stderr, "Unparseable description obtained for key %d\n", key);
 			exit(3);
 		}
 
-		calc_perms(pretty_mask, perm, uid, gid);
+		calc_perms(pretty_mask, parsed.perm, parsed.uid, parsed.gid);
 
 		printf("%9d: %s %5d %5d %*.*s: %s\n",
 		       key,
 		       pretty_mask,
-		       uid, gid,
-		       tlen, tlen, buffer,
-		       buffer + dpos);
-
-		free(buffer);
+		       parsed.uid, parsed.gid,
+		       parsed.type_len, parsed.type_len, parsed.type,
+		       parsed.desc);
 
 	} while (--count);
 
+	free(buffer);
+
 	exit(0);
 
 } /* end act_keyctl_list() */
@@ -929,12 +909,11 @@ static void act_keyctl_rlist(int argc, char *argv[])
  */
 static void act_keyctl_describe(int argc, char *argv[])
 {
+	struct keyctl_key_desc parsed;
 	key_serial_t key;
 	key_perm_t perm;
 	char *buffer;
-	uid_t uid;
-	gid_t gid;
-	int tlen, dpos, n, ret;
+	int ret;
 
 	if (argc != 2)
 		format();
@@ -947,19 +926,11 @@ static void act_keyctl_describe(int argc, char *argv[])
 		error("keyctl_describe");
 
 	/* parse it */
-	uid = 0;
-	gid = 0;
-	perm = 0;
-
-	tlen = -1;
-	dpos = -1;
-
-	n = sscanf(buffer, "%*[^;]%n;%d;%d;%x;%n",
-		   &tlen, &uid, &gid, &perm, &dpos);
-	if (n != 3) {
+	if (keyctl_parse_description(buffer, ret, &parsed) < 0) {
 		fprintf(stderr, "Unparseable description obtained for key %d\n", key);
 		exit(3);
 	}
+	perm = parsed.perm;
 
 	/* display it */
 	printf("%9d:"
@@ -993,9 +964,9 @@ static void act_keyctl_describe(int argc, char *argv[])
 	       perm & KEY_OTH_WRITE	? 'w' : '-',
 	       perm & KEY_OTH_READ	? 'r' : '-',
 	       perm & KEY_OTH_VIEW	? 'v' : '-',
-	       uid, gid,
-	       tlen, tlen, buffer,
-	       buffer + dpos);
+	       parsed.uid, parsed.gid,
+	       parsed.type_len, parsed.type_len, parsed.type,
+	       parsed.desc);
 
 	exit(0);
 
@@ -1194,17 +1165,14 @@ static void act_keyctl_instantiate(int argc, char *argv[])
 static void act_keyctl_pinstantiate(int argc, char *argv[])
 {
 	key_serial_t key, dest;
-	size_t datalen;
-	void *data;
 
 	if (argc != 3)
 		format();
 
 	key = get_key_id(argv[1]);
 	dest = get_key_id(argv[2]);
-	data = grab_stdin(&datalen);
 
-	if (keyctl_instantiate(key, data, datalen, dest) < 0)
+	if (keyctl_instantiate_from_fd(key, 0, dest) < 0)
 		error("keyctl_instantiate");
 
 	exit(0);
@@ -1402,7 +1370,10 @@ static void act_keyctl_reap(int argc, char *argv[])
 	if (argc != 1)
 		format();
 
-	n = recursive_session_key_scan(act_keyctl_reap_func, NULL);
+	n = keyctl_scan_tree(KEY_SPEC_SESSION_KEYRING, 0,
+			     act_keyctl_reap_func, NULL);
+	if (n < 0)
+		error("keyctl_scan_tree");
 	printf("%d keys reaped\n", n);
 	exit(0);
 }
@@ -1569,7 +1540,9 @@ static void act_keyctl_purge(int argc, char *argv[])
 		format();
 	}
 
-	n = recursive_session_key_scan(func, &purge);
+	n = keyctl_scan_tree(KEY_SPEC_SESSION_KEYRING, 0, func, &purge);
+	if (n < 0)
+		error("keyctl_scan_tree");
 	printf("purged %d keys\n", n);
 	exit(0);
 }
@@ -1700,12 +1673,12 @@ incorrect_key_by_name_spec:
 static int dump_key_tree_aux(key_serial_t key, int depth, int more, int hex_key_IDs)
 {
 	static char dumpindent[64];
+	struct keyctl_key_desc parsed;
 	key_serial_t *pk;
-	key_perm_t perm;
 	size_t ringlen;
 	void *payload;
-	char *desc, type[255], pretty_mask[9];
-	int uid, gid, ret, n, dpos, rdepth, kcount = 0;
+	char *desc, pretty_mask[9];
+	int ret, rdepth, kcount = 0;
 
 	if (depth > 8 * 4)
 		return 0;
@@ -1718,44 +1691,38 @@ static int dump_key_tree_aux(key_serial_t key, int depth, int more, int hex_key_
 	}
 
 	/* parse */
-	type[0] = 0;
-	uid = 0;
-	gid = 0;
-	perm = 0;
-
-	n = sscanf(desc, "%[^;];%d;%d;%x;%n",
-		   type, &uid, &gid, &perm, &dpos);
-
-	if (n != 4) {
+	if (keyctl_parse_description(desc, ret, &parsed) < 0) {
 		fprintf(stderr, "Unparseable description obtained for key %d\n", key);
 		exit(3);
 	}
 
 	/* and print */
-	calc_perms(pretty_mask, perm, uid, gid);
+	calc_perms(pretty_mask, parsed.perm, parsed.uid, parsed.gid);
 
 	if (hex_key_IDs)
-		printf("0x%08x %s  %5d %5d  %s%s%s: %s\n",
+		printf("0x%08x %s  %5d %5d  %s%s%*.*s: %s\n",
 		       key,
 		       pretty_mask,
-		       uid, gid,
+		       parsed.uid, parsed.gid,
 		       dumpindent,
 		       depth > 0 ? "\\_ " : "",
-		       type, desc + dpos);
+		       parsed.type_len, parsed.type_len, parsed.type,
+		       parsed.desc);
 	else
-		printf("%10d %s  %5d %5d  %s%s%s: %s\n",
+		printf("%10d %s  %5d %5d  %s%s%*.*s: %s\n",
 		       key,
 		       pretty_mask,
-		       uid, gid,
+		       parsed.uid, parsed.gid,
 		       dumpindent,
 		       depth > 0 ? "\\_ " : "",
-		       type, desc + dpos);
+		       parsed.type_len, parsed.type_len, parsed.type,
+		       parsed.desc);
 
 	free(desc);
 
 	/* if it's a keyring then we're going to want to recursively
 	 * display it if we can */
-	if (strcmp(type, "keyring") == 0) {
+	if (parsed.type_id == KEY_TYPE_KEYRING) {
 		/* find out how big the keyring is */
 		ret = keyctl_read(key, NULL, 0);
 		if (ret < 0)
@@ -1782,7 +1749,7 @@ static int dump_key_tree_aux(key_serial_t key, int depth, int more, int hex_key_
 			key = *pk++;
 
 			/* recurse into nexted keyrings */
-			if (strcmp(type, "keyring") == 0) {
+			if (parsed.type_id == KEY_TYPE_KEYRING) {
 				if (depth == 0) {
 					rdepth = depth;
 					dumpindent[rdepth++] = ' ';
@@ -1823,7 +1790,7 @@ static int dump_key_tree(key_serial_t keyring, const char *name, int hex_key_IDs
 {
 	printf("%s\n", name);
 
-	keyring = keyctl_get_keyring_ID(keyring, 0);
+	keyring = keyctl_get_keyring_ID_cached(keyring, 0);
 	if (keyring == -1)
 		error("Unable to dump key");
 
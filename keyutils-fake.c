@@ -0,0 +1,2333 @@
+/* keyutils-fake.c: userspace emulation of the kernel key management facility
+ *
+ * Copyright (C) 2026 Red Hat, Inc. All Rights Reserved.
+ * Written by agent (agent@local)
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation; either version
+ * 2 of the License, or (at your option) any later version.
+ *
+ * This provides add_key(), request_key(), keyctl() and
+ * keyctl_proc_keys_iterate() in place of the ones in libkeyutils so that the
+ * library and the tools built on it can be run and benchmarked without going
+ * anywhere near the kernel.  Preload it with LD_PRELOAD or link it ahead of
+ * libkeyutils.
+ *
+ * The keys are held in the memory of the process by default.  If
+ * KEYUTILS_FAKE_STATE names a file, they are kept in that file instead, under
+ * flock(), so that a tree of processes (such as the testsuite) can share them.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <pthread.h>
+#include <time.h>
+#include <errno.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include "keyutils.h"
+
+#define FAKE_MAX_TYPE_LEN	31
+#define FAKE_MAX_DESC_LEN	4095		/* PAGE_SIZE - 1 */
+#define FAKE_MAX_PAYLOAD	(1024 * 1024 - 1)
+#define FAKE_MAX_DEPTH		6		/* KEYRING_SEARCH_MAX_DEPTH */
+#define FAKE_SERIAL_BASE	0x10000000
+#define FAKE_BIG_KEY_FILE	1024		/* big_key goes to shmem above this */
+#define FAKE_INVALID_ID		((unsigned)-1)
+#define FAKE_OVERFLOW_ID	65534		/* what the kernel shows for -1 */
+
+#define KEY_SPEC_REQUESTOR_KEYRING	-8
+#define KEY_REQKEY_DEFL_REQUESTOR_KEYRING 7
+
+/* the permission bits, as shifted down into the bottom byte */
+#define KEY_NEED_VIEW		0x01
+#define KEY_NEED_READ		0x02
+#define KEY_NEED_WRITE		0x04
+#define KEY_NEED_SEARCH		0x08
+#define KEY_NEED_LINK		0x10
+#define KEY_NEED_SETATTR	0x20
+
+#define FAKE_LOOKUP_CREATE	0x01
+#define FAKE_LOOKUP_PARTIAL	0x02
+#define FAKE_LOOKUP_FOR_UNLINK	0x04
+
+#define FAKE_KEY_REVOKED	0x01
+#define FAKE_KEY_INVALIDATED	0x02
+#define FAKE_KEY_UID_KEYRING	0x04		/* _uid.N or _uid_ses.N */
+
+struct fake_type {
+	const char	*name;
+	size_t		max_plen;	/* 0 if no payload is permitted */
+	unsigned	is_keyring : 1;
+	unsigned	can_read : 1;
+	unsigned	can_update : 1;
+	unsigned	need_prefix : 1; /* description must be "<prefix>:..." */
+};
+
+static const struct fake_type fake_types[] = {
+	{ .name = "keyring",	.is_keyring = 1, .can_read = 1 },
+	{ .name = "user",	.max_plen = 32767,
+	  .can_read = 1, .can_update = 1 },
+	{ .name = "logon",	.max_plen = 32767,
+	  .can_update = 1, .need_prefix = 1 },
+	{ .name = "big_key",	.max_plen = FAKE_MAX_PAYLOAD,
+	  .can_read = 1, .can_update = 1 },
+};
+
+#define FAKE_NR_TYPES (sizeof(fake_types) / sizeof(fake_types[0]))
+
+struct fake_key;
+
+struct fake_link {
+	struct fake_key		*key;
+	struct fake_link	*hash_next;	/* next in the keyring's hash chain */
+	struct fake_link	*prev, *next;	/* keyring contents in link order */
+	struct fake_link	*nest_prev, *nest_next; /* nested keyrings only */
+};
+
+struct fake_key {
+	key_serial_t		serial;
+	const struct fake_type	*type;
+	char			*desc;
+	size_t			desc_len;
+	void			*payload;
+	size_t			plen;
+	uid_t			uid;
+	gid_t			gid;
+	key_perm_t		perm;
+	unsigned		flags;		/* FAKE_KEY_* */
+	time_t			expiry;		/* 0 if it doesn't expire */
+	unsigned		usage;		/* links and bindings */
+	uint32_t		hash;		/* hash of type and description */
+	unsigned		mark;		/* last search to visit this */
+	int			mark_depth;	/* shallowest depth it visited at */
+	struct fake_key		*serial_next;	/* next in the serial hash chain */
+	struct fake_key		*prev, *next;	/* all keys in serial order */
+
+	/* keyrings only */
+	struct fake_link	**slots;
+	unsigned		mask;
+	unsigned		nr_links;
+	struct fake_link	*first, *last;
+	struct fake_link	*nested, *nested_last;
+};
+
+/*
+ * The keyrings that the processes are attached to.  The user keyrings are
+ * bound to the UID, the session keyring to the process that joined it (and is
+ * found by walking up the process tree), and the process and thread keyrings
+ * to the PID and TID respectively.
+ */
+enum fake_bind_kind {
+	FAKE_BIND_USER,
+	FAKE_BIND_USER_SESSION,
+	FAKE_BIND_SESSION,
+	FAKE_BIND_PROCESS,
+	FAKE_BIND_THREAD,
+};
+
+struct fake_binding {
+	unsigned		kind;
+	unsigned		id;		/* UID, PID or TID */
+	struct fake_key		*key;
+};
+
+struct fake_user {
+	uid_t			uid;
+	unsigned		nkeys;
+	size_t			nbytes;
+};
+
+struct fake_search {
+	const struct fake_type	*type;
+	const char		*desc;
+	size_t			desc_len;
+	uint32_t		hash;
+	struct fake_key		*match;		/* particular key wanted or NULL */
+	int			possessed;
+	int			state_check;	/* skip revoked and expired keys */
+	int			error;		/* error to give if not found */
+	unsigned		mark;
+};
+
+static struct {
+	pthread_mutex_t		lock;
+	int			state_fd;
+	const char		*state_file;
+	uint64_t		generation;	/* of the state we have loaded */
+	int			dirty;
+	time_t			now;
+
+	pid_t			pid;
+	uid_t			uid;
+	gid_t			gid;
+	gid_t			*groups;
+	int			nr_groups;
+	unsigned		maxkeys, rootmaxkeys;
+	size_t			maxbytes, rootmaxbytes;
+
+	struct fake_key		**serial_slots;
+	unsigned		serial_mask;
+	unsigned		nr_keys;
+	struct fake_key		*first, *last;
+	key_serial_t		next_serial;
+	unsigned		mark;
+	struct fake_key		*gc;		/* keys awaiting destruction */
+
+	struct fake_binding	*bindings;
+	unsigned		nr_bindings, max_bindings;
+	unsigned		bind_version;
+	unsigned		session_version; /* bind_version of session cache */
+	pid_t			session_pid;
+	struct fake_key		*session;
+
+	struct fake_user	*users;
+	unsigned		nr_users, max_users;
+} fake = {
+	.lock		= PTHREAD_MUTEX_INITIALIZER,
+	.state_fd	= -1,
+	.next_serial	= FAKE_SERIAL_BASE,
+	.maxkeys	= 200,
+	.maxbytes	= 20000,
+	.rootmaxkeys	= 1000000,
+	.rootmaxbytes	= 25000000,
+};
+
+static pthread_once_t fake_once = PTHREAD_ONCE_INIT;
+static pthread_key_t fake_thread_key;
+static __thread pid_t fake_tid;
+static __thread int fake_reqkey_defl;
+
+static void fake_unbind(unsigned kind, unsigned id);
+static void fake_gc(void);
+
+/*****************************************************************************/
+/*
+ * hash a key's type and description
+ */
+static uint32_t fake_hash(const struct fake_type *type,
+			  const char *desc, size_t desc_len)
+{
+	const unsigned char *p;
+	uint32_t h = 2166136261U;
+
+	for (p = (const unsigned char *)type->name; *p; p++)
+		h = (h ^ *p) * 16777619U;
+	h = (h ^ 0) * 16777619U;
+	for (p = (const unsigned char *)desc; desc_len > 0; desc_len--, p++)
+		h = (h ^ *p) * 16777619U;
+	return h;
+}
+
+static pid_t fake_gettid(void)
+{
+	if (!fake_tid)
+		fake_tid = syscall(SYS_gettid);
+	return fake_tid;
+}
+
+static int fake_in_group(gid_t gid)
+{
+	int loop;
+
+	if (gid == fake.gid)
+		return 1;
+	for (loop = 0; loop < fake.nr_groups; loop++)
+		if (fake.groups[loop] == gid)
+			return 1;
+	return 0;
+}
+
+static unsigned fake_munge(unsigned id)
+{
+	return id == FAKE_INVALID_ID ? FAKE_OVERFLOW_ID : id;
+}
+
+/*
+ * work out what the caller may do to a key
+ */
+static unsigned fake_perm(const struct fake_key *key, int possessed)
+{
+	key_perm_t kperm;
+
+	if (key->uid == fake.uid)
+		kperm = key->perm >> 16;
+	else if (key->gid != FAKE_INVALID_ID &&
+		 key->perm & KEY_GRP_ALL &&
+		 fake_in_group(key->gid))
+		kperm = key->perm >> 8;
+	else
+		kperm = key->perm;
+
+	if (possessed)
+		kperm |= key->perm >> 24;
+	return kperm & KEY_OTH_ALL;
+}
+
+/*
+ * check that a key is still usable
+ */
+static int fake_key_validate(const struct fake_key *key)
+{
+	if (key->flags & FAKE_KEY_INVALIDATED)
+		return -ENOKEY;
+	if (key->flags & FAKE_KEY_REVOKED)
+		return -EKEYREVOKED;
+	if (key->expiry && fake.now >= key->expiry)
+		return -EKEYEXPIRED;
+	return 0;
+}
+
+/*****************************************************************************/
+/*
+ * charge or refund a user's key quota
+ * - charges are only checked against the limits if check is set
+ */
+static int fake_quota(uid_t uid, int nkeys, ssize_t nbytes, int check)
+{
+	struct fake_user *u, *tmp;
+	unsigned loop, maxkeys;
+	size_t maxbytes;
+
+	for (loop = 0; loop < fake.nr_users; loop++)
+		if (fake.users[loop].uid == uid)
+			goto found;
+
+	if (fake.nr_users >= fake.max_users) {
+		unsigned max = fake.max_users ? fake.max_users * 2 : 8;
+
+		tmp = realloc(fake.users, max * sizeof(*tmp));
+		if (!tmp)
+			return -ENOMEM;
+		fake.users = tmp;
+		fake.max_users = max;
+	}
+	loop = fake.nr_users++;
+	memset(&fake.users[loop], 0, sizeof(fake.users[loop]));
+	fake.users[loop].uid = uid;
+
+found:
+	u = &fake.users[loop];
+	maxkeys = uid == 0 ? fake.rootmaxkeys : fake.maxkeys;
+	maxbytes = uid == 0 ? fake.rootmaxbytes : fake.maxbytes;
+	if (check &&
+	    ((nkeys > 0 && u->nkeys + nkeys > maxkeys) ||
+	     (nbytes > 0 && u->nbytes + nbytes > maxbytes)))
+		return -EDQUOT;
+	u->nkeys += nkeys;
+	u->nbytes += nbytes;
+	return 0;
+}
+
+static ssize_t fake_quota_len(const struct fake_key *key)
+{
+	return key->desc_len + 1 + key->plen;
+}
+
+/*****************************************************************************/
+/*
+ * find a key by serial number
+ */
+static struct fake_key *fake_find_serial(key_serial_t serial)
+{
+	struct fake_key *key;
+
+	if (!fake.serial_slots)
+		return NULL;
+	for (key = fake.serial_slots[serial & fake.serial_mask];
+	     key;
+	     key = key->serial_next)
+		if (key->serial == serial)
+			return key;
+	return NULL;
+}
+
+static int fake_serial_insert(struct fake_key *key)
+{
+	struct fake_key **slots, *k, *next;
+	unsigned loop, size;
+
+	if (fake.nr_keys >= fake.serial_mask) {
+		size = fake.serial_slots ? (fake.serial_mask + 1) * 2 : 256;
+		slots = calloc(size, sizeof(*slots));
+		if (!slots)
+			return -ENOMEM;
+		if (fake.serial_slots) {
+			for (loop = 0; loop <= fake.serial_mask; loop++) {
+				for (k = fake.serial_slots[loop]; k; k = next) {
+					next = k->serial_next;
+					k->serial_next = slots[k->serial & (size - 1)];
+					slots[k->serial & (size - 1)] = k;
+				}
+			}
+			free(fake.serial_slots);
+		}
+		fake.serial_slots = slots;
+		fake.serial_mask = size - 1;
+	}
+
+	key->serial_next = fake.serial_slots[key->serial & fake.serial_mask];
+	fake.serial_slots[key->serial & fake.serial_mask] = key;
+	fake.nr_keys++;
+
+	/* keep the list in serial order for /proc/keys */
+	key->next = NULL;
+	key->prev = fake.last;
+	if (fake.last)
+		fake.last->next = key;
+	else
+		fake.first = key;
+	fake.last = key;
+	return 0;
+}
+
+static void fake_serial_remove(struct fake_key *key)
+{
+	struct fake_key **pp;
+
+	for (pp = &fake.serial_slots[key->serial & fake.serial_mask];
+	     *pp;
+	     pp = &(*pp)->serial_next) {
+		if (*pp == key) {
+			*pp = key->serial_next;
+			break;
+		}
+	}
+	fake.nr_keys--;
+
+	if (key->prev)
+		key->prev->next = key->next;
+	else
+		fake.first = key->next;
+	if (key->next)
+		key->next->prev = key->prev;
+	else
+		fake.last = key->prev;
+}
+
+/*****************************************************************************/
+/*
+ * find the link in a keyring to a key of the given type and description
+ */
+static struct fake_link *fake_ring_find(const struct fake_key *ring,
+					const struct fake_type *type,
+					const char *desc, size_t desc_len,
+					uint32_t hash)
+{
+	struct fake_link *link;
+	struct fake_key *key;
+
+	if (!ring->slots)
+		return NULL;
+	for (link = ring->slots[hash & ring->mask]; link; link = link->hash_next) {
+		key = link->key;
+		if (key->hash == hash &&
+		    key->type == type &&
+		    key->desc_len == desc_len &&
+		    memcmp(key->desc, desc, desc_len) == 0)
+			return link;
+	}
+	return NULL;
+}
+
+static int fake_ring_grow(struct fake_key *ring)
+{
+	struct fake_link **slots, *link;
+	unsigned size;
+
+	size = ring->slots ? (ring->mask + 1) * 2 : 16;
+	slots = calloc(size, sizeof(*slots));
+	if (!slots)
+		return -ENOMEM;
+	for (link = ring->first; link; link = link->next) {
+		link->hash_next = slots[link->key->hash & (size - 1)];
+		slots[link->key->hash & (size - 1)] = link;
+	}
+	free(ring->slots);
+	ring->slots = slots;
+	ring->mask = size - 1;
+	return 0;
+}
+
+/*
+ * drop a usage count on a key, queuing it for destruction on the last
+ */
+static void fake_key_put(struct fake_key *key)
+{
+	if (--key->usage > 0)
+		return;
+	fake_serial_remove(key);
+	key->next = fake.gc;
+	fake.gc = key;
+}
+
+/*
+ * link a key into a keyring, displacing any key of the same type and
+ * description that's already there
+ */
+static int fake_ring_link(struct fake_key *ring, struct fake_key *key)
+{
+	struct fake_link *link;
+	struct fake_key *old;
+	int ret;
+
+	link = fake_ring_find(ring, key->type, key->desc, key->desc_len,
+			      key->hash);
+	if (link) {
+		if (link->key == key)
+			return 0;
+		old = link->key;
+		link->key = key;
+		key->usage++;
+		fake_key_put(old);
+		fake.dirty = 1;
+		return 0;
+	}
+
+	if (ring->nr_links > ring->mask || !ring->slots) {
+		ret = fake_ring_grow(ring);
+		if (ret < 0)
+			return ret;
+	}
+
+	link = calloc(1, sizeof(*link));
+	if (!link)
+		return -ENOMEM;
+	link->key = key;
+	link->hash_next = ring->slots[key->hash & ring->mask];
+	ring->slots[key->hash & ring->mask] = link;
+
+	link->prev = ring->last;
+	if (ring->last)
+		ring->last->next = link;
+	else
+		ring->first = link;
+	ring->last = link;
+
+	if (key->type->is_keyring) {
+		link->nest_prev = ring->nested_last;
+		if (ring->nested_last)
+			ring->nested_last->nest_next = link;
+		else
+			ring->nested = link;
+		ring->nested_last = link;
+	}
+
+	ring->nr_links++;
+	key->usage++;
+	fake.dirty = 1;
+	return 0;
+}
+
+/*
+ * remove a link from a keyring
+ */
+static void fake_ring_unlink(struct fake_key *ring, struct fake_link *link)
+{
+	struct fake_link **pp;
+
+	for (pp = &ring->slots[link->key->hash & ring->mask];
+	     *pp;
+	     pp = &(*pp)->hash_next) {
+		if (*pp == link) {
+			*pp = link->hash_next;
+			break;
+		}
+	}
+
+	if (link->prev)
+		link->prev->next = link->next;
+	else
+		ring->first = link->next;
+	if (link->next)
+		link->next->prev = link->prev;
+	else
+		ring->last = link->prev;
+
+	if (link->key->type->is_keyring) {
+		if (link->nest_prev)
+			link->nest_prev->nest_next = link->nest_next;
+		else
+			ring->nested = link->nest_next;
+		if (link->nest_next)
+			link->nest_next->nest_prev = link->nest_prev;
+		else
+			ring->nested_last = link->nest_prev;
+	}
+
+	ring->nr_links--;
+	fake_key_put(link->key);
+	free(link);
+	fake.dirty = 1;
+}
+
+static void fake_ring_clear(struct fake_key *ring)
+{
+	while (ring->first)
+		fake_ring_unlink(ring, ring->first);
+}
+
+/*
+ * see if linking a keyring into another would create a cycle
+ * - we give up if the keyrings nest too deeply
+ */
+static int fake_ring_cycle(const struct fake_key *from,
+			   const struct fake_key *target, int depth)
+{
+	struct fake_link *link;
+	int ret;
+
+	link = fake_ring_find(from, target->type, target->desc,
+			      target->desc_len, target->hash);
+	if (link && link->key == target)
+		return -EDEADLK;
+
+	for (link = from->nested; link; link = link->nest_next) {
+		if (depth + 1 > FAKE_MAX_DEPTH)
+			return -ELOOP;
+		ret = fake_ring_cycle(link->key, target, depth + 1);
+		if (ret < 0)
+			return ret;
+	}
+	return 0;
+}
+
+static int fake_link_key(struct fake_key *ring, struct fake_key *key)
+{
+	int ret;
+
+	if (!ring->type->is_keyring)
+		return -ENOTDIR;
+	ret = fake_key_validate(ring);
+	if (ret < 0)
+		return ret;
+
+	if (key->type->is_keyring) {
+		if (key == ring)
+			return -EDEADLK;
+		ret = fake_ring_cycle(key, ring, 0);
+		if (ret < 0)
+			return ret;
+	}
+	return fake_ring_link(ring, key);
+}
+
+/*****************************************************************************/
+/*
+ * allocate a new key
+ * - a serial number is assigned if one isn't supplied
+ * - the quota is only enforced if check is set
+ */
+static struct fake_key *fake_key_alloc(key_serial_t serial,
+				       const struct fake_type *type,
+				       const char *desc, size_t desc_len,
+				       const void *payload, size_t plen,
+				       uid_t uid, gid_t gid, key_perm_t perm,
+				       int check, int *_error)
+{
+	struct fake_key *key;
+	int ret;
+
+	key = calloc(1, sizeof(*key));
+	if (!key)
+		goto nomem;
+	key->desc = malloc(desc_len + 1);
+	if (!key->desc)
+		goto nomem_key;
+	memcpy(key->desc, desc, desc_len);
+	key->desc[desc_len] = '\0';
+	key->desc_len = desc_len;
+	if (plen) {
+		key->payload = malloc(plen);
+		if (!key->payload)
+			goto nomem_desc;
+		memcpy(key->payload, payload, plen);
+		key->plen = plen;
+	}
+
+	key->type = type;
+	key->uid = uid;
+	key->gid = gid;
+	key->perm = perm;
+	key->hash = fake_hash(type, desc, desc_len);
+
+	ret = fake_quota(uid, 1, fake_quota_len(key), check);
+	if (ret < 0)
+		goto error;
+
+	key->serial = serial;
+	if (!key->serial) {
+		do {
+			key->serial = fake.next_serial++;
+			if (fake.next_serial <= 0)
+				fake.next_serial = FAKE_SERIAL_BASE;
+		} while (fake_find_serial(key->serial));
+	}
+
+	ret = fake_serial_insert(key);
+	if (ret < 0) {
+		fake_quota(uid, -1, -fake_quota_len(key), 0);
+		goto error;
+	}
+	fake.dirty = 1;
+	return key;
+
+nomem_desc:
+	ret = -ENOMEM;
+error:
+	free(key->payload);
+	free(key->desc);
+	free(key);
+	*_error = ret;
+	return NULL;
+nomem_key:
+	free(key);
+nomem:
+	*_error = -ENOMEM;
+	return NULL;
+}
+
+/*
+ * destroy the keys that have lost their last usage
+ * - this is done iteratively as destroying a keyring may release more keys
+ */
+static void fake_gc(void)
+{
+	struct fake_key *key;
+
+	while ((key = fake.gc)) {
+		fake.gc = key->next;
+		fake_ring_clear(key);
+		fake_quota(key->uid, -1, -fake_quota_len(key), 0);
+		free(key->slots);
+		free(key->payload);
+		free(key->desc);
+		free(key);
+		fake.dirty = 1;
+	}
+}
+
+/*
+ * replace a key's payload
+ */
+static int fake_key_set_payload(struct fake_key *key,
+				const void *payload, size_t plen)
+{
+	void *p = NULL;
+	int ret;
+
+	ret = fake_quota(key->uid, 0, (ssize_t)plen - (ssize_t)key->plen, 1);
+	if (ret < 0)
+		return ret;
+	if (plen) {
+		p = malloc(plen);
+		if (!p) {
+			fake_quota(key->uid, 0, (ssize_t)key->plen - (ssize_t)plen, 0);
+			return -ENOMEM;
+		}
+		memcpy(p, payload, plen);
+	}
+	free(key->payload);
+	key->payload = p;
+	key->plen = plen;
+	fake.dirty = 1;
+	return 0;
+}
+
+/*****************************************************************************/
+/*
+ * find the keyring bound to a UID, process or thread
+ */
+static struct fake_binding *fake_find_binding(unsigned kind, unsigned id)
+{
+	unsigned loop;
+
+	for (loop = 0; loop < fake.nr_bindings; loop++)
+		if (fake.bindings[loop].kind == kind &&
+		    fake.bindings[loop].id == id)
+			return &fake.bindings[loop];
+	return NULL;
+}
+
+static int fake_bind(unsigned kind, unsigned id, struct fake_key *key)
+{
+	struct fake_binding *b, *tmp;
+
+	b = fake_find_binding(kind, id);
+	if (!b) {
+		if (fake.nr_bindings >= fake.max_bindings) {
+			unsigned max = fake.max_bindings ?
+				fake.max_bindings * 2 : 16;
+
+			tmp = realloc(fake.bindings, max * sizeof(*tmp));
+			if (!tmp)
+				return -ENOMEM;
+			fake.bindings = tmp;
+			fake.max_bindings = max;
+		}
+		b = &fake.bindings[fake.nr_bindings++];
+		b->kind = kind;
+		b->id = id;
+		b->key = NULL;
+	}
+
+	key->usage++;
+	if (b->key)
+		fake_key_put(b->key);
+	b->key = key;
+	fake.bind_version++;
+	fake.dirty = 1;
+	return 0;
+}
+
+static void fake_unbind(unsigned kind, unsigned id)
+{
+	struct fake_binding *b;
+	struct fake_key *key;
+
+	b = fake_find_binding(kind, id);
+	if (!b)
+		return;
+	key = b->key;
+	*b = fake.bindings[--fake.nr_bindings];
+	fake_key_put(key);
+	fake.bind_version++;
+	fake.dirty = 1;
+}
+
+/*
+ * create a keyring and bind it
+ */
+static struct fake_key *fake_new_anchor(unsigned kind, unsigned id,
+					const char *desc, uid_t uid, gid_t gid,
+					key_perm_t perm, int *_error)
+{
+	struct fake_key *key;
+	int ret;
+
+	key = fake_key_alloc(0, &fake_types[0], desc, strlen(desc), NULL, 0,
+			     uid, gid, perm, 1, _error);
+	if (!key)
+		return NULL;
+
+	ret = fake_bind(kind, id, key);
+	if (ret < 0) {
+		key->usage = 1;
+		fake_key_put(key);
+		*_error = ret;
+		return NULL;
+	}
+	return key;
+}
+
+/*
+ * get the user keyring or the user session keyring, creating both if need be
+ */
+static struct fake_key *fake_user_ring(unsigned kind, int *_error)
+{
+	struct fake_binding *b;
+	struct fake_key *user, *session;
+	char desc[32];
+	int ret;
+
+	b = fake_find_binding(kind, fake.uid);
+	if (b)
+		return b->key;
+
+	b = fake_find_binding(FAKE_BIND_USER, fake.uid);
+	if (b) {
+		user = b->key;
+	} else {
+		sprintf(desc, "_uid.%u", fake.uid);
+		user = fake_new_anchor(FAKE_BIND_USER, fake.uid, desc,
+				       fake.uid, FAKE_INVALID_ID,
+				       (KEY_POS_ALL & ~KEY_POS_SETATTR) | KEY_USR_ALL,
+				       _error);
+		if (!user)
+			return NULL;
+		user->flags |= FAKE_KEY_UID_KEYRING;
+		if (kind == FAKE_BIND_USER)
+			return user;
+	}
+
+	sprintf(desc, "_uid_ses.%u", fake.uid);
+	session = fake_new_anchor(FAKE_BIND_USER_SESSION, fake.uid, desc,
+				  fake.uid, FAKE_INVALID_ID,
+				  (KEY_POS_ALL & ~KEY_POS_SETATTR) | KEY_USR_ALL,
+				  _error);
+	if (!session)
+		return NULL;
+	session->flags |= FAKE_KEY_UID_KEYRING;
+	ret = fake_ring_link(session, user);
+	if (ret < 0) {
+		*_error = ret;
+		return NULL;
+	}
+	return kind == FAKE_BIND_USER ? user : session;
+}
+
+static void fake_begin(void);
+static void fake_end(void);
+
+static void fake_thread_exit(void *p)
+{
+	fake_begin();
+	fake_unbind(FAKE_BIND_THREAD, (pid_t)(long)p);
+	fake_end();
+}
+
+static struct fake_key *fake_thread_ring(int create, int *_error)
+{
+	struct fake_binding *b;
+	struct fake_key *key;
+
+	b = fake_find_binding(FAKE_BIND_THREAD, fake_gettid());
+	if (b)
+		return b->key;
+	if (!create) {
+		*_error = -ENOKEY;
+		return NULL;
+	}
+
+	key = fake_new_anchor(FAKE_BIND_THREAD, fake_gettid(), "_tid",
+			      fake.uid, fake.gid, KEY_POS_ALL | KEY_USR_VIEW,
+			      _error);
+	if (key)
+		pthread_setspecific(fake_thread_key, (void *)(long)fake_gettid());
+	return key;
+}
+
+static struct fake_key *fake_process_ring(int create, int *_error)
+{
+	struct fake_binding *b;
+
+	b = fake_find_binding(FAKE_BIND_PROCESS, fake.pid);
+	if (b)
+		return b->key;
+	if (!create) {
+		*_error = -ENOKEY;
+		return NULL;
+	}
+
+	return fake_new_anchor(FAKE_BIND_PROCESS, fake.pid, "_pid",
+			       fake.uid, fake.gid, KEY_POS_ALL | KEY_USR_VIEW,
+			       _error);
+}
+
+/*
+ * get a process's parent from /proc
+ */
+static pid_t fake_parent_of(pid_t pid)
+{
+	char path[32], buf[512], *p;
+	ssize_t n;
+	int fd;
+
+	if (pid == fake.pid)
+		return getppid();
+
+	sprintf(path, "/proc/%d/stat", pid);
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1)
+		return 0;
+	n = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (n <= 0)
+		return 0;
+	buf[n] = '\0';
+
+	/* the comm field may contain anything, so skip to its end */
+	p = strrchr(buf, ')');
+	if (!p)
+		return 0;
+	return strtol(p + 3, NULL, 10);
+}
+
+/*
+ * find the session keyring, which is the one bound to the nearest ancestor
+ * process that has one
+ */
+static struct fake_key *fake_session_ring(void)
+{
+	struct fake_binding *b = NULL;
+	pid_t pid = fake.pid;
+	int depth;
+
+	if (fake.session_version == fake.bind_version &&
+	    fake.session_pid == fake.pid)
+		return fake.session;
+
+	for (depth = 0; pid > 0 && depth < 64; depth++) {
+		b = fake_find_binding(FAKE_BIND_SESSION, pid);
+		if (b || pid == 1)
+			break;
+		pid = fake_parent_of(pid);
+	}
+
+	fake.session = b ? b->key : NULL;
+	fake.session_pid = fake.pid;
+	fake.session_version = fake.bind_version;
+	return fake.session;
+}
+
+/*****************************************************************************/
+/*
+ * search a keyring tree for a key
+ * - the keyring's own contents are checked before the nested keyrings
+ * - keyrings are only descended into if they grant search permission
+ * - a keyring is only searched again if it's found nearer the top, as the
+ *   depth limit may have stopped us going all the way down before
+ */
+static struct fake_key *fake_search_ring(struct fake_search *s,
+					 struct fake_key *ring, int depth)
+{
+	struct fake_link *link;
+	struct fake_key *key;
+	int ret;
+
+	ring->mark = s->mark;
+	ring->mark_depth = depth;
+
+	link = fake_ring_find(ring, s->type, s->desc, s->desc_len, s->hash);
+	if (link) {
+		key = link->key;
+		if ((!s->match || key == s->match) &&
+		    fake_perm(key, s->possessed) & KEY_NEED_SEARCH) {
+			ret = s->state_check ? fake_key_validate(key) : 0;
+			if (ret == 0)
+				return key;
+			s->error = ret;
+		}
+	}
+
+	if (depth >= FAKE_MAX_DEPTH)
+		return NULL;
+
+	for (link = ring->nested; link; link = link->nest_next) {
+		key = link->key;
+		if ((key->mark == s->mark && key->mark_depth <= depth + 1) ||
+		    fake_key_validate(key) < 0 ||
+		    !(fake_perm(key, s->possessed) & KEY_NEED_SEARCH))
+			continue;
+		key = fake_search_ring(s, key, depth + 1);
+		if (key)
+			return key;
+	}
+	return NULL;
+}
+
+/*
+ * search the thread, process and session keyrings in that order
+ */
+static struct fake_key *fake_search_process(struct fake_search *s)
+{
+	struct fake_key *anchors[3], *key;
+	int loop, ret;
+
+	anchors[0] = fake_thread_ring(0, &ret);
+	anchors[1] = fake_process_ring(0, &ret);
+	anchors[2] = fake_session_ring();
+	if (!anchors[2])
+		anchors[2] = fake_user_ring(FAKE_BIND_USER_SESSION, &ret);
+
+	s->possessed = 1;
+	s->mark = ++fake.mark;
+	for (loop = 0; loop < 3; loop++) {
+		key = anchors[loop];
+		if (!key ||
+		    (key->mark == s->mark && key->mark_depth == 0) ||
+		    fake_key_validate(key) < 0 ||
+		    !(fake_perm(key, 1) & KEY_NEED_SEARCH))
+			continue;
+		key = fake_search_ring(s, key, 0);
+		if (key)
+			return key;
+	}
+	return NULL;
+}
+
+/*
+ * a key is possessed if the caller can find it by searching its keyrings
+ */
+static int fake_is_possessed(struct fake_key *key)
+{
+	struct fake_search s = {
+		.type		= key->type,
+		.desc		= key->desc,
+		.desc_len	= key->desc_len,
+		.hash		= key->hash,
+		.match		= key,
+	};
+
+	return fake_search_process(&s) != NULL;
+}
+
+/*
+ * look up a key by ID, as the kernel does for a keyctl() argument
+ */
+static int fake_lookup(key_serial_t id, unsigned lflags, unsigned need,
+		       struct fake_key **_key, int *_possessed)
+{
+	struct fake_key *key;
+	int possessed = 1, ret = -ENOKEY;
+
+	switch (id) {
+	case KEY_SPEC_THREAD_KEYRING:
+		key = fake_thread_ring(lflags & FAKE_LOOKUP_CREATE, &ret);
+		break;
+	case KEY_SPEC_PROCESS_KEYRING:
+		key = fake_process_ring(lflags & FAKE_LOOKUP_CREATE, &ret);
+		break;
+	case KEY_SPEC_SESSION_KEYRING:
+		key = fake_session_ring();
+		if (!key)
+			key = fake_user_ring(FAKE_BIND_USER_SESSION, &ret);
+		break;
+	case KEY_SPEC_USER_KEYRING:
+		key = fake_user_ring(FAKE_BIND_USER, &ret);
+		break;
+	case KEY_SPEC_USER_SESSION_KEYRING:
+		key = fake_user_ring(FAKE_BIND_USER_SESSION, &ret);
+		break;
+	case KEY_SPEC_GROUP_KEYRING:
+	case KEY_SPEC_REQKEY_AUTH_KEY:
+	case KEY_SPEC_REQUESTOR_KEYRING:
+		return -EINVAL;
+	default:
+		if (id < 1)
+			return -EINVAL;
+		key = fake_find_serial(id);
+		if (key)
+			possessed = fake_is_possessed(key);
+		break;
+	}
+
+	if (!key)
+		return ret;
+
+	if (!(lflags & FAKE_LOOKUP_FOR_UNLINK) && need) {
+		ret = fake_key_validate(key);
+		if (ret < 0)
+			return ret;
+		if (!(fake_perm(key, possessed) & need))
+			return -EACCES;
+	}
+
+	*_key = key;
+	if (_possessed)
+		*_possessed = possessed;
+	return 0;
+}
+
+/*****************************************************************************/
+/*
+ * check the strings passed in from the caller
+ */
+static int fake_check_type(const char *type)
+{
+	size_t len;
+
+	if (!type)
+		return -EFAULT;
+	len = strnlen(type, FAKE_MAX_TYPE_LEN + 1);
+	if (len == 0 || len > FAKE_MAX_TYPE_LEN)
+		return -EINVAL;
+	if (type[0] == '.')
+		return -EPERM;
+	return 0;
+}
+
+static int fake_check_desc(const char *desc, size_t *_len)
+{
+	if (!desc)
+		return -EFAULT;
+	*_len = strnlen(desc, FAKE_MAX_DESC_LEN + 1);
+	if (*_len > FAKE_MAX_DESC_LEN)
+		return -EINVAL;
+	return 0;
+}
+
+static const struct fake_type *fake_find_type(const char *name)
+{
+	unsigned loop;
+
+	for (loop = 0; loop < FAKE_NR_TYPES; loop++)
+		if (strcmp(fake_types[loop].name, name) == 0)
+			return &fake_types[loop];
+	return NULL;
+}
+
+/*
+ * check a payload as the type's preparse op would
+ */
+static int fake_check_payload(const struct fake_type *type,
+			      const char *desc, size_t plen)
+{
+	const char *p;
+
+	if (type->is_keyring)
+		return plen ? -EINVAL : 0;
+	if (plen == 0 || plen > type->max_plen)
+		return -EINVAL;
+	if (type->need_prefix) {
+		p = strchr(desc, ':');
+		if (!p || p == desc)
+			return -EINVAL;
+	}
+	return 0;
+}
+
+static key_perm_t fake_default_perm(const struct fake_type *type)
+{
+	key_perm_t perm = KEY_POS_VIEW | KEY_POS_SEARCH | KEY_POS_LINK |
+		KEY_POS_SETATTR | KEY_USR_VIEW;
+
+	if (type->can_read)
+		perm |= KEY_POS_READ;
+	if (type->is_keyring || type->can_update)
+		perm |= KEY_POS_WRITE;
+	return perm;
+}
+
+/*****************************************************************************/
+/*
+ * emulate add_key()
+ */
+static long fake_add_key(const char *type, const char *desc,
+			 const void *payload, size_t plen, key_serial_t ringid)
+{
+	const struct fake_type *ktype;
+	struct fake_link *link;
+	struct fake_key *ring, *key;
+	size_t desc_len;
+	int possessed, ret;
+
+	ret = fake_check_type(type);
+	if (ret < 0)
+		return ret;
+	if (!desc)
+		return -EINVAL;
+	ret = fake_check_desc(desc, &desc_len);
+	if (ret < 0)
+		return ret;
+	if (desc_len == 0)
+		return -EINVAL;
+	if (desc[0] == '.' && strcmp(type, "keyring") == 0)
+		return -EPERM;
+	if (plen > FAKE_MAX_PAYLOAD)
+		return -EINVAL;
+	if (plen && !payload)
+		return -EFAULT;
+
+	ret = fake_lookup(ringid, FAKE_LOOKUP_CREATE, KEY_NEED_WRITE,
+			  &ring, &possessed);
+	if (ret < 0)
+		return ret;
+
+	ktype = fake_find_type(type);
+	if (!ktype)
+		return -ENODEV;
+	if (!ring->type->is_keyring)
+		return -ENOTDIR;
+	ret = fake_check_payload(ktype, desc, plen);
+	if (ret < 0)
+		return ret;
+
+	/* update a matching key in the keyring if the type allows it */
+	link = fake_ring_find(ring, ktype, desc, desc_len,
+			      fake_hash(ktype, desc, desc_len));
+	if (link && ktype->can_update &&
+	    !(link->key->flags & (FAKE_KEY_REVOKED | FAKE_KEY_INVALIDATED))) {
+		key = link->key;
+		if (!(fake_perm(key, possessed) & KEY_NEED_WRITE))
+			return -EACCES;
+		ret = fake_key_set_payload(key, payload, plen);
+		return ret < 0 ? ret : key->serial;
+	}
+
+	key = fake_key_alloc(0, ktype, desc, desc_len, payload, plen,
+			     fake.uid, fake.gid, fake_default_perm(ktype),
+			     1, &ret);
+	if (!key)
+		return ret;
+
+	ret = fake_ring_link(ring, key);
+	if (ret < 0) {
+		key->usage = 1;
+		fake_key_put(key);
+		return ret;
+	}
+	return key->serial;
+}
+
+/*
+ * emulate request_key()
+ * - there's no upcall, so keys can only be found, not constructed
+ */
+static long fake_request_key(const char *type, const char *desc,
+			     const char *callout_info, key_serial_t destringid)
+{
+	const struct fake_type *ktype;
+	struct fake_search s = {};
+	struct fake_key *dest = NULL, *key;
+	size_t len;
+	int ret;
+
+	ret = fake_check_type(type);
+	if (ret < 0)
+		return ret;
+	if (!desc)
+		return -EINVAL;
+	ret = fake_check_desc(desc, &len);
+	if (ret < 0)
+		return ret;
+	if (callout_info) {
+		ret = fake_check_desc(callout_info, &len);
+		if (ret < 0)
+			return ret;
+	}
+
+	if (destringid) {
+		ret = fake_lookup(destringid, FAKE_LOOKUP_CREATE,
+				  KEY_NEED_WRITE, &dest, NULL);
+		if (ret < 0)
+			return ret;
+	}
+
+	ktype = fake_find_type(type);
+	if (!ktype)
+		return -ENOKEY;
+
+	s.type = ktype;
+	s.desc = desc;
+	s.desc_len = strlen(desc);
+	s.hash = fake_hash(ktype, desc, s.desc_len);
+	s.state_check = 1;
+	s.error = -ENOKEY;
+	key = fake_search_process(&s);
+	if (!key)
+		return s.error;
+
+	if (dest) {
+		ret = fake_link_key(dest, key);
+		if (ret < 0)
+			return ret;
+	}
+	return key->serial;
+}
+
+/*****************************************************************************/
+/*
+ * the keyctl() operations
+ */
+static long fake_join_session_keyring(const char *name)
+{
+	struct fake_key *key;
+	size_t len;
+	int ret;
+
+	if (!name) {
+		key = fake_key_alloc(0, &fake_types[0], "_ses", 4, NULL, 0,
+				     fake.uid, fake.gid,
+				     KEY_POS_ALL | KEY_USR_VIEW | KEY_USR_READ,
+				     1, &ret);
+		if (!key)
+			return ret;
+		goto bind;
+	}
+
+	ret = fake_check_desc(name, &len);
+	if (ret < 0)
+		return ret;
+	if (len == 0)
+		return -EINVAL;
+
+	/* join a keyring of that name if there is one we may search */
+	for (key = fake.first; key; key = key->next) {
+		if (key->type->is_keyring &&
+		    !(key->flags & FAKE_KEY_UID_KEYRING) &&
+		    key->desc_len == len &&
+		    memcmp(key->desc, name, len) == 0 &&
+		    fake_key_validate(key) == 0 &&
+		    fake_perm(key, 0) & KEY_NEED_SEARCH)
+			goto bind;
+	}
+
+	key = fake_key_alloc(0, &fake_types[0], name, len, NULL, 0,
+			     fake.uid, fake.gid,
+			     KEY_POS_ALL | KEY_USR_VIEW | KEY_USR_READ |
+			     KEY_USR_LINK,
+			     1, &ret);
+	if (!key)
+		return ret;
+
+bind:
+	ret = fake_bind(FAKE_BIND_SESSION, fake.pid, key);
+	if (ret < 0) {
+		if (key->usage == 0) {
+			key->usage = 1;
+			fake_key_put(key);
+		}
+		return ret;
+	}
+	return key->serial;
+}
+
+static long fake_update(key_serial_t id, const void *payload, size_t plen)
+{
+	struct fake_key *key;
+	int ret;
+
+	if (plen > FAKE_MAX_PAYLOAD)
+		return -EINVAL;
+	if (plen && !payload)
+		return -EFAULT;
+
+	ret = fake_lookup(id, 0, KEY_NEED_WRITE, &key, NULL);
+	if (ret < 0)
+		return ret;
+	if (!key->type->can_update)
+		return -EOPNOTSUPP;
+	ret = fake_check_payload(key->type, key->desc, plen);
+	if (ret < 0)
+		return ret;
+	return fake_key_set_payload(key, payload, plen);
+}
+
+static long fake_revoke(key_serial_t id)
+{
+	struct fake_key *key;
+	int ret;
+
+	ret = fake_lookup(id, 0, KEY_NEED_WRITE, &key, NULL);
+	if (ret == -EACCES)
+		ret = fake_lookup(id, 0, KEY_NEED_SETATTR, &key, NULL);
+	if (ret < 0)
+		return ret;
+
+	if (!(key->flags & FAKE_KEY_REVOKED)) {
+		key->flags |= FAKE_KEY_REVOKED;
+		if (key->type->is_keyring)
+			fake_ring_clear(key);
+		fake.dirty = 1;
+	}
+	return 0;
+}
+
+static long fake_chown(key_serial_t id, uid_t uid, gid_t gid)
+{
+	struct fake_key *key;
+	int ret;
+
+	ret = fake_lookup(id, FAKE_LOOKUP_PARTIAL, KEY_NEED_SETATTR, &key, NULL);
+	if (ret < 0)
+		return ret;
+
+	if (fake.uid != 0) {
+		if (uid != (uid_t)-1 && uid != key->uid)
+			return -EACCES;
+		if (gid != (gid_t)-1 && gid != key->gid && !fake_in_group(gid))
+			return -EACCES;
+	}
+
+	if (uid != (uid_t)-1 && uid != key->uid) {
+		ret = fake_quota(uid, 1, fake_quota_len(key), 1);
+		if (ret < 0)
+			return ret;
+		fake_quota(key->uid, -1, -fake_quota_len(key), 0);
+		key->uid = uid;
+	}
+	if (gid != (gid_t)-1)
+		key->gid = gid;
+	fake.dirty = 1;
+	return 0;
+}
+
+static long fake_setperm(key_serial_t id, key_perm_t perm)
+{
+	struct fake_key *key;
+	int ret;
+
+	if (perm & ~(KEY_POS_ALL | KEY_USR_ALL | KEY_GRP_ALL | KEY_OTH_ALL))
+		return -EINVAL;
+
+	ret = fake_lookup(id, FAKE_LOOKUP_PARTIAL, KEY_NEED_SETATTR, &key, NULL);
+	if (ret < 0)
+		return ret;
+	if (fake.uid != 0 && key->uid != fake.uid)
+		return -EACCES;
+
+	key->perm = perm;
+	fake.dirty = 1;
+	return 0;
+}
+
+static long fake_describe(key_serial_t id, char *buffer, size_t buflen)
+{
+	struct fake_key *key;
+	char info[FAKE_MAX_TYPE_LEN + FAKE_MAX_DESC_LEN + 64];
+	size_t len;
+	int ret;
+
+	ret = fake_lookup(id, FAKE_LOOKUP_PARTIAL, KEY_NEED_VIEW, &key, NULL);
+	if (ret < 0)
+		return ret;
+
+	len = sprintf(info, "%s;%d;%d;%08x;%s",
+		      key->type->name,
+		      (int)fake_munge(key->uid),
+		      (int)fake_munge(key->gid),
+		      key->perm, key->desc) + 1;
+
+	if (buffer && buflen > 0)
+		memcpy(buffer, info, buflen < len ? buflen : len);
+	return len;
+}
+
+static long fake_clear(key_serial_t ringid)
+{
+	struct fake_key *ring;
+	int ret;
+
+	ret = fake_lookup(ringid, FAKE_LOOKUP_CREATE, KEY_NEED_WRITE,
+			  &ring, NULL);
+	if (ret < 0)
+		return ret;
+	if (!ring->type->is_keyring)
+		return -ENOTDIR;
+	fake_ring_clear(ring);
+	return 0;
+}
+
+static long fake_link(key_serial_t id, key_serial_t ringid)
+{
+	struct fake_key *ring, *key;
+	int ret;
+
+	ret = fake_lookup(ringid, FAKE_LOOKUP_CREATE, KEY_NEED_WRITE,
+			  &ring, NULL);
+	if (ret < 0)
+		return ret;
+	ret = fake_lookup(id, FAKE_LOOKUP_CREATE, KEY_NEED_LINK, &key, NULL);
+	if (ret < 0)
+		return ret;
+	return fake_link_key(ring, key);
+}
+
+static long fake_unlink(key_serial_t id, key_serial_t ringid)
+{
+	struct fake_link *link;
+	struct fake_key *ring, *key;
+	int ret;
+
+	ret = fake_lookup(ringid, 0, KEY_NEED_WRITE, &ring, NULL);
+	if (ret < 0)
+		return ret;
+	ret = fake_lookup(id, FAKE_LOOKUP_FOR_UNLINK, 0, &key, NULL);
+	if (ret < 0)
+		return ret;
+	if (!ring->type->is_keyring)
+		return -ENOTDIR;
+
+	link = fake_ring_find(ring, key->type, key->desc, key->desc_len,
+			      key->hash);
+	if (!link || link->key != key)
+		return -ENOENT;
+	fake_ring_unlink(ring, link);
+	return 0;
+}
+
+static long fake_search(key_serial_t ringid, const char *type,
+			const char *desc, key_serial_t destringid)
+{
+	const struct fake_type *ktype;
+	struct fake_search s = {};
+	struct fake_key *ring, *dest = NULL, *key;
+	size_t len;
+	int possessed, ret;
+
+	ret = fake_check_type(type);
+	if (ret < 0)
+		return ret;
+	ret = fake_check_desc(desc, &len);
+	if (ret < 0)
+		return ret;
+
+	ret = fake_lookup(ringid, 0, KEY_NEED_SEARCH, &ring, &possessed);
+	if (ret < 0)
+		return ret;
+	if (destringid) {
+		ret = fake_lookup(destringid, FAKE_LOOKUP_CREATE,
+				  KEY_NEED_WRITE, &dest, NULL);
+		if (ret < 0)
+			return ret;
+	}
+
+	ktype = fake_find_type(type);
+	if (!ktype)
+		return -ENOKEY;
+	if (!ring->type->is_keyring)
+		return -ENOTDIR;
+
+	s.type = ktype;
+	s.desc = desc;
+	s.desc_len = len;
+	s.hash = fake_hash(ktype, desc, len);
+	s.possessed = possessed;
+	s.state_check = 1;
+	s.error = -ENOKEY;
+	s.mark = ++fake.mark;
+	key = fake_search_ring(&s, ring, 0);
+	if (!key)
+		return s.error;
+
+	if (dest) {
+		if (!(fake_perm(key, possessed) & KEY_NEED_LINK))
+			return -EACCES;
+		ret = fake_link_key(dest, key);
+		if (ret < 0)
+			return ret;
+	}
+	return key->serial;
+}
+
+static long fake_read(key_serial_t id, char *buffer, size_t buflen)
+{
+	struct fake_link *link;
+	struct fake_key *key;
+	key_serial_t *p;
+	size_t len;
+	int possessed, ret;
+
+	ret = fake_lookup(id, 0, 0, &key, &possessed);
+	if (ret < 0)
+		return -ENOKEY;
+
+	/* a possessed key may be read if it can be searched for */
+	if (!(fake_perm(key, possessed) & KEY_NEED_READ) && !possessed)
+		return -EACCES;
+	if (!key->type->can_read)
+		return -EOPNOTSUPP;
+	ret = fake_key_validate(key);
+	if (ret < 0)
+		return ret;
+
+	if (!key->type->is_keyring) {
+		len = key->plen;
+		if (buffer && buflen > 0)
+			memcpy(buffer, key->payload, buflen < len ? buflen : len);
+		return len;
+	}
+
+	len = key->nr_links * sizeof(key_serial_t);
+	if (buffer) {
+		p = (key_serial_t *)buffer;
+		for (link = key->first;
+		     link && buflen >= sizeof(key_serial_t);
+		     link = link->next) {
+			*p++ = link->key->serial;
+			buflen -= sizeof(key_serial_t);
+		}
+	}
+	return len;
+}
+
+static long fake_set_reqkey_keyring(int reqkey_defl)
+{
+	int old = fake_reqkey_defl;
+
+	switch (reqkey_defl) {
+	case KEY_REQKEY_DEFL_NO_CHANGE:
+		return old;
+	case KEY_REQKEY_DEFL_DEFAULT:
+	case KEY_REQKEY_DEFL_THREAD_KEYRING:
+	case KEY_REQKEY_DEFL_PROCESS_KEYRING:
+	case KEY_REQKEY_DEFL_SESSION_KEYRING:
+	case KEY_REQKEY_DEFL_USER_KEYRING:
+	case KEY_REQKEY_DEFL_USER_SESSION_KEYRING:
+	case KEY_REQKEY_DEFL_REQUESTOR_KEYRING:
+		fake_reqkey_defl = reqkey_defl;
+		return old;
+	default:
+		return -EINVAL;
+	}
+}
+
+static long fake_set_timeout(key_serial_t id, unsigned timeout)
+{
+	struct fake_key *key;
+	int ret;
+
+	ret = fake_lookup(id, FAKE_LOOKUP_PARTIAL, KEY_NEED_SETATTR, &key, NULL);
+	if (ret < 0)
+		return ret;
+	key->expiry = timeout ? fake.now + timeout : 0;
+	fake.dirty = 1;
+	return 0;
+}
+
+static long fake_get_security(key_serial_t id, char *buffer, size_t buflen)
+{
+	struct fake_key *key;
+	int ret;
+
+	ret = fake_lookup(id, FAKE_LOOKUP_PARTIAL, KEY_NEED_VIEW, &key, NULL);
+	if (ret < 0)
+		return ret;
+	if (buffer && buflen > 0)
+		buffer[0] = '\0';
+	return 1;
+}
+
+static long fake_session_to_parent(void)
+{
+	struct fake_key *key;
+	pid_t ppid;
+	int ret;
+
+	ret = fake_lookup(KEY_SPEC_SESSION_KEYRING, 0, KEY_NEED_LINK,
+			  &key, NULL);
+	if (ret < 0)
+		return ret;
+	ppid = getppid();
+	if (ppid <= 1)
+		return -EPERM;
+	return fake_bind(FAKE_BIND_SESSION, ppid, key);
+}
+
+static long fake_invalidate(key_serial_t id)
+{
+	struct fake_link *link;
+	struct fake_key *key, *ring, *next;
+	int ret;
+
+	ret = fake_lookup(id, 0, KEY_NEED_SEARCH, &key, NULL);
+	if (ret < 0)
+		return ret;
+
+	/* the kernel's garbage collector would promptly unlink it */
+	key->flags |= FAKE_KEY_INVALIDATED;
+	key->usage++;
+	for (ring = fake.first; ring; ring = next) {
+		next = ring->next;
+		if (!ring->type->is_keyring)
+			continue;
+		link = fake_ring_find(ring, key->type, key->desc,
+				      key->desc_len, key->hash);
+		if (link && link->key == key)
+			fake_ring_unlink(ring, link);
+	}
+	fake_key_put(key);
+	fake.dirty = 1;
+	return 0;
+}
+
+static long fake_keyctl(int cmd, unsigned long arg2, unsigned long arg3,
+			unsigned long arg4, unsigned long arg5)
+{
+	key_serial_t id = arg2;
+	struct fake_key *key;
+	int ret;
+
+	switch (cmd) {
+	case KEYCTL_GET_KEYRING_ID:
+		ret = fake_lookup(id, arg3 ? FAKE_LOOKUP_CREATE : 0,
+				  KEY_NEED_SEARCH, &key, NULL);
+		return ret < 0 ? ret : key->serial;
+	case KEYCTL_JOIN_SESSION_KEYRING:
+		return fake_join_session_keyring((const char *)arg2);
+	case KEYCTL_UPDATE:
+		return fake_update(id, (const void *)arg3, arg4);
+	case KEYCTL_REVOKE:
+		return fake_revoke(id);
+	case KEYCTL_CHOWN:
+		return fake_chown(id, arg3, arg4);
+	case KEYCTL_SETPERM:
+		return fake_setperm(id, arg3);
+	case KEYCTL_DESCRIBE:
+		return fake_describe(id, (char *)arg3, arg4);
+	case KEYCTL_CLEAR:
+		return fake_clear(id);
+	case KEYCTL_LINK:
+		return fake_link(id, arg3);
+	case KEYCTL_UNLINK:
+		return fake_unlink(id, arg3);
+	case KEYCTL_SEARCH:
+		return fake_search(id, (const char *)arg3, (const char *)arg4,
+				   arg5);
+	case KEYCTL_READ:
+		return fake_read(id, (char *)arg3, arg4);
+
+	/* nothing is ever under construction, so there's no authority to
+	 * instantiate anything */
+	case KEYCTL_INSTANTIATE:
+		if (arg4 > FAKE_MAX_PAYLOAD)
+			return -EINVAL;
+		return -EPERM;
+	case KEYCTL_INSTANTIATE_IOV:
+		if (arg4 > 1024)	/* UIO_MAXIOV */
+			return -EINVAL;
+		return -EPERM;
+	case KEYCTL_REJECT:
+		if ((int)arg4 <= 0 || arg4 >= 4095 ||
+		    (arg4 >= 512 && arg4 <= 516))	/* ERESTART* */
+			return -EINVAL;
+		return -EPERM;
+	case KEYCTL_NEGATE:
+		return -EPERM;
+	case KEYCTL_ASSUME_AUTHORITY:
+		if (id < 0)
+			return -EINVAL;
+		return id == 0 ? 0 : -ENOKEY;
+
+	case KEYCTL_SET_REQKEY_KEYRING:
+		return fake_set_reqkey_keyring(id);
+	case KEYCTL_SET_TIMEOUT:
+		return fake_set_timeout(id, arg3);
+	case KEYCTL_GET_SECURITY:
+		return fake_get_security(id, (char *)arg3, arg4);
+	case KEYCTL_SESSION_TO_PARENT:
+		return fake_session_to_parent();
+	case KEYCTL_INVALIDATE:
+		return fake_invalidate(id);
+	default:
+		return -EOPNOTSUPP;
+	}
+}
+
+/*****************************************************************************/
+/*
+ * The state file holds a header, then each key in serial order followed by its
+ * description, its payload and the serials of the keys it links to, and then
+ * the bindings.
+ */
+#define FAKE_STATE_MAGIC "KEYFAKE1"
+
+struct fake_state_header {
+	char		magic[8];
+	uint64_t	generation;
+	int32_t		next_serial;
+	uint32_t	nr_keys;
+	uint32_t	nr_bindings;
+	uint32_t	__pad;
+};
+
+struct fake_state_key {
+	int32_t		serial;
+	uint32_t	type;		/* index into fake_types[] */
+	uint32_t	uid;
+	uint32_t	gid;
+	uint32_t	perm;
+	uint32_t	flags;
+	int64_t		expiry;
+	uint32_t	desc_len;
+	uint32_t	plen;
+	uint32_t	nr_links;
+	uint32_t	__pad;
+};
+
+struct fake_state_binding {
+	uint32_t	kind;
+	uint32_t	id;
+	int32_t		serial;
+	uint32_t	__pad;
+};
+
+/*
+ * discard everything we have in memory
+ */
+static void fake_reset(void)
+{
+	struct fake_key *key, *next;
+	struct fake_link *link, *lnext;
+
+	for (key = fake.first; key; key = next) {
+		next = key->next;
+		for (link = key->first; link; link = lnext) {
+			lnext = link->next;
+			free(link);
+		}
+		free(key->slots);
+		free(key->payload);
+		free(key->desc);
+		free(key);
+	}
+	free(fake.serial_slots);
+	fake.serial_slots = NULL;
+	fake.serial_mask = 0;
+	fake.nr_keys = 0;
+	fake.first = fake.last = NULL;
+	fake.next_serial = FAKE_SERIAL_BASE;
+	fake.nr_bindings = 0;
+	fake.nr_users = 0;
+	fake.bind_version++;
+}
+
+static int fake_load_state(void)
+{
+	struct fake_state_header hdr;
+	struct fake_state_binding sb;
+	struct fake_state_key sk;
+	struct fake_key *key, *ring, *target;
+	struct stat st;
+	unsigned loop, l;
+	int32_t serial;
+	char *buf, *p, *end;
+	int ret = -EINVAL;
+
+	fake_reset();
+
+	if (fstat(fake.state_fd, &st) == -1)
+		return -errno;
+	if (st.st_size == 0) {
+		fake.generation = 0;
+		return 0;
+	}
+
+	buf = malloc(st.st_size);
+	if (!buf)
+		return -ENOMEM;
+	if (pread(fake.state_fd, buf, st.st_size, 0) != st.st_size)
+		goto out;
+	p = buf;
+	end = buf + st.st_size;
+
+#define TAKE(x, n)				\
+	do {					\
+		if (end - p < (n))		\
+			goto out;		\
+		memcpy((x), p, (n));		\
+		p += (n);			\
+	} while (0)
+
+	TAKE(&hdr, sizeof(hdr));
+	if (memcmp(hdr.magic, FAKE_STATE_MAGIC, 8) != 0)
+		goto out;
+
+	/* create the keys first, then link them together */
+	for (loop = 0; loop < hdr.nr_keys; loop++) {
+		TAKE(&sk, sizeof(sk));
+		if (sk.type >= FAKE_NR_TYPES ||
+		    sk.desc_len > FAKE_MAX_DESC_LEN ||
+		    end - p < sk.desc_len + sk.plen)
+			goto out;
+		if (sk.serial <= 0 || fake_find_serial(sk.serial))
+			goto out;
+		key = fake_key_alloc(sk.serial, &fake_types[sk.type],
+				     p, sk.desc_len, p + sk.desc_len, sk.plen,
+				     sk.uid, sk.gid, sk.perm, 0, &ret);
+		if (!key)
+			goto out;
+		key->flags = sk.flags;
+		key->expiry = sk.expiry;
+		p += sk.desc_len + sk.plen;
+		ret = -EINVAL;
+		if (end - p < sk.nr_links * sizeof(int32_t))
+			goto out;
+		p += sk.nr_links * sizeof(int32_t);
+	}
+
+	p = buf + sizeof(hdr);
+	for (ring = fake.first; ring; ring = ring->next) {
+		TAKE(&sk, sizeof(sk));
+		p += sk.desc_len + sk.plen;
+		for (l = 0; l < sk.nr_links; l++) {
+			TAKE(&serial, sizeof(serial));
+			target = fake_find_serial(serial);
+			if (target) {
+				ret = fake_ring_link(ring, target);
+				if (ret < 0)
+					goto out;
+			}
+		}
+	}
+
+	for (loop = 0; loop < hdr.nr_bindings; loop++) {
+		TAKE(&sb, sizeof(sb));
+		target = fake_find_serial(sb.serial);
+		if (target) {
+			ret = fake_bind(sb.kind, sb.id, target);
+			if (ret < 0)
+				goto out;
+		}
+	}
+#undef TAKE
+
+	/* drop any key that nothing holds onto */
+	for (key = fake.first; key; key = target) {
+		target = key->next;
+		if (key->usage == 0) {
+			key->usage = 1;
+			fake_key_put(key);
+		}
+	}
+
+	fake.next_serial = hdr.next_serial;
+	fake.generation = hdr.generation;
+	ret = 0;
+out:
+	free(buf);
+	if (ret < 0)
+		fake_reset();
+	return ret;
+}
+
+static int fake_save_state(void)
+{
+	struct fake_state_header hdr;
+	struct fake_state_binding sb;
+	struct fake_state_key sk;
+	struct fake_link *link;
+	struct fake_key *key;
+	unsigned loop;
+	size_t size;
+	char *buf, *p;
+	int ret = 0;
+
+	size = sizeof(hdr) + fake.nr_bindings * sizeof(sb);
+	for (key = fake.first; key; key = key->next)
+		size += sizeof(sk) + key->desc_len + key->plen +
+			key->nr_links * sizeof(int32_t);
+
+	buf = malloc(size);
+	if (!buf)
+		return -ENOMEM;
+	p = buf;
+
+#define PUT(x, n)				\
+	do {					\
+		memcpy(p, (x), (n));		\
+		p += (n);			\
+	} while (0)
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, FAKE_STATE_MAGIC, 8);
+	hdr.generation = ++fake.generation;
+	hdr.next_serial = fake.next_serial;
+	hdr.nr_keys = fake.nr_keys;
+	hdr.nr_bindings = fake.nr_bindings;
+	PUT(&hdr, sizeof(hdr));
+
+	for (key = fake.first; key; key = key->next) {
+		memset(&sk, 0, sizeof(sk));
+		sk.serial = key->serial;
+		sk.type = key->type - fake_types;
+		sk.uid = key->uid;
+		sk.gid = key->gid;
+		sk.perm = key->perm;
+		sk.flags = key->flags;
+		sk.expiry = key->expiry;
+		sk.desc_len = key->desc_len;
+		sk.plen = key->plen;
+		sk.nr_links = key->nr_links;
+		PUT(&sk, sizeof(sk));
+		PUT(key->desc, key->desc_len);
+		PUT(key->payload, key->plen);
+		for (link = key->first; link; link = link->next)
+			PUT(&link->key->serial, sizeof(int32_t));
+	}
+
+	for (loop = 0; loop < fake.nr_bindings; loop++) {
+		memset(&sb, 0, sizeof(sb));
+		sb.kind = fake.bindings[loop].kind;
+		sb.id = fake.bindings[loop].id;
+		sb.serial = fake.bindings[loop].key->serial;
+		PUT(&sb, sizeof(sb));
+	}
+#undef PUT
+
+	if (pwrite(fake.state_fd, buf, size, 0) != size ||
+	    ftruncate(fake.state_fd, size) == -1)
+		ret = -errno;
+	free(buf);
+	return ret;
+}
+
+/*
+ * release the keyrings of processes and threads that have gone away
+ */
+static void fake_reap_bindings(void)
+{
+	struct fake_binding *b;
+	unsigned loop;
+
+	for (loop = 0; loop < fake.nr_bindings; loop++) {
+		b = &fake.bindings[loop];
+		if (b->kind != FAKE_BIND_SESSION &&
+		    b->kind != FAKE_BIND_PROCESS &&
+		    b->kind != FAKE_BIND_THREAD)
+			continue;
+		if (kill(b->id, 0) == 0 || errno != ESRCH)
+			continue;
+		fake_unbind(b->kind, b->id);
+		loop--;
+	}
+}
+
+/*****************************************************************************/
+/*
+ * set up on first use
+ */
+static void fake_atfork_prepare(void)
+{
+	pthread_mutex_lock(&fake.lock);
+}
+
+static void fake_atfork_parent(void)
+{
+	pthread_mutex_unlock(&fake.lock);
+}
+
+static void fake_atfork_child(void)
+{
+	fake.pid = getpid();
+	fake_tid = 0;
+
+	/* flock() locks belong to the open file, so the child needs its own */
+	if (fake.state_fd != -1) {
+		close(fake.state_fd);
+		fake.state_fd = open(fake.state_file,
+				     O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+	}
+	pthread_mutex_unlock(&fake.lock);
+}
+
+static void fake_init(void)
+{
+	const char *quota;
+	unsigned long maxkeys, maxbytes;
+	int n;
+
+	fake.pid = getpid();
+	fake.uid = geteuid();
+	fake.gid = getegid();
+	n = getgroups(0, NULL);
+	if (n > 0) {
+		fake.groups = calloc(n, sizeof(gid_t));
+		if (fake.groups)
+			fake.nr_groups = getgroups(n, fake.groups);
+		if (fake.nr_groups < 0)
+			fake.nr_groups = 0;
+	}
+
+	quota = getenv("KEYUTILS_FAKE_QUOTA");
+	if (quota && sscanf(quota, "%lu/%lu", &maxkeys, &maxbytes) == 2) {
+		fake.maxkeys = fake.rootmaxkeys = maxkeys;
+		fake.maxbytes = fake.rootmaxbytes = maxbytes;
+	}
+
+	fake.state_file = getenv("KEYUTILS_FAKE_STATE");
+	if (fake.state_file && fake.state_file[0]) {
+		fake.state_fd = open(fake.state_file,
+				     O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+		if (fake.state_fd == -1)
+			fprintf(stderr, "libkeyutils-fake: Can't open %s: %m\n",
+				fake.state_file);
+	}
+
+	pthread_key_create(&fake_thread_key, fake_thread_exit);
+	pthread_atfork(fake_atfork_prepare, fake_atfork_parent,
+		       fake_atfork_child);
+}
+
+/*
+ * begin and end an operation
+ * - if the keys are in a file, it's reloaded if someone else has changed it
+ *   and written back if we change it
+ */
+static void fake_begin(void)
+{
+	struct fake_state_header hdr;
+	ssize_t n;
+
+	pthread_once(&fake_once, fake_init);
+	pthread_mutex_lock(&fake.lock);
+	fake.now = time(NULL);
+	fake.dirty = 0;
+
+	if (fake.state_fd == -1)
+		return;
+
+	flock(fake.state_fd, LOCK_EX);
+	n = pread(fake.state_fd, &hdr, sizeof(hdr), 0);
+	if (n != sizeof(hdr) ||
+	    memcmp(hdr.magic, FAKE_STATE_MAGIC, 8) != 0 ||
+	    hdr.generation != fake.generation ||
+	    fake.generation == 0) {
+		if (fake_load_state() < 0)
+			fprintf(stderr, "libkeyutils-fake: Discarding bad state in %s\n",
+				fake.state_file);
+		fake.dirty = 0;
+		fake_reap_bindings();
+		fake_gc();
+	}
+}
+
+static void fake_end(void)
+{
+	fake_gc();
+	if (fake.state_fd != -1) {
+		if (fake.dirty)
+			fake_save_state();
+		flock(fake.state_fd, LOCK_UN);
+	}
+	pthread_mutex_unlock(&fake.lock);
+}
+
+static long fake_result(long ret)
+{
+	if (ret < 0) {
+		errno = -ret;
+		return -1;
+	}
+	return ret;
+}
+
+/*****************************************************************************/
+/*
+ * the system call replacements
+ */
+key_serial_t add_key(const char *type,
+		     const char *description,
+		     const void *payload,
+		     size_t plen,
+		     key_serial_t ringid)
+{
+	long ret;
+
+	fake_begin();
+	ret = fake_add_key(type, description, payload, plen, ringid);
+	fake_end();
+	return fake_result(ret);
+}
+
+key_serial_t request_key(const char *type,
+			 const char *description,
+			 const char *callout_info,
+			 key_serial_t destringid)
+{
+	long ret;
+
+	fake_begin();
+	ret = fake_request_key(type, description, callout_info, destringid);
+	fake_end();
+	return fake_result(ret);
+}
+
+long keyctl(int cmd, ...)
+{
+	va_list va;
+	unsigned long arg2, arg3, arg4, arg5;
+	long ret;
+
+	va_start(va, cmd);
+	arg2 = va_arg(va, unsigned long);
+	arg3 = va_arg(va, unsigned long);
+	arg4 = va_arg(va, unsigned long);
+	arg5 = va_arg(va, unsigned long);
+	va_end(va);
+
+	fake_begin();
+	ret = fake_keyctl(cmd, arg2, arg3, arg4, arg5);
+	fake_end();
+	return fake_result(ret);
+}
+
+/*
+ * there is no /proc/keys for these keys, so present them directly
+ * - the keys the caller may view are copied out first so that the callback
+ *   is free to call back into here
+ */
+int keyctl_proc_keys_iterate(keyctl_proc_keys_iterator_t func, void *data)
+{
+	struct keyctl_proc_key *keys = NULL, *k;
+	struct fake_key *key;
+	unsigned nr = 0, loop;
+	size_t heap_size = 0, off;
+	char *heap = NULL;
+	int ret = 0;
+
+	fake_begin();
+
+	/* leave room for the type's summary after each description */
+	for (key = fake.first; key; key = key->next)
+		heap_size += key->desc_len + 32;
+
+	keys = malloc((fake.nr_keys + 1) * sizeof(*keys));
+	heap = malloc(heap_size + 1);
+	if (!keys || !heap) {
+		fake_end();
+		free(keys);
+		free(heap);
+		errno = ENOMEM;
+		return -1;
+	}
+
+	off = 0;
+	for (key = fake.first; key; key = key->next) {
+		if (!(fake_perm(key, 0) & KEY_NEED_VIEW) &&
+		    (!(key->perm & KEY_POS_VIEW) || !fake_is_possessed(key)))
+			continue;
+
+		k = &keys[nr++];
+		memset(k, 0, sizeof(*k));
+		k->serial = key->serial;
+		k->flags = KEY_PROC_INSTANTIATED | KEY_PROC_IN_QUOTA;
+		if (key->flags & FAKE_KEY_REVOKED)
+			k->flags |= KEY_PROC_REVOKED;
+		if (key->flags & FAKE_KEY_INVALIDATED)
+			k->flags |= KEY_PROC_INVALIDATED;
+		k->usage = key->usage;
+		if (!key->expiry)
+			k->timeout = -1;
+		else if (key->expiry <= fake.now)
+			k->timeout = 0;
+		else
+			k->timeout = key->expiry - fake.now;
+		k->perm = key->perm;
+		k->uid = fake_munge(key->uid);
+		k->gid = fake_munge(key->gid);
+		k->type = key->type->name;
+		k->type_len = strlen(key->type->name);
+
+		/* the type's summary follows the description, as in the
+		 * kernel's listing */
+		k->desc = heap + off;
+		memcpy(heap + off, key->desc, key->desc_len);
+		off += key->desc_len;
+		if (key->type->is_keyring && key->nr_links == 0)
+			off += sprintf(heap + off, ": empty");
+		else if (key->type->is_keyring)
+			off += sprintf(heap + off, ": %u", key->nr_links);
+		else if (strcmp(key->type->name, "big_key") == 0)
+			off += sprintf(heap + off, ": %zu [%s]", key->plen,
+				       key->plen > FAKE_BIG_KEY_FILE ?
+				       "file" : "buff");
+		else
+			off += sprintf(heap + off, ": %zu", key->plen);
+		k->desc_len = heap + off - k->desc;
+		heap[off++] = '\0';
+	}
+
+	fake_end();
+
+	for (loop = 0; loop < nr; loop++) {
+		ret = func(&keys[loop], data);
+		if (ret != 0)
+			break;
+	}
+
+	free(keys);
+	free(heap);
+	return ret;
+}
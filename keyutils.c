@@ -15,8 +15,16 @@
 #include <stdarg.h>
 #include <string.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
 #include <dlfcn.h>
+#include <pthread.h>
 #include <sys/uio.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <signal.h>
 #include <errno.h>
 #include <asm/unistd.h>
 #include "keyutils.h"
@@ -34,410 +42,3649 @@ static char *(*libc_strerror_r)(int errnum, char *buf, size_t n);
 
 #define __weak __attribute__((weak))
 
-key_serial_t __weak add_key(const char *type,
-			    const char *description,
-			    const void *payload,
-			    size_t plen,
-			    key_serial_t ringid)
-{
-	return syscall(__NR_add_key,
-		       type, description, payload, plen, ringid);
-}
+#ifdef KEYUTILS_USDT
+#include <sys/sdt.h>
+#define keyutils_probe2(name, a, b)	STAP_PROBE2(libkeyutils, name, a, b)
+#define keyutils_probe3(name, a, b, c)	STAP_PROBE3(libkeyutils, name, a, b, c)
+#else
+#define keyutils_probe2(name, a, b)	do {} while (0)
+#define keyutils_probe3(name, a, b, c)	do {} while (0)
+#endif
 
-key_serial_t __weak request_key(const char *type,
-				const char *description,
-				const char * callout_info,
-				key_serial_t destringid)
+static void *keyutils_default_alloc(size_t size, void *data)
 {
-	return syscall(__NR_request_key,
-		       type, description, callout_info, destringid);
+	return malloc(size);
 }
 
-static inline long __keyctl(int cmd,
-			    unsigned long arg2,
-			    unsigned long arg3,
-			    unsigned long arg4,
-			    unsigned long arg5)
+static void keyutils_default_free(void *p, void *data)
 {
-	return syscall(__NR_keyctl,
-		       cmd, arg2, arg3, arg4, arg5);
+	free(p);
 }
 
-long __weak keyctl(int cmd, ...)
-{
-	va_list va;
-	unsigned long arg2, arg3, arg4, arg5;
+static struct keyutils_allocator keyutils_allocator = {
+	.alloc	= keyutils_default_alloc,
+	.free	= keyutils_default_free,
+};
 
-	va_start(va, cmd);
-	arg2 = va_arg(va, unsigned long);
-	arg3 = va_arg(va, unsigned long);
-	arg4 = va_arg(va, unsigned long);
-	arg5 = va_arg(va, unsigned long);
-	va_end(va);
+/*
+ * the allocator needn't set errno when it fails, so do it here
+ */
+static inline void *kalloc(size_t size)
+{
+	void *p;
 
-	return __keyctl(cmd, arg2, arg3, arg4, arg5);
+	p = keyutils_allocator.alloc(size, keyutils_allocator.data);
+	if (!p)
+		errno = ENOMEM;
+	return p;
 }
 
-key_serial_t keyctl_get_keyring_ID(key_serial_t id, int create)
+static inline void kfree(void *p)
 {
-	return keyctl(KEYCTL_GET_KEYRING_ID, id, create);
+	if (p)
+		keyutils_allocator.free(p, keyutils_allocator.data);
 }
 
-key_serial_t keyctl_join_session_keyring(const char *name)
+/*
+ * Syscall statistics
+ * - each thread counts into its own block, which only it writes, so no
+ *   locking or atomic RMW is needed on the fast path
+ * - blocks of exited threads are folded into the retired totals and reused
+ * - resetting records a baseline to subtract rather than zeroing counters
+ *   that other threads are updating
+ */
+struct keyutils_thread_stats {
+	struct keyutils_thread_stats	*next;
+	int				owned;
+	struct keyutils_stats		stats;
+};
+
+static int keyutils_stats_enabled;
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t stats_once = PTHREAD_ONCE_INIT;
+static pthread_key_t stats_key;
+static struct keyutils_thread_stats *stats_threads;
+static struct keyutils_stats stats_retired, stats_base;
+static __thread struct keyutils_thread_stats *stats_mine;
+
+static void stats_add(struct keyutils_stats *to, const struct keyutils_stats *from,
+		      int sign)
 {
-	return keyctl(KEYCTL_JOIN_SESSION_KEYRING, name);
+	const uint64_t *f = (const uint64_t *)from;
+	uint64_t *t = (uint64_t *)to, v;
+	size_t i;
+
+	for (i = 0; i < sizeof(*to) / sizeof(uint64_t); i++) {
+		v = __atomic_load_n(&f[i], __ATOMIC_RELAXED);
+		if (sign > 0)
+			t[i] += v;
+		else
+			t[i] -= v;
+	}
 }
 
-long keyctl_update(key_serial_t id, const void *payload, size_t plen)
+static void stats_thread_exit(void *p)
 {
-	return keyctl(KEYCTL_UPDATE, id, payload, plen);
+	struct keyutils_thread_stats *ts = p;
+
+	pthread_mutex_lock(&stats_lock);
+	stats_add(&stats_retired, &ts->stats, 1);
+	memset(&ts->stats, 0, sizeof(ts->stats));
+	ts->owned = 0;
+	pthread_mutex_unlock(&stats_lock);
+	stats_mine = NULL;
 }
 
-long keyctl_revoke(key_serial_t id)
+static void stats_init_key(void)
 {
-	return keyctl(KEYCTL_REVOKE, id);
+	pthread_key_create(&stats_key, stats_thread_exit);
 }
 
-long keyctl_chown(key_serial_t id, uid_t uid, gid_t gid)
+static struct keyutils_thread_stats *stats_get_mine(void)
 {
-	return keyctl(KEYCTL_CHOWN, id, uid, gid);
+	struct keyutils_thread_stats *ts;
+
+	pthread_once(&stats_once, stats_init_key);
+
+	pthread_mutex_lock(&stats_lock);
+	for (ts = stats_threads; ts; ts = ts->next)
+		if (!ts->owned)
+			break;
+	if (!ts) {
+		/* blocks are recycled but never freed, so they mustn't come
+		 * from an allocator the application might later replace */
+		ts = malloc(sizeof(*ts));
+		if (!ts) {
+			pthread_mutex_unlock(&stats_lock);
+			return NULL;
+		}
+		memset(ts, 0, sizeof(*ts));
+		ts->next = stats_threads;
+		stats_threads = ts;
+	}
+	ts->owned = 1;
+	pthread_mutex_unlock(&stats_lock);
+
+	pthread_setspecific(stats_key, ts);
+	stats_mine = ts;
+	return ts;
 }
 
-long keyctl_setperm(key_serial_t id, key_perm_t perm)
+static inline void stats_inc(uint64_t *p, uint64_t n)
 {
-	return keyctl(KEYCTL_SETPERM, id, perm);
+	__atomic_store_n(p, *p + n, __ATOMIC_RELAXED);
 }
 
-long keyctl_describe(key_serial_t id, char *buffer, size_t buflen)
+static void stats_record(unsigned op, int failed, uint64_t ns)
 {
-	return keyctl(KEYCTL_DESCRIBE, id, buffer, buflen);
+	struct keyutils_thread_stats *ts = stats_mine;
+	struct keyutils_op_stats *o;
+	unsigned bucket;
+
+	if (!ts) {
+		ts = stats_get_mine();
+		if (!ts)
+			return;
+	}
+
+	bucket = ns ? 63 - __builtin_clzll(ns) : 0;
+	if (bucket >= KEYUTILS_STATS_NR_BUCKETS)
+		bucket = KEYUTILS_STATS_NR_BUCKETS - 1;
+
+	o = &ts->stats.ops[op];
+	stats_inc(&o->calls, 1);
+	if (failed)
+		stats_inc(&o->errors, 1);
+	stats_inc(&o->total_ns, ns);
+	stats_inc(&o->latency[bucket], 1);
 }
 
-long keyctl_clear(key_serial_t ringid)
+/*
+ * make a syscall, timing it and counting it against the given op
+ */
+static long stats_syscall(unsigned op, long nr,
+			  unsigned long arg1, unsigned long arg2,
+			  unsigned long arg3, unsigned long arg4,
+			  unsigned long arg5)
 {
-	return keyctl(KEYCTL_CLEAR, ringid);
+	struct timespec t0, t1;
+	long ret;
+	int err;
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	ret = syscall(nr, arg1, arg2, arg3, arg4, arg5);
+	err = errno;
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+
+	stats_record(op, ret < 0,
+		     (t1.tv_sec - t0.tv_sec) * 1000000000ULL +
+		     t1.tv_nsec - t0.tv_nsec);
+	errno = err;
+	return ret;
 }
 
-long keyctl_link(key_serial_t id, key_serial_t ringid)
+static void __attribute__((constructor)) stats_init(void)
 {
-	return keyctl(KEYCTL_LINK, id, ringid);
+	const char *env = getenv("KEYUTILS_STATS");
+
+	if (env && *env && strcmp(env, "0") != 0)
+		keyutils_stats_enabled = 1;
 }
 
-long keyctl_unlink(key_serial_t id, key_serial_t ringid)
+/*
+ * Turn statistics gathering on or off, returning the previous state
+ */
+int keyutils_stats_enable(int enable)
 {
-	return keyctl(KEYCTL_UNLINK, id, ringid);
+	return __atomic_exchange_n(&keyutils_stats_enabled, !!enable,
+				   __ATOMIC_RELAXED);
 }
 
-long keyctl_search(key_serial_t ringid,
-		   const char *type,
-		   const char *description,
-		   key_serial_t destringid)
+static void stats_gather(struct keyutils_stats *stats)
 {
-	return keyctl(KEYCTL_SEARCH, ringid, type, description, destringid);
+	struct keyutils_thread_stats *ts;
+
+	memcpy(stats, &stats_retired, sizeof(*stats));
+	for (ts = stats_threads; ts; ts = ts->next)
+		stats_add(stats, &ts->stats, 1);
 }
 
-long keyctl_read(key_serial_t id, char *buffer, size_t buflen)
+/*
+ * Get the statistics gathered since the last reset, summed over all threads
+ */
+int keyutils_stats_snapshot(struct keyutils_stats *stats)
 {
-	return keyctl(KEYCTL_READ, id, buffer, buflen);
+	pthread_mutex_lock(&stats_lock);
+	stats_gather(stats);
+	stats_add(stats, &stats_base, -1);
+	pthread_mutex_unlock(&stats_lock);
+	return 0;
 }
 
-long keyctl_instantiate(key_serial_t id,
-			const void *payload,
-			size_t plen,
-			key_serial_t ringid)
+/*
+ * Restart the statistics from zero
+ */
+void keyutils_stats_reset(void)
 {
-	return keyctl(KEYCTL_INSTANTIATE, id, payload, plen, ringid);
+	pthread_mutex_lock(&stats_lock);
+	stats_gather(&stats_base);
+	pthread_mutex_unlock(&stats_lock);
 }
 
-long keyctl_negate(key_serial_t id, unsigned timeout, key_serial_t ringid)
+/*
+ * Negative lookup cache
+ * - if enabled, request_key() and keyctl_search() failures with ENOKEY or
+ *   EKEYREJECTED are remembered for a while so that asking again fails
+ *   without a syscall
+ * - entries are keyed on the op, type, description, callout info and keyring
+ *   and are dropped early if this process adds a key of that type and
+ *   description, links such a key into a keyring or changes its permissions or
+ *   ownership; all are dropped if a keyring is so treated
+ * - request_key() failures are not cached if the lookup involves the calling
+ *   thread's thread keyring
+ * - the names are kept as "type\0desc\0info" in one allocation, which comes
+ *   from libc as the entries can outlive the allocator that was current when
+ *   they were made
+ */
+#define NEG_CACHE_SLOTS		256
+#define NEG_CACHE_MAX		4096
+
+enum neg_cache_op {
+	NEG_CACHE_REQUEST_KEY,
+	NEG_CACHE_SEARCH,
+};
+
+struct neg_cache_entry {
+	struct neg_cache_entry	*next;
+	uint32_t		hash;		/* hash of type and desc only */
+	enum neg_cache_op	op;
+	key_serial_t		ringid;
+	int			error;
+	uint64_t		expiry;
+	size_t			type_len;
+	size_t			desc_len;
+	int			has_info;
+	char			name[];
+};
+
+static unsigned neg_cache_ttl;		/* ms, or 0 if disabled */
+static unsigned neg_cache_nr;
+static pthread_mutex_t neg_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t neg_cache_once = PTHREAD_ONCE_INIT;
+static struct neg_cache_entry *neg_cache[NEG_CACHE_SLOTS];
+
+static uint32_t key_index_hash(uint32_t hash, const char *p, size_t len);
+
+static uint64_t neg_cache_now(void)
 {
-	return keyctl(KEYCTL_NEGATE, id, timeout, ringid);
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
 }
 
-long keyctl_set_reqkey_keyring(int reqkey_defl)
+/*
+ * discard entries, all of them or just those that have expired
+ * - the caller must hold neg_cache_lock
+ */
+static void neg_cache_prune(int all)
 {
-	return keyctl(KEYCTL_SET_REQKEY_KEYRING, reqkey_defl);
+	struct neg_cache_entry *e, **pp;
+	uint64_t now = all ? 0 : neg_cache_now();
+	unsigned i;
+
+	for (i = 0; i < NEG_CACHE_SLOTS; i++) {
+		pp = &neg_cache[i];
+		while ((e = *pp)) {
+			if (all || e->expiry <= now) {
+				*pp = e->next;
+				free(e);
+				neg_cache_nr--;
+			} else {
+				pp = &e->next;
+			}
+		}
+	}
 }
 
-long keyctl_set_timeout(key_serial_t id, unsigned timeout)
+static void neg_cache_prepare(void)
 {
-	return keyctl(KEYCTL_SET_TIMEOUT, id, timeout);
+	pthread_mutex_lock(&neg_cache_lock);
 }
 
-long keyctl_assume_authority(key_serial_t id)
+static void neg_cache_parent(void)
 {
-	return keyctl(KEYCTL_ASSUME_AUTHORITY, id);
+	pthread_mutex_unlock(&neg_cache_lock);
 }
 
-long keyctl_get_security(key_serial_t id, char *buffer, size_t buflen)
+/*
+ * the child of a fork has different process and thread keyrings, so what we
+ * remember may not hold there
+ */
+static void neg_cache_child(void)
 {
-	return keyctl(KEYCTL_GET_SECURITY, id, buffer, buflen);
+	neg_cache_prune(1);
+	pthread_mutex_unlock(&neg_cache_lock);
 }
 
-long keyctl_session_to_parent(void)
+static void neg_cache_init(void)
 {
-	return keyctl(KEYCTL_SESSION_TO_PARENT);
+	pthread_atfork(neg_cache_prepare, neg_cache_parent, neg_cache_child);
 }
 
-long keyctl_reject(key_serial_t id, unsigned timeout, unsigned error,
-		   key_serial_t ringid)
+static uint32_t neg_cache_hash(const char *type, const char *desc)
 {
-	long ret = keyctl(KEYCTL_REJECT, id, timeout, error, ringid);
+	uint32_t hash;
 
-	/* fall back to keyctl_negate() if this op is not supported by this
-	 * kernel version */
-	if (ret == -1 && errno == EOPNOTSUPP)
-		return keyctl_negate(id, timeout, ringid);
-	return ret;
+	hash = key_index_hash(2166136261U, type, strlen(type) + 1);
+	return key_index_hash(hash, desc, strlen(desc));
 }
 
-long keyctl_instantiate_iov(key_serial_t id,
-			    const struct iovec *payload_iov,
-			    unsigned ioc,
+/*
+ * see if a lookup is known to fail, returning the error if so or 0 if not
+ */
+static int neg_cache_lookup(enum neg_cache_op op, const char *type,
+			    const char *desc, const char *info,
 			    key_serial_t ringid)
 {
-	long ret = keyctl(KEYCTL_INSTANTIATE_IOV, id, payload_iov, ioc, ringid);
-
-	/* fall back to keyctl_instantiate() if this op is not supported by
-	 * this kernel version */
-	if (ret == -1 && errno == EOPNOTSUPP) {
-		unsigned loop;
-		size_t bsize = 0, seg;
-		void *buf, *p;
+	struct neg_cache_entry *e;
+	uint32_t hash = neg_cache_hash(type, desc);
+	uint64_t now = neg_cache_now();
+	size_t type_len = strlen(type), desc_len = strlen(desc);
+	const char *p;
+	int error = 0;
 
-		if (!payload_iov || !ioc)
-			return keyctl_instantiate(id, NULL, 0, ringid);
-		for (loop = 0; loop < ioc; loop++)
-			bsize += payload_iov[loop].iov_len;
-		if (bsize == 0)
-			return keyctl_instantiate(id, NULL, 0, ringid);
-		p = buf = malloc(bsize);
-		if (!buf)
-			return -1;
-		for (loop = 0; loop < ioc; loop++) {
-			seg = payload_iov[loop].iov_len;
-			p = memcpy(p, payload_iov[loop].iov_base, seg) + seg;
-		}
-		ret = keyctl_instantiate(id, buf, bsize, ringid);
-		free(buf);
+	pthread_mutex_lock(&neg_cache_lock);
+	for (e = neg_cache[hash % NEG_CACHE_SLOTS]; e; e = e->next) {
+		if (e->hash != hash || e->op != op || e->ringid != ringid ||
+		    e->type_len != type_len || e->desc_len != desc_len ||
+		    e->has_info != !!info || e->expiry <= now)
+			continue;
+		p = e->name;
+		if (memcmp(p, type, type_len) != 0)
+			continue;
+		p += type_len + 1;
+		if (memcmp(p, desc, desc_len) != 0)
+			continue;
+		p += desc_len + 1;
+		if (info && strcmp(p, info) != 0)
+			continue;
+		error = e->error;
+		break;
 	}
-	return ret;
-}
-
-long keyctl_invalidate(key_serial_t id)
-{
-	return keyctl(KEYCTL_INVALIDATE, id);
+	pthread_mutex_unlock(&neg_cache_lock);
+	return error;
 }
 
-long keyctl_get_persistent(uid_t uid, key_serial_t id)
-{
-	return keyctl(KEYCTL_GET_PERSISTENT, uid, id);
-}
-
-/*****************************************************************************/
 /*
- * fetch key description into an allocated buffer
- * - resulting string is NUL terminated
- * - returns count not including NUL
+ * remember that a lookup failed
  */
-int keyctl_describe_alloc(key_serial_t id, char **_buffer)
+static void neg_cache_insert(enum neg_cache_op op, const char *type,
+			     const char *desc, const char *info,
+			     key_serial_t ringid, int error, unsigned ttl)
 {
-	char *buf;
-	long buflen, ret;
-
-	ret = keyctl_describe(id, NULL, 0);
-	if (ret < 0)
-		return -1;
-
-	for (;;) {
-		buflen = ret;
-		buf = malloc(buflen);
-		if (!buf)
-			return -1;
+	struct neg_cache_entry *e;
+	size_t type_len = strlen(type), desc_len = strlen(desc);
+	size_t info_len = info ? strlen(info) : 0;
+	uint32_t hash = neg_cache_hash(type, desc);
+	char *p;
 
-		ret = keyctl_describe(id, buf, buflen);
-		if (ret < 0) {
-			free(buf);
-			return -1;
-		}
+	e = malloc(sizeof(*e) + type_len + desc_len + info_len + 3);
+	if (!e)
+		return;
+	e->hash		= hash;
+	e->op		= op;
+	e->ringid	= ringid;
+	e->error	= error;
+	e->expiry	= neg_cache_now() + ttl * 1000000ULL;
+	e->type_len	= type_len;
+	e->desc_len	= desc_len;
+	e->has_info	= !!info;
+	p = e->name;
+	memcpy(p, type, type_len + 1);
+	p += type_len + 1;
+	memcpy(p, desc, desc_len + 1);
+	p += desc_len + 1;
+	memcpy(p, info ?: "", info_len + 1);
 
-		if (buflen >= ret)
-			break;
-		free(buf);
+	pthread_mutex_lock(&neg_cache_lock);
+	if (neg_cache_nr >= NEG_CACHE_MAX)
+		neg_cache_prune(0);
+	if (neg_cache_nr >= NEG_CACHE_MAX) {
+		pthread_mutex_unlock(&neg_cache_lock);
+		free(e);
+		return;
 	}
-
-	*_buffer = buf;
-	return ret - 1;
+	e->next = neg_cache[hash % NEG_CACHE_SLOTS];
+	neg_cache[hash % NEG_CACHE_SLOTS] = e;
+	neg_cache_nr++;
+	pthread_mutex_unlock(&neg_cache_lock);
 }
 
-/*****************************************************************************/
 /*
- * fetch key contents into an allocated buffer
- * - resulting buffer has an extra NUL added to the end
- * - returns count (not including extraneous NUL)
+ * forget the failures of lookups for a particular type and description
  */
-int keyctl_read_alloc(key_serial_t id, void **_buffer)
+static void neg_cache_drop(const char *type, size_t type_len,
+			   const char *desc, size_t desc_len)
 {
-	char *buf;
-	long buflen, ret;
+	struct neg_cache_entry *e, **pp;
+	uint32_t hash;
 
-	ret = keyctl_read(id, NULL, 0);
-	if (ret < 0)
-		return -1;
-
-	for (;;) {
-		buflen = ret;
-		buf = malloc(buflen + 1);
-		if (!buf)
-			return -1;
+	hash = key_index_hash(2166136261U, type, type_len);
+	hash = key_index_hash(hash, "", 1);
+	hash = key_index_hash(hash, desc, desc_len);
 
-		ret = keyctl_read(id, buf, buflen);
-		if (ret < 0) {
-			free(buf);
-			return -1;
+	pthread_mutex_lock(&neg_cache_lock);
+	pp = &neg_cache[hash % NEG_CACHE_SLOTS];
+	while ((e = *pp)) {
+		if (e->hash == hash &&
+		    e->type_len == type_len &&
+		    e->desc_len == desc_len &&
+		    memcmp(e->name, type, type_len) == 0 &&
+		    memcmp(e->name + type_len + 1, desc, desc_len) == 0) {
+			*pp = e->next;
+			free(e);
+			neg_cache_nr--;
+		} else {
+			pp = &e->next;
 		}
-
-		if (buflen >= ret)
-			break;
-		free(buf);
 	}
-
-	buf[ret] = 0;
-	*_buffer = buf;
-	return ret;
+	pthread_mutex_unlock(&neg_cache_lock);
 }
 
-/*****************************************************************************/
 /*
- * fetch key security label into an allocated buffer
- * - resulting string is NUL terminated
- * - returns count not including NUL
+ * a key has been linked into a keyring or has had its permissions or ownership
+ * changed, so forget the failures of lookups that might now find it
+ * - if it's a keyring, then anything it contains might now be found, so forget
+ *   everything
  */
-int keyctl_get_security_alloc(key_serial_t id, char **_buffer)
+static void neg_cache_exposed(key_serial_t id)
 {
-	char *buf;
-	long buflen, ret;
-
-	ret = keyctl_get_security(id, NULL, 0);
-	if (ret < 0)
-		return -1;
-
-	for (;;) {
-		buflen = ret;
-		buf = malloc(buflen);
-		if (!buf)
-			return -1;
+	struct keyctl_key_desc kd;
+	char buf[512];
+	long len;
 
-		ret = keyctl_get_security(id, buf, buflen);
-		if (ret < 0) {
-			free(buf);
-			return -1;
-		}
+	if (!__atomic_load_n(&neg_cache_nr, __ATOMIC_RELAXED))
+		return;
 
-		if (buflen >= ret)
-			break;
-		free(buf);
+	len = keyctl_describe(id, buf, sizeof(buf));
+	if (len > 0 && len <= sizeof(buf) &&
+	    keyctl_parse_description(buf, len, &kd) == 0 &&
+	    !(kd.type_len == 7 && memcmp(kd.type, "keyring", 7) == 0)) {
+		neg_cache_drop(kd.type, kd.type_len, kd.desc, kd.desc_len);
+		return;
 	}
 
-	*_buffer = buf;
-	return ret - 1;
+	/* we don't know what it was or it may contain anything, so forget
+	 * everything */
+	keyutils_negative_cache_flush();
 }
 
 /*
- * Depth-first recursively apply a function over a keyring tree
+ * see if a request_key() lookup might involve this thread's thread keyring,
+ * which no other thread would see
+ * - the search starts with the thread keyring if there is one
+ * - the default destination may be the thread keyring and it's per-thread
+ *   which keyring that is
  */
-static int recursive_key_scan_aux(key_serial_t parent, key_serial_t key,
-				  int depth, recursive_key_scanner_t func,
-				  void *data)
+static int neg_cache_thread_specific(key_serial_t destringid)
 {
-	key_serial_t *pk;
-	key_perm_t perm;
-	size_t ringlen;
-	void *ring;
-	char *desc, type[255];
-	int desc_len, uid, gid, ret, n, kcount = 0;
-
-	if (depth > 800)
-		return 0;
-
-	/* read the key description */
-	desc = NULL;
-	desc_len = keyctl_describe_alloc(key, &desc);
-	if (desc_len < 0)
-		goto do_this_key;
-
-	/* parse */
-	type[0] = 0;
-
-	n = sscanf(desc, "%[^;];%d;%d;%x;", type, &uid, &gid, &perm);
-	if (n != 4) {
-		free(desc);
-		desc = NULL;
-		errno = -EINVAL;
-		desc_len = -1;
-		goto do_this_key;
-	}
-
-	/* if it's a keyring then we're going to want to recursively search it
-	 * if we can */
-	if (strcmp(type, "keyring") == 0) {
-		/* read the keyring's contents */
-		ret = keyctl_read_alloc(key, &ring);
-		if (ret < 0)
-			goto do_this_key;
-
-		ringlen = ret;
-
-		/* walk the keyring */
-		pk = ring;
-		for (ringlen = ret;
-		     ringlen >= sizeof(key_serial_t);
-		     ringlen -= sizeof(key_serial_t)
-		     )
-			kcount += recursive_key_scan_aux(key, *pk++, depth + 1,
-							 func, data);
+	if (destringid == 0 || destringid == KEY_SPEC_THREAD_KEYRING)
+		return 1;
+	return keyctl_get_keyring_ID_cached(KEY_SPEC_THREAD_KEYRING, 0) > 0;
+}
 
-		free(ring);
-	}
+static void __attribute__((constructor)) neg_cache_env_init(void)
+{
+	const char *env = getenv("KEYUTILS_NEGATIVE_CACHE");
 
-do_this_key:
-	kcount += func(parent, key, desc, desc_len, data);
-	free(desc);
-	return kcount;
+	if (env && *env)
+		keyutils_negative_cache_enable(strtoul(env, NULL, 0));
 }
 
 /*
- * Depth-first apply a function over a keyring tree
+ * Turn the negative lookup cache on with the given TTL in milliseconds, or off
+ * if the TTL is 0, returning the previous TTL
  */
-int recursive_key_scan(key_serial_t key, recursive_key_scanner_t func, void *data)
+unsigned keyutils_negative_cache_enable(unsigned ttl)
 {
-	return recursive_key_scan_aux(0, key, 0, func, data);
+	pthread_once(&neg_cache_once, neg_cache_init);
+	ttl = __atomic_exchange_n(&neg_cache_ttl, ttl, __ATOMIC_RELAXED);
+	if (!neg_cache_ttl)
+		keyutils_negative_cache_flush();
+	return ttl;
 }
 
 /*
- * Depth-first apply a function over session keyring tree
+ * Forget all the failed lookups that have been cached
  */
-int recursive_session_key_scan(recursive_key_scanner_t func, void *data)
+void keyutils_negative_cache_flush(void)
 {
-	key_serial_t session =
-		keyctl_get_keyring_ID(KEY_SPEC_SESSION_KEYRING, 0);
-	if (session > 0)
-		return recursive_key_scan(session, func, data);
-	return 0;
+	pthread_mutex_lock(&neg_cache_lock);
+	neg_cache_prune(1);
+	pthread_mutex_unlock(&neg_cache_lock);
 }
 
-/*
- * Find a key by type and description
- */
-key_serial_t find_key_by_type_and_desc(const char *type, const char *desc,
-				       key_serial_t destringid)
+key_serial_t __weak add_key(const char *type,
+			    const char *description,
+			    const void *payload,
+			    size_t plen,
+			    key_serial_t ringid)
 {
-	key_serial_t id, error;
-	FILE *f;
-	char buf[1024], typebuf[40], rdesc[1024], *kdesc, *cp;
-	int n, ndesc, dlen;
+	key_serial_t ret;
 
-	error = ENOKEY;
+	keyutils_probe3(add_key_entry, type, description, ringid);
+	if (__builtin_expect(keyutils_stats_enabled, 0))
+		ret = stats_syscall(KEYUTILS_STATS_ADD_KEY, __NR_add_key,
+				    (unsigned long)type,
+				    (unsigned long)description,
+				    (unsigned long)payload, plen, ringid);
+	else
+		ret = syscall(__NR_add_key,
+			      type, description, payload, plen, ringid);
+	keyutils_probe2(add_key_return, ringid, ret);
+	if (__builtin_expect(neg_cache_ttl, 0) && ret != -1)
+		neg_cache_drop(type, strlen(type),
+			       description, strlen(description));
+	return ret;
+}
+
+key_serial_t __weak request_key(const char *type,
+				const char *description,
+				const char * callout_info,
+				key_serial_t destringid)
+{
+	key_serial_t ret;
+	unsigned ttl = neg_cache_ttl;
+	int err;
+
+	if (__builtin_expect(ttl, 0) && neg_cache_thread_specific(destringid))
+		ttl = 0;
+
+	if (__builtin_expect(ttl, 0)) {
+		err = neg_cache_lookup(NEG_CACHE_REQUEST_KEY, type, description,
+				       callout_info, destringid);
+		if (err) {
+			errno = err;
+			return -1;
+		}
+	}
+
+	keyutils_probe3(request_key_entry, type, description, destringid);
+	if (__builtin_expect(keyutils_stats_enabled, 0))
+		ret = stats_syscall(KEYUTILS_STATS_REQUEST_KEY, __NR_request_key,
+				    (unsigned long)type,
+				    (unsigned long)description,
+				    (unsigned long)callout_info, destringid, 0);
+	else
+		ret = syscall(__NR_request_key,
+			      type, description, callout_info, destringid);
+	keyutils_probe2(request_key_return, destringid, ret);
+	if (__builtin_expect(ttl, 0) && ret == -1 &&
+	    (errno == ENOKEY || errno == EKEYREJECTED)) {
+		err = errno;
+		neg_cache_insert(NEG_CACHE_REQUEST_KEY, type, description,
+				 callout_info, destringid, err, ttl);
+		errno = err;
+	}
+	return ret;
+}
+
+static inline long __keyctl(int cmd,
+			    unsigned long arg2,
+			    unsigned long arg3,
+			    unsigned long arg4,
+			    unsigned long arg5)
+{
+	long ret;
+
+	keyutils_probe2(keyctl_entry, cmd, arg2);
+	if (__builtin_expect(keyutils_stats_enabled, 0))
+		ret = stats_syscall((unsigned)cmd < KEYUTILS_STATS_NR_KEYCTL ?
+				    cmd : KEYUTILS_STATS_KEYCTL_OTHER,
+				    __NR_keyctl, cmd, arg2, arg3, arg4, arg5);
+	else
+		ret = syscall(__NR_keyctl,
+			      cmd, arg2, arg3, arg4, arg5);
+	keyutils_probe3(keyctl_return, cmd, arg2, ret);
+	return ret;
+}
+
+long __weak keyctl(int cmd, ...)
+{
+	va_list va;
+	unsigned long arg2, arg3, arg4, arg5;
+
+	va_start(va, cmd);
+	arg2 = va_arg(va, unsigned long);
+	arg3 = va_arg(va, unsigned long);
+	arg4 = va_arg(va, unsigned long);
+	arg5 = va_arg(va, unsigned long);
+	va_end(va);
+
+	return __keyctl(cmd, arg2, arg3, arg4, arg5);
+}
+
+key_serial_t keyctl_get_keyring_ID(key_serial_t id, int create)
+{
+	return keyctl(KEYCTL_GET_KEYRING_ID, id, create);
+}
+
+/*****************************************************************************/
+/*
+ * cache of what the special keyring IDs resolve to
+ * - the cache is per-thread as the thread keyring and the session keyring are
+ *   per-thread credentials
+ * - bumping the generation number discards what every thread remembers
+ * - only successful resolutions are cached, so asking again for a keyring that
+ *   didn't exist will find it once it has been created
+ * - @g, the request_key authorisation key and the requestor keyring are never
+ *   cached
+ */
+#define SPECIAL_ID_FIRST	KEY_SPEC_USER_SESSION_KEYRING
+#define SPECIAL_ID_NR		(-SPECIAL_ID_FIRST)
+
+static unsigned special_id_gen = 1;
+static pthread_once_t special_id_once = PTHREAD_ONCE_INIT;
+
+static __thread struct {
+	unsigned	gen;
+	key_serial_t	serial[SPECIAL_ID_NR];
+} special_ids;
+
+void keyutils_keyring_ID_cache_flush(void)
+{
+	__atomic_add_fetch(&special_id_gen, 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * the child of a fork gets no process keyring or thread keyring of its own
+ * until it asks for them
+ */
+static void special_id_init(void)
+{
+	pthread_atfork(NULL, NULL, keyutils_keyring_ID_cache_flush);
+}
+
+/*
+ * a key has been revoked or invalidated and may be one that some thread has
+ * cached, but we can't see into other threads' caches, so make them all look
+ * again
+ */
+static void special_id_forget(key_serial_t id)
+{
+	keyutils_keyring_ID_cache_flush();
+}
+
+key_serial_t keyctl_get_keyring_ID_cached(key_serial_t id, int create)
+{
+	key_serial_t serial;
+	unsigned gen, slot;
+
+	if (id >= 0 || id < SPECIAL_ID_FIRST)
+		return keyctl_get_keyring_ID(id, create);
+
+	pthread_once(&special_id_once, special_id_init);
+
+	slot = -id - 1;
+	gen = __atomic_load_n(&special_id_gen, __ATOMIC_ACQUIRE);
+	if (special_ids.gen != gen) {
+		memset(special_ids.serial, 0, sizeof(special_ids.serial));
+		special_ids.gen = gen;
+	}
+	if (special_ids.serial[slot])
+		return special_ids.serial[slot];
+
+	serial = keyctl_get_keyring_ID(id, create);
+	if (serial > 0)
+		special_ids.serial[slot] = serial;
+	return serial;
+}
+
+/*****************************************************************************/
+/*
+ * Kernel feature cache
+ * - a bit per KEYCTL_* command, noting whether we know if the kernel has it and
+ *   if so, whether it does
+ * - the wrappers for commands that have been added over time note what they
+ *   learn when called and don't bother the kernel again once it's known that
+ *   the command isn't there
+ * - the kernel can't lose a command whilst we're running, so there's no need to
+ *   forget anything
+ */
+#define FEATURE_NR_KEYCTL	(KEYCTL_GET_PERSISTENT + 1)
+
+static uint64_t features_known, features_present;
+
+static void feature_set(uint64_t mask, int present)
+{
+	if (present)
+		__atomic_or_fetch(&features_present, mask, __ATOMIC_RELAXED);
+	__atomic_or_fetch(&features_known, mask, __ATOMIC_RELEASE);
+}
+
+/*
+ * see if a command is known to be missing
+ */
+static int feature_missing(int cmd)
+{
+	uint64_t known = __atomic_load_n(&features_known, __ATOMIC_ACQUIRE);
+
+	return (known & KEYCTL_FEATURE(cmd)) &&
+		!(features_present & KEYCTL_FEATURE(cmd));
+}
+
+/*
+ * note what the result of a command says about its presence
+ * - only EOPNOTSUPP says that the command is missing; any other result, error
+ *   or not, says that the kernel knew what to do with it
+ */
+static void feature_note(int cmd, long ret)
+{
+	if (ret == -1 && errno == ENOSYS)
+		return;
+	if (ret == -1 && errno == EOPNOTSUPP)
+		feature_set(KEYCTL_FEATURE(cmd), 0);
+	else
+		feature_set(KEYCTL_FEATURE(cmd), 1);
+}
+
+/*
+ * fail a command that's known to be missing
+ */
+static long feature_absent(void)
+{
+	errno = EOPNOTSUPP;
+	return -1;
+}
+
+/*
+ * ways of asking the kernel about each command that will be rejected without
+ * anything happening
+ * - the commands that came with the original keyrings support are all
+ *   answered by KEYCTL_GET_KEYRING_ID
+ * - KEYCTL_SESSION_TO_PARENT can't be tried without its taking effect, so
+ *   it's assumed to be present if KEYCTL_REJECT, which followed it, is
+ */
+static const struct feature_probe {
+	int		cmd;
+	uint64_t	covers;
+	unsigned long	arg2, arg3, arg4, arg5;
+} feature_probes[] = {
+	/* key ID 0 is never valid */
+	{ KEYCTL_GET_KEYRING_ID,
+	  (KEYCTL_FEATURE(KEYCTL_NEGATE) << 1) - 1, 0, 0 },
+	{ KEYCTL_SET_REQKEY_KEYRING,
+	  KEYCTL_FEATURE(KEYCTL_SET_REQKEY_KEYRING),
+	  (unsigned long)KEY_REQKEY_DEFL_NO_CHANGE },
+	{ KEYCTL_SET_TIMEOUT,
+	  KEYCTL_FEATURE(KEYCTL_SET_TIMEOUT), 0, 0 },
+	/* special IDs may not be assumed; 0 would discard our authority */
+	{ KEYCTL_ASSUME_AUTHORITY,
+	  KEYCTL_FEATURE(KEYCTL_ASSUME_AUTHORITY),
+	  (unsigned long)KEY_SPEC_THREAD_KEYRING },
+	{ KEYCTL_GET_SECURITY,
+	  KEYCTL_FEATURE(KEYCTL_GET_SECURITY), 0, 0, 0 },
+	/* an error of 0 is invalid */
+	{ KEYCTL_REJECT,
+	  KEYCTL_FEATURE(KEYCTL_REJECT) |
+	  KEYCTL_FEATURE(KEYCTL_SESSION_TO_PARENT), 0, 0, 0, 0 },
+	/* we can't hold the authority to instantiate key 0 */
+	{ KEYCTL_INSTANTIATE_IOV,
+	  KEYCTL_FEATURE(KEYCTL_INSTANTIATE_IOV), 0, 0, 0, 0 },
+	{ KEYCTL_INVALIDATE,
+	  KEYCTL_FEATURE(KEYCTL_INVALIDATE), 0 },
+	{ KEYCTL_GET_PERSISTENT,
+	  KEYCTL_FEATURE(KEYCTL_GET_PERSISTENT), (unsigned long)-1, 0 },
+};
+
+/*
+ * find out which of the given KEYCTL_* commands the kernel supports
+ * - each command is only asked about once per process, and not at all if
+ *   its presence has already been learnt from calling it
+ * - returns a bitmap of KEYCTL_FEATURE() bits, only those asked for being
+ *   certain
+ */
+uint64_t keyutils_probe_features(uint64_t which)
+{
+	const struct feature_probe *p;
+	uint64_t known;
+	unsigned i;
+	long ret;
+	int err = errno;
+
+	which &= (1ULL << FEATURE_NR_KEYCTL) - 1;
+
+	for (i = 0; i < sizeof(feature_probes) / sizeof(feature_probes[0]); i++) {
+		p = &feature_probes[i];
+		known = __atomic_load_n(&features_known, __ATOMIC_ACQUIRE);
+		if (!(which & p->covers & ~known))
+			continue;
+
+		ret = keyctl(p->cmd, p->arg2, p->arg3, p->arg4, p->arg5);
+		if (ret == -1 && errno == ENOSYS) {
+			/* no keyrings support at all */
+			feature_set((1ULL << FEATURE_NR_KEYCTL) - 1, 0);
+			break;
+		}
+		feature_set(p->covers,
+			    !(ret == -1 && errno == EOPNOTSUPP));
+	}
+
+	errno = err;
+	return __atomic_load_n(&features_present, __ATOMIC_RELAXED);
+}
+
+key_serial_t keyctl_join_session_keyring(const char *name)
+{
+	key_serial_t ret;
+
+	ret = keyctl(KEYCTL_JOIN_SESSION_KEYRING, name);
+	if (ret != -1) {
+		keyutils_keyring_ID_cache_flush();
+		if (__builtin_expect(neg_cache_ttl, 0))
+			keyutils_negative_cache_flush();
+	}
+	return ret;
+}
+
+long keyctl_update(key_serial_t id, const void *payload, size_t plen)
+{
+	return keyctl(KEYCTL_UPDATE, id, payload, plen);
+}
+
+long keyctl_revoke(key_serial_t id)
+{
+	long ret;
+
+	ret = keyctl(KEYCTL_REVOKE, id);
+	if (ret == 0)
+		special_id_forget(id);
+	return ret;
+}
+
+long keyctl_chown(key_serial_t id, uid_t uid, gid_t gid)
+{
+	long ret;
+
+	ret = keyctl(KEYCTL_CHOWN, id, uid, gid);
+	if (__builtin_expect(neg_cache_ttl, 0) && ret != -1)
+		neg_cache_exposed(id);
+	return ret;
+}
+
+long keyctl_setperm(key_serial_t id, key_perm_t perm)
+{
+	long ret;
+
+	ret = keyctl(KEYCTL_SETPERM, id, perm);
+	if (__builtin_expect(neg_cache_ttl, 0) && ret != -1)
+		neg_cache_exposed(id);
+	return ret;
+}
+
+long keyctl_describe(key_serial_t id, char *buffer, size_t buflen)
+{
+	return keyctl(KEYCTL_DESCRIBE, id, buffer, buflen);
+}
+
+long keyctl_clear(key_serial_t ringid)
+{
+	return keyctl(KEYCTL_CLEAR, ringid);
+}
+
+long keyctl_link(key_serial_t id, key_serial_t ringid)
+{
+	long ret;
+
+	ret = keyctl(KEYCTL_LINK, id, ringid);
+	if (__builtin_expect(neg_cache_ttl, 0) && ret != -1)
+		neg_cache_exposed(id);
+	return ret;
+}
+
+long keyctl_unlink(key_serial_t id, key_serial_t ringid)
+{
+	return keyctl(KEYCTL_UNLINK, id, ringid);
+}
+
+long keyctl_search(key_serial_t ringid,
+		   const char *type,
+		   const char *description,
+		   key_serial_t destringid)
+{
+	unsigned ttl = neg_cache_ttl;
+	long ret;
+	int err;
+
+	/* the thread keyring is different in each thread */
+	if (__builtin_expect(ttl, 0) && ringid == KEY_SPEC_THREAD_KEYRING)
+		ttl = 0;
+
+	if (__builtin_expect(ttl, 0)) {
+		err = neg_cache_lookup(NEG_CACHE_SEARCH, type, description,
+				       NULL, ringid);
+		if (err) {
+			errno = err;
+			return -1;
+		}
+	}
+
+	ret = keyctl(KEYCTL_SEARCH, ringid, type, description, destringid);
+	if (__builtin_expect(ttl, 0) && ret == -1 &&
+	    (errno == ENOKEY || errno == EKEYREJECTED)) {
+		err = errno;
+		neg_cache_insert(NEG_CACHE_SEARCH, type, description, NULL,
+				 ringid, err, ttl);
+		errno = err;
+	}
+	return ret;
+}
+
+long keyctl_read(key_serial_t id, char *buffer, size_t buflen)
+{
+	return keyctl(KEYCTL_READ, id, buffer, buflen);
+}
+
+long keyctl_instantiate(key_serial_t id,
+			const void *payload,
+			size_t plen,
+			key_serial_t ringid)
+{
+	return keyctl(KEYCTL_INSTANTIATE, id, payload, plen, ringid);
+}
+
+long keyctl_negate(key_serial_t id, unsigned timeout, key_serial_t ringid)
+{
+	return keyctl(KEYCTL_NEGATE, id, timeout, ringid);
+}
+
+long keyctl_set_reqkey_keyring(int reqkey_defl)
+{
+	return keyctl(KEYCTL_SET_REQKEY_KEYRING, reqkey_defl);
+}
+
+long keyctl_set_timeout(key_serial_t id, unsigned timeout)
+{
+	return keyctl(KEYCTL_SET_TIMEOUT, id, timeout);
+}
+
+long keyctl_assume_authority(key_serial_t id)
+{
+	long ret;
+
+	if (feature_missing(KEYCTL_ASSUME_AUTHORITY))
+		return feature_absent();
+	ret = keyctl(KEYCTL_ASSUME_AUTHORITY, id);
+	feature_note(KEYCTL_ASSUME_AUTHORITY, ret);
+	return ret;
+}
+
+long keyctl_get_security(key_serial_t id, char *buffer, size_t buflen)
+{
+	return keyctl(KEYCTL_GET_SECURITY, id, buffer, buflen);
+}
+
+long keyctl_session_to_parent(void)
+{
+	long ret;
+
+	ret = keyctl(KEYCTL_SESSION_TO_PARENT);
+	if (ret == 0)
+		keyutils_keyring_ID_cache_flush();
+	return ret;
+}
+
+long keyctl_reject(key_serial_t id, unsigned timeout, unsigned error,
+		   key_serial_t ringid)
+{
+	long ret;
+
+	/* fall back to keyctl_negate() if this op is not supported by this
+	 * kernel version */
+	if (feature_missing(KEYCTL_REJECT))
+		return keyctl_negate(id, timeout, ringid);
+	ret = keyctl(KEYCTL_REJECT, id, timeout, error, ringid);
+	feature_note(KEYCTL_REJECT, ret);
+	if (ret == -1 && errno == EOPNOTSUPP)
+		return keyctl_negate(id, timeout, ringid);
+	return ret;
+}
+
+long keyctl_instantiate_iov(key_serial_t id,
+			    const struct iovec *payload_iov,
+			    unsigned ioc,
+			    key_serial_t ringid)
+{
+	long ret;
+
+	/* fall back to keyctl_instantiate() if this op is not supported by
+	 * this kernel version */
+	if (feature_missing(KEYCTL_INSTANTIATE_IOV)) {
+		ret = -1;
+		errno = EOPNOTSUPP;
+	} else {
+		ret = keyctl(KEYCTL_INSTANTIATE_IOV, id, payload_iov, ioc,
+			     ringid);
+		feature_note(KEYCTL_INSTANTIATE_IOV, ret);
+	}
+	if (ret == -1 && errno == EOPNOTSUPP) {
+		unsigned loop;
+		size_t bsize = 0, seg;
+		void *buf, *p;
+
+		if (!payload_iov || !ioc)
+			return keyctl_instantiate(id, NULL, 0, ringid);
+		for (loop = 0; loop < ioc; loop++)
+			bsize += payload_iov[loop].iov_len;
+		if (bsize == 0)
+			return keyctl_instantiate(id, NULL, 0, ringid);
+		p = buf = kalloc(bsize);
+		if (!buf)
+			return -1;
+		for (loop = 0; loop < ioc; loop++) {
+			seg = payload_iov[loop].iov_len;
+			p = memcpy(p, payload_iov[loop].iov_base, seg) + seg;
+		}
+		ret = keyctl_instantiate(id, buf, bsize, ringid);
+		kfree(buf);
+	}
+	return ret;
+}
+
+long keyctl_invalidate(key_serial_t id)
+{
+	long ret;
+
+	if (feature_missing(KEYCTL_INVALIDATE))
+		return feature_absent();
+	ret = keyctl(KEYCTL_INVALIDATE, id);
+	feature_note(KEYCTL_INVALIDATE, ret);
+	if (ret == 0)
+		special_id_forget(id);
+	return ret;
+}
+
+long keyctl_get_persistent(uid_t uid, key_serial_t id)
+{
+	long ret;
+
+	if (feature_missing(KEYCTL_GET_PERSISTENT))
+		return feature_absent();
+	ret = keyctl(KEYCTL_GET_PERSISTENT, uid, id);
+	feature_note(KEYCTL_GET_PERSISTENT, ret);
+	return ret;
+}
+
+/*****************************************************************************/
+/*
+ * set the allocator used for buffers handed out by the library
+ * - NULL restores malloc() and free()
+ * - the allocator should not be changed whilst buffers from the old one are
+ *   still held or the library is in use by other threads
+ */
+void keyutils_set_allocator(const struct keyutils_allocator *allocator)
+{
+	if (allocator && allocator->alloc && allocator->free) {
+		keyutils_allocator = *allocator;
+	} else {
+		keyutils_allocator.alloc = keyutils_default_alloc;
+		keyutils_allocator.free = keyutils_default_free;
+		keyutils_allocator.data = NULL;
+	}
+}
+
+/*
+ * release a buffer handed out by the library
+ */
+void keyutils_free(void *p)
+{
+	kfree(p);
+}
+
+/*****************************************************************************/
+/*
+ * scrub memory in a way the compiler isn't permitted to elide
+ */
+static void secure_zero(void *p, size_t len)
+{
+	memset(p, 0, len);
+	__asm__ __volatile__("" : : "r"(p) : "memory");
+}
+
+/*****************************************************************************/
+/*
+ * fetch key data into a caller-owned buffer, growing it if need be
+ * - the buffer is tried first, so a warm buffer costs a single syscall
+ * - the size is only learnt by probing if there's no buffer at all
+ * - the buffer must come from the allocator given
+ * - the buffer is left with the caller on error
+ * - returns the count from the kernel
+ */
+static long keyctl_fetch_reuse(long (*fetch)(key_serial_t, char *, size_t),
+			       int is_read,
+			       key_serial_t id,
+			       char **_buffer,
+			       size_t *_buflen,
+			       const struct keyutils_allocator *a)
+{
+	size_t buflen, space;
+	char *buf;
+	long ret;
+
+	buf = *_buffer;
+	buflen = buf ? *_buflen : 0;
+
+	for (;;) {
+		/* read results need room for an extra NUL, and keyrings can
+		 * only be read into a whole number of serials */
+		space = buflen > is_read ? buflen - is_read : 0;
+		if (is_read)
+			space &= ~(sizeof(key_serial_t) - 1);
+		if (space > 0)
+			ret = fetch(id, buf, space);
+		else
+			ret = fetch(id, NULL, 0);
+		if (ret < 0)
+			return -1;
+
+		if ((buf || !is_read) && ret <= space)
+			break;
+
+		/* the old contents don't need keeping, but the kernel may have
+		 * copied part of the payload into them */
+		if (buf) {
+			secure_zero(buf, buflen);
+			a->free(buf, a->data);
+		}
+		*_buffer = NULL;
+		*_buflen = 0;
+
+		buflen = ret;
+		if (is_read)
+			buflen = ((buflen + sizeof(key_serial_t) - 1) &
+				  ~(sizeof(key_serial_t) - 1)) + 1;
+		buf = a->alloc(buflen, a->data);
+		if (!buf) {
+			errno = ENOMEM;
+			return -1;
+		}
+		*_buffer = buf;
+		*_buflen = buflen;
+	}
+
+	if (is_read)
+		buf[ret] = 0;
+	return ret;
+}
+
+/*****************************************************************************/
+/*
+ * fetch key description into a reusable buffer
+ * - resulting string is NUL terminated
+ * - returns count not including NUL
+ */
+int keyctl_describe_reuse(key_serial_t id, char **_buffer, size_t *_buflen)
+{
+	long ret;
+
+	ret = keyctl_fetch_reuse(keyctl_describe, 0, id, _buffer, _buflen,
+				 &keyutils_allocator);
+	return ret < 0 ? -1 : ret - 1;
+}
+
+/*****************************************************************************/
+/*
+ * fetch key contents into a reusable buffer
+ * - resulting buffer has an extra NUL added to the end
+ * - returns count (not including extraneous NUL)
+ */
+int keyctl_read_reuse(key_serial_t id, void **_buffer, size_t *_buflen)
+{
+	char *buf = *_buffer;
+	long ret;
+
+	ret = keyctl_fetch_reuse(keyctl_read, 1, id, &buf, _buflen,
+				 &keyutils_allocator);
+	*_buffer = buf;
+	return ret;
+}
+
+/*****************************************************************************/
+/*
+ * fetch key security label into a reusable buffer
+ * - resulting string is NUL terminated
+ * - returns count not including NUL
+ */
+int keyctl_get_security_reuse(key_serial_t id, char **_buffer, size_t *_buflen)
+{
+	long ret;
+
+	ret = keyctl_fetch_reuse(keyctl_get_security, 0, id, _buffer, _buflen,
+				 &keyutils_allocator);
+	return ret < 0 ? -1 : ret - 1;
+}
+
+/*****************************************************************************/
+/*
+ * fetch key description into an allocated buffer
+ * - resulting string is NUL terminated
+ * - returns count not including NUL
+ */
+int keyctl_describe_alloc(key_serial_t id, char **_buffer)
+{
+	char *buf = NULL;
+	size_t buflen = 0;
+	int ret;
+
+	ret = keyctl_describe_reuse(id, &buf, &buflen);
+	if (ret < 0) {
+		kfree(buf);
+		return -1;
+	}
+
+	*_buffer = buf;
+	return ret;
+}
+
+/*****************************************************************************/
+/*
+ * fetch key contents into an allocated buffer
+ * - resulting buffer has an extra NUL added to the end
+ * - returns count (not including extraneous NUL)
+ */
+int keyctl_read_alloc(key_serial_t id, void **_buffer)
+{
+	void *buf = NULL;
+	size_t buflen = 0;
+	int ret;
+
+	ret = keyctl_read_reuse(id, &buf, &buflen);
+	if (ret < 0) {
+		kfree(buf);
+		return -1;
+	}
+
+	*_buffer = buf;
+	return ret;
+}
+
+/*****************************************************************************/
+/*
+ * fetch key security label into an allocated buffer
+ * - resulting string is NUL terminated
+ * - returns count not including NUL
+ */
+int keyctl_get_security_alloc(key_serial_t id, char **_buffer)
+{
+	char *buf = NULL;
+	size_t buflen = 0;
+	int ret;
+
+	ret = keyctl_get_security_reuse(id, &buf, &buflen);
+	if (ret < 0) {
+		kfree(buf);
+		return -1;
+	}
+
+	*_buffer = buf;
+	return ret;
+}
+
+/*
+ * key types that keyctl_parse_description() recognises
+ */
+static const struct {
+	const char	*name;
+	int		len;
+	int		id;
+} key_type_names[] = {
+	{ "keyring",		7,	KEY_TYPE_KEYRING },
+	{ "user",		4,	KEY_TYPE_USER },
+	{ "logon",		5,	KEY_TYPE_LOGON },
+	{ "big_key",		7,	KEY_TYPE_BIG_KEY },
+	{ "asymmetric",		10,	KEY_TYPE_ASYMMETRIC },
+	{ "dns_resolver",	12,	KEY_TYPE_DNS_RESOLVER },
+	{ "encrypted",		9,	KEY_TYPE_ENCRYPTED },
+	{ "trusted",		7,	KEY_TYPE_TRUSTED },
+	{ ".request_key_auth",	17,	KEY_TYPE_REQUEST_KEY_AUTH },
+};
+
+/*
+ * parse a decimal or hex number terminated by a semicolon
+ */
+static int describe_parse_num(const char **_p, const char *end, int base,
+			      unsigned long *_val)
+{
+	const char *p = *_p;
+	unsigned long val = 0;
+	int neg = 0, digit, ndigits = 0;
+
+	if (base == 10 && p < end && *p == '-') {
+		neg = 1;
+		p++;
+	}
+
+	for (; p < end && *p != ';'; p++, ndigits++) {
+		if (*p >= '0' && *p <= '9')
+			digit = *p - '0';
+		else if (base == 16 && *p >= 'a' && *p <= 'f')
+			digit = *p - 'a' + 10;
+		else if (base == 16 && *p >= 'A' && *p <= 'F')
+			digit = *p - 'A' + 10;
+		else
+			return -1;
+		val = val * base + digit;
+	}
+
+	if (p >= end || ndigits == 0)
+		return -1;
+	*_val = neg ? -val : val;
+	*_p = p + 1;
+	return 0;
+}
+
+/*****************************************************************************/
+/*
+ * parse a key description as returned by keyctl_describe()
+ * - the type and description are left pointing into the buffer and are not
+ *   NUL terminated
+ */
+int keyctl_parse_description(const char *buffer, size_t buflen,
+			     struct keyctl_key_desc *parsed)
+{
+	const char *p, *end = buffer + buflen;
+	unsigned long val;
+	unsigned i;
+
+	/* the kernel may or may not include the NUL in the length */
+	if (buflen > 0 && end[-1] == '\0')
+		end--;
+
+	p = memchr(buffer, ';', end - buffer);
+	if (!p || p == buffer)
+		goto invalid;
+	parsed->type = buffer;
+	parsed->type_len = p - buffer;
+	p++;
+
+	if (describe_parse_num(&p, end, 10, &val) < 0)
+		goto invalid;
+	parsed->uid = val;
+	if (describe_parse_num(&p, end, 10, &val) < 0)
+		goto invalid;
+	parsed->gid = val;
+	if (describe_parse_num(&p, end, 16, &val) < 0)
+		goto invalid;
+	parsed->perm = val;
+
+	parsed->desc = p;
+	parsed->desc_len = end - p;
+
+	parsed->type_id = KEY_TYPE_OTHER;
+	for (i = 0; i < sizeof(key_type_names) / sizeof(key_type_names[0]); i++) {
+		if (key_type_names[i].len == parsed->type_len &&
+		    memcmp(key_type_names[i].name, buffer, parsed->type_len) == 0) {
+			parsed->type_id = key_type_names[i].id;
+			break;
+		}
+	}
+	return 0;
+
+invalid:
+	errno = EINVAL;
+	return -1;
+}
+
+/*****************************************************************************/
+/*
+ * fetch a key description into a reusable buffer and parse it
+ * - the parsed type and description point into the buffer
+ * - returns count not including NUL
+ */
+int keyctl_describe_parsed(key_serial_t id, char **_buffer, size_t *_buflen,
+			   struct keyctl_key_desc *parsed)
+{
+	int ret;
+
+	ret = keyctl_describe_reuse(id, _buffer, _buflen);
+	if (ret < 0)
+		return -1;
+	if (keyctl_parse_description(*_buffer, ret, parsed) < 0)
+		return -1;
+	return ret;
+}
+
+/*
+ * Secure memory pool for key material
+ * - regions are mlock'd and excluded from core dumps when created and stay
+ *   that way for the life of the process
+ * - blocks are carved out of the regions first-fit and zeroed when freed
+ */
+#define SECURE_REGION_SIZE	(64 * 1024)
+#define SECURE_ALIGN		16
+
+struct secure_region {
+	struct secure_region	*next;
+	size_t			size;		/* size of mapping */
+} __attribute__((aligned(SECURE_ALIGN)));
+
+struct secure_block {
+	struct secure_region	*region;
+	size_t			size;		/* size of block including header */
+	size_t			prev_size;	/* size of previous block or 0 */
+	int			in_use;
+} __attribute__((aligned(SECURE_ALIGN)));
+
+#define SECURE_MIN_BLOCK	(sizeof(struct secure_block) + SECURE_ALIGN)
+
+static pthread_mutex_t secure_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct secure_region *secure_regions;
+
+static inline struct secure_block *secure_first_block(struct secure_region *r)
+{
+	return (struct secure_block *)(r + 1);
+}
+
+static inline struct secure_block *secure_next_block(struct secure_block *b)
+{
+	struct secure_block *n = (void *)b + b->size;
+
+	return (void *)n < (void *)b->region + b->region->size ? n : NULL;
+}
+
+static inline struct secure_block *secure_prev_block(struct secure_block *b)
+{
+	return b->prev_size ? (void *)b - b->prev_size : NULL;
+}
+
+/*
+ * map, lock and add a region with room for a block of at least the given size
+ * - must be called with the lock held
+ */
+static struct secure_region *secure_add_region(size_t need)
+{
+	struct secure_region *r;
+	struct secure_block *b;
+	size_t size, page = sysconf(_SC_PAGESIZE);
+
+	size = sizeof(struct secure_region) + need;
+	if (size < SECURE_REGION_SIZE)
+		size = SECURE_REGION_SIZE;
+	size = (size + page - 1) & ~(page - 1);
+
+	r = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (r == MAP_FAILED)
+		return NULL;
+
+	if (mlock(r, size) < 0)
+		goto error;
+
+	/* older kernels don't know about MADV_DONTDUMP */
+	if (madvise(r, size, MADV_DONTDUMP) < 0 && errno != EINVAL)
+		goto error;
+
+	r->size = size;
+	r->next = secure_regions;
+	secure_regions = r;
+
+	b = secure_first_block(r);
+	b->region = r;
+	b->size = size - sizeof(*r);
+	b->prev_size = 0;
+	b->in_use = 0;
+	return r;
+
+error:
+	munmap(r, size);
+	return NULL;
+}
+
+/*
+ * split the unneeded tail off a block and give it back to the pool
+ * - must be called with the lock held
+ */
+static void secure_trim(struct secure_block *b, size_t need)
+{
+	struct secure_block *t, *n;
+
+	if (b->size - need < SECURE_MIN_BLOCK)
+		return;
+
+	t = (void *)b + need;
+	t->region = b->region;
+	t->size = b->size - need;
+	t->prev_size = need;
+	t->in_use = 0;
+	b->size = need;
+
+	n = secure_next_block(t);
+	if (n && !n->in_use) {
+		t->size += n->size;
+		secure_zero(n, sizeof(*n));
+		n = secure_next_block(t);
+	}
+	if (n)
+		n->prev_size = t->size;
+}
+
+/*
+ * find a free block of at least the given size, taking the largest if the
+ * size is 0
+ * - must be called with the lock held
+ */
+static struct secure_block *secure_find(size_t need)
+{
+	struct secure_region *r;
+	struct secure_block *b, *best = NULL;
+
+	for (r = secure_regions; r; r = r->next) {
+		for (b = secure_first_block(r); b; b = secure_next_block(b)) {
+			if (b->in_use || b->size < need)
+				continue;
+			if (need)
+				return b;
+			if (!best || b->size > best->size)
+				best = b;
+		}
+	}
+	return best;
+}
+
+/*
+ * ensure the secure pool has at least the given amount of locked memory
+ * available
+ */
+int keyutils_secure_pool_init(size_t size)
+{
+	int ret = 0;
+
+	pthread_mutex_lock(&secure_lock);
+	if (!secure_find(sizeof(struct secure_block) + size) &&
+	    !secure_add_region(sizeof(struct secure_block) + size))
+		ret = -1;
+	pthread_mutex_unlock(&secure_lock);
+	return ret;
+}
+
+/*
+ * allocate a buffer from the secure pool
+ */
+void *keyutils_secure_alloc(size_t size)
+{
+	struct secure_block *b;
+	size_t need;
+
+	need = sizeof(*b) + size;
+	need = (need + SECURE_ALIGN - 1) & ~(SECURE_ALIGN - 1);
+	if (need < size) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	pthread_mutex_lock(&secure_lock);
+	b = secure_find(need);
+	if (!b) {
+		if (!secure_add_region(need)) {
+			pthread_mutex_unlock(&secure_lock);
+			return NULL;
+		}
+		b = secure_find(need);
+	}
+	b->in_use = 1;
+	secure_trim(b, need);
+	pthread_mutex_unlock(&secure_lock);
+	return b + 1;
+}
+
+/*
+ * scrub a buffer and return it to the secure pool
+ */
+void keyutils_secure_free(void *p)
+{
+	struct secure_block *b, *n;
+
+	if (!p)
+		return;
+
+	b = (struct secure_block *)p - 1;
+
+	pthread_mutex_lock(&secure_lock);
+	secure_zero(p, b->size - sizeof(*b));
+	b->in_use = 0;
+
+	/* merge with free neighbours */
+	n = secure_next_block(b);
+	if (n && !n->in_use) {
+		b->size += n->size;
+		secure_zero(n, sizeof(*n));
+	}
+
+	n = secure_prev_block(b);
+	if (n && !n->in_use) {
+		n->size += b->size;
+		secure_zero(b, sizeof(*b));
+		b = n;
+	}
+
+	n = secure_next_block(b);
+	if (n)
+		n->prev_size = b->size;
+	pthread_mutex_unlock(&secure_lock);
+}
+
+static void *secure_alloc_hook(size_t size, void *data)
+{
+	return keyutils_secure_alloc(size);
+}
+
+static void secure_free_hook(void *p, void *data)
+{
+	keyutils_secure_free(p);
+}
+
+const struct keyutils_allocator keyutils_secure_allocator = {
+	.alloc	= secure_alloc_hook,
+	.free	= secure_free_hook,
+};
+
+/*****************************************************************************/
+/*
+ * fetch key contents straight into the secure pool
+ * - the size is probed first so that only a block of that size is taken from
+ *   the pool; holding a bigger block across the read would make concurrent
+ *   allocations map and lock fresh regions
+ * - resulting buffer has an extra NUL added to the end
+ * - returns count (not including extraneous NUL)
+ * - the buffer must be released with keyutils_secure_free()
+ */
+int keyctl_read_secure(key_serial_t id, void **_buffer)
+{
+	size_t buflen;
+	char *buf;
+	long ret;
+
+	ret = keyctl_read(id, NULL, 0);
+	if (ret < 0)
+		return -1;
+
+	for (;;) {
+		/* keyrings can only be read in whole serials */
+		buflen = (ret + sizeof(key_serial_t) - 1) &
+			~(sizeof(key_serial_t) - 1);
+		buf = keyutils_secure_alloc(buflen + 1);
+		if (!buf)
+			return -1;
+
+		ret = keyctl_read(id, buflen > 0 ? buf : NULL, buflen);
+		if (ret < 0) {
+			keyutils_secure_free(buf);
+			return -1;
+		}
+		if (ret <= buflen)
+			break;
+
+		/* the key grew between the probe and the read */
+		keyutils_secure_free(buf);
+	}
+
+	buf[ret] = 0;
+	*_buffer = buf;
+	return ret;
+}
+
+/*****************************************************************************/
+/*
+ * Per-thread scratch buffer for moving payloads between keys and files
+ * - it's kept between calls so that a thread moving many payloads only
+ *   allocates once; it's freed when the thread exits
+ * - it's never larger than the biggest payload the kernel will take
+ * - whoever uses it must scrub what they put in it
+ * - it outlives any one call, so it comes from libc rather than from an
+ *   allocator the application might replace in the meantime
+ */
+#define KEY_FD_MAX	(1024 * 1024 - 1)
+
+struct key_scratch {
+	char		*buf;
+	size_t		size;
+};
+
+static pthread_once_t key_scratch_once = PTHREAD_ONCE_INIT;
+static pthread_key_t key_scratch_key;
+static __thread struct key_scratch key_scratch;
+
+static const struct keyutils_allocator key_scratch_allocator = {
+	.alloc	= keyutils_default_alloc,
+	.free	= keyutils_default_free,
+};
+
+static void key_scratch_thread_exit(void *p)
+{
+	free(key_scratch.buf);
+	key_scratch.buf = NULL;
+	key_scratch.size = 0;
+}
+
+static void key_scratch_init_key(void)
+{
+	pthread_key_create(&key_scratch_key, key_scratch_thread_exit);
+}
+
+/*
+ * make sure the scratch buffer holds at least the given amount, keeping the
+ * first keep bytes of what's in it
+ */
+static char *key_scratch_get(size_t need, size_t keep)
+{
+	size_t size;
+	char *buf;
+
+	if (need <= key_scratch.size)
+		return key_scratch.buf;
+
+	pthread_once(&key_scratch_once, key_scratch_init_key);
+
+	size = key_scratch.size ?: 16384;
+	while (size < need)
+		size *= 2;
+	if (size > KEY_FD_MAX + 1)
+		size = KEY_FD_MAX + 1;
+
+	buf = malloc(size);
+	if (!buf)
+		return NULL;
+	if (key_scratch.buf) {
+		memcpy(buf, key_scratch.buf, keep);
+		secure_zero(key_scratch.buf, keep);
+		free(key_scratch.buf);
+	}
+	key_scratch.buf = buf;
+	key_scratch.size = size;
+	pthread_setspecific(key_scratch_key, &key_scratch);
+	return buf;
+}
+
+/*****************************************************************************/
+/*
+ * Get at the payload to be loaded from a file descriptor
+ * - everything from the file position to EOF is taken
+ * - regular files are mapped so that the kernel copies straight from the page
+ *   cache; anything else is read into the scratch buffer
+ */
+struct key_fd_payload {
+	void		*data;
+	size_t		len;
+	void		*map;
+	size_t		map_len;
+	off_t		end;		/* where the file position should go */
+};
+
+static int key_fd_get(int fd, struct key_fd_payload *p)
+{
+	struct stat st;
+	size_t len, page, skew;
+	char *buf;
+	off_t pos;
+	ssize_t n;
+
+	memset(p, 0, sizeof(*p));
+	p->end = -1;
+
+	/* some regular files, such as those in /proc, don't know their size
+	 * until they're read */
+	if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+		pos = lseek(fd, 0, SEEK_CUR);
+		if (pos == -1)
+			goto stream;
+		if (pos >= st.st_size) {
+			p->end = pos;
+			return 0;
+		}
+		if (st.st_size - pos > KEY_FD_MAX) {
+			errno = E2BIG;
+			return -1;
+		}
+
+		page = sysconf(_SC_PAGESIZE);
+		len = st.st_size - pos;
+		skew = pos & (page - 1);
+		p->map = mmap(NULL, skew + len, PROT_READ, MAP_PRIVATE, fd,
+			      pos - skew);
+		if (p->map == MAP_FAILED) {
+			p->map = NULL;
+			goto stream;
+		}
+		p->map_len = skew + len;
+		p->data = (char *)p->map + skew;
+		p->len = len;
+		p->end = pos + len;
+		return 0;
+	}
+
+stream:
+	len = 0;
+	for (;;) {
+		buf = key_scratch_get(len + 1, len);
+		if (!buf)
+			goto error;
+		n = read(fd, buf + len, key_scratch.size - len);
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			goto error;
+		}
+		if (n == 0)
+			break;
+		len += n;
+		if (len > KEY_FD_MAX) {
+			errno = E2BIG;
+			goto error;
+		}
+	}
+
+	p->data = len ? key_scratch.buf : NULL;
+	p->len = len;
+	return 0;
+
+error:
+	if (key_scratch.buf)
+		secure_zero(key_scratch.buf, len);
+	return -1;
+}
+
+/*
+ * finish with a payload, moving the file position past it if it was used
+ */
+static void key_fd_put(int fd, struct key_fd_payload *p, long ret)
+{
+	int err = errno;
+
+	if (p->map)
+		munmap(p->map, p->map_len);
+	else if (p->len)
+		secure_zero(p->data, p->len);
+	if (ret != -1 && p->end != -1)
+		lseek(fd, p->end, SEEK_SET);
+	errno = err;
+}
+
+/*
+ * add a key with the payload read from a file descriptor
+ */
+key_serial_t add_key_from_fd(const char *type, const char *description,
+			     int fd, key_serial_t ringid)
+{
+	struct key_fd_payload p;
+	key_serial_t ret;
+
+	if (key_fd_get(fd, &p) < 0)
+		return -1;
+	ret = add_key(type, description, p.data, p.len, ringid);
+	key_fd_put(fd, &p, ret);
+	return ret;
+}
+
+/*
+ * update a key with the payload read from a file descriptor
+ */
+long keyctl_update_from_fd(key_serial_t id, int fd)
+{
+	struct key_fd_payload p;
+	long ret;
+
+	if (key_fd_get(fd, &p) < 0)
+		return -1;
+	ret = keyctl_update(id, p.data, p.len);
+	key_fd_put(fd, &p, ret);
+	return ret;
+}
+
+/*
+ * instantiate a key with the payload read from a file descriptor
+ */
+long keyctl_instantiate_from_fd(key_serial_t id, int fd, key_serial_t ringid)
+{
+	struct key_fd_payload p;
+	long ret;
+
+	if (key_fd_get(fd, &p) < 0)
+		return -1;
+	ret = keyctl_instantiate(id, p.data, p.len, ringid);
+	key_fd_put(fd, &p, ret);
+	return ret;
+}
+
+/*
+ * write all of a buffer to a file descriptor, riding out signals, short
+ * writes and non-blocking descriptors
+ */
+static int key_fd_write(int fd, const char *buf, size_t len)
+{
+	struct pollfd pfd = { .fd = fd, .events = POLLOUT };
+	ssize_t n;
+
+	while (len > 0) {
+		n = write(fd, buf, len);
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				if (poll(&pfd, 1, -1) == -1 && errno != EINTR)
+					return -1;
+				continue;
+			}
+			return -1;
+		}
+		buf += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/*
+ * read a key's payload and write it to a file descriptor
+ * - the payload is read into the calling thread's scratch buffer, or into the
+ *   locked pool if KEY_READ_SECURE is given, and written straight out of it
+ * - the buffer is scrubbed afterwards
+ * - returns the number of bytes written
+ */
+long keyctl_read_to_fd(key_serial_t id, int fd, unsigned flags)
+{
+	void *sbuf;
+	size_t len;
+	long ret;
+	int err;
+
+	if (flags & ~KEY_READ_SECURE) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (flags & KEY_READ_SECURE) {
+		ret = keyctl_read_secure(id, &sbuf);
+		if (ret < 0)
+			return -1;
+		if (key_fd_write(fd, sbuf, ret) < 0)
+			ret = -1;
+		err = errno;
+		keyutils_secure_free(sbuf);
+		errno = err;
+		return ret;
+	}
+
+	pthread_once(&key_scratch_once, key_scratch_init_key);
+	pthread_setspecific(key_scratch_key, &key_scratch);
+	ret = keyctl_fetch_reuse(keyctl_read, 1, id, &key_scratch.buf,
+				 &key_scratch.size, &key_scratch_allocator);
+	if (ret < 0)
+		return -1;
+	len = ret;
+	if (key_fd_write(fd, key_scratch.buf, len) < 0)
+		ret = -1;
+	err = errno;
+	secure_zero(key_scratch.buf, len);
+
+	/* keyrings can be bigger than any payload; don't hang on to that */
+	if (key_scratch.size > KEY_FD_MAX + 1) {
+		free(key_scratch.buf);
+		key_scratch.buf = NULL;
+		key_scratch.size = 0;
+	}
+	errno = err;
+	return ret;
+}
+
+/*****************************************************************************/
+/*
+ * fetch the descriptions or contents of a batch of keys into one caller
+ * supplied arena
+ * - each key costs a single syscall as the whole of the remaining arena is
+ *   offered to the kernel
+ * - a key that doesn't fit gets ENOBUFS and the amount of arena it would have
+ *   needed, so that the caller can size the arena for the next sweep
+ * - returns the number of keys placed in the arena
+ */
+static int keyctl_fetch_many(long (*fetch)(key_serial_t, char *, size_t),
+			     int is_read,
+			     const key_serial_t *ids,
+			     unsigned nr,
+			     struct keyctl_batch_result *results,
+			     void *arena,
+			     size_t arena_size)
+{
+	struct keyctl_batch_result *res;
+	unsigned loop;
+	size_t used, pad, space;
+	char *p;
+	long ret;
+	int count = 0;
+
+	if ((nr > 0 && (!ids || !results)) || (arena_size > 0 && !arena)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	used = 0;
+	for (loop = 0; loop < nr; loop++) {
+		res = &results[loop];
+		res->data = NULL;
+
+		/* keep keyring contents aligned for access as key_serial_t */
+		p = (char *)arena + used;
+		pad = 0;
+		if (is_read)
+			pad = -(uintptr_t)p & (sizeof(key_serial_t) - 1);
+
+		space = 0;
+		if (used + pad < arena_size) {
+			p += pad;
+			space = arena_size - used - pad;
+		}
+
+		/* read results are given an extra NUL, descriptions come with
+		 * their own; keyrings can only be read in whole serials */
+		if (is_read && space > 0) {
+			space--;
+			space &= ~(sizeof(key_serial_t) - 1);
+		}
+
+		ret = fetch(ids[loop], space > 0 ? p : NULL, space);
+		if (ret < 0) {
+			res->len = -1;
+			res->error = errno;
+			continue;
+		}
+
+		if (ret > space) {
+			res->len = pad + ret;
+			if (is_read)
+				res->len = pad + ((ret + sizeof(key_serial_t) - 1) &
+						  ~(sizeof(key_serial_t) - 1)) + 1;
+			res->error = ENOBUFS;
+			continue;
+		}
+
+		res->data = p;
+		res->error = 0;
+		if (is_read) {
+			p[ret] = 0;
+			res->len = ret;
+			used += pad + ret + 1;
+		} else {
+			res->len = ret - 1;
+			used += ret;
+		}
+		count++;
+	}
+
+	return count;
+}
+
+/*
+ * fetch the descriptions of a batch of keys into an arena
+ * - resulting strings are NUL terminated
+ */
+int keyctl_describe_many(const key_serial_t *ids, unsigned nr,
+			 struct keyctl_batch_result *results,
+			 void *arena, size_t arena_size)
+{
+	return keyctl_fetch_many(keyctl_describe, 0, ids, nr, results,
+				 arena, arena_size);
+}
+
+/*
+ * fetch the contents of a batch of keys into an arena
+ * - each result has an extra NUL added to the end
+ */
+int keyctl_read_many(const key_serial_t *ids, unsigned nr,
+		     struct keyctl_batch_result *results,
+		     void *arena, size_t arena_size)
+{
+	return keyctl_fetch_many(keyctl_read, 1, ids, nr, results,
+				 arena, arena_size);
+}
+
+/*****************************************************************************/
+/*
+ * apply an operation to a batch of keys, noting the error from each
+ * - the keys are claimed in chunks by however many threads are working on the
+ *   batch, the calling thread included
+ */
+#define KEY_BULK_CHUNK 32
+
+struct key_bulk {
+	long		(*op)(key_serial_t id, key_serial_t ringid);
+	const key_serial_t *ids;
+	key_serial_t	ringid;
+	int		*errors;
+	unsigned	nr;
+	unsigned	next;		/* next key to be claimed */
+	unsigned	count;		/* number of keys successfully done */
+};
+
+static void *key_bulk_thread(void *_bulk)
+{
+	struct key_bulk *bulk = _bulk;
+	unsigned i, end, count = 0;
+
+	for (;;) {
+		i = __atomic_fetch_add(&bulk->next, KEY_BULK_CHUNK,
+				       __ATOMIC_RELAXED);
+		if (i >= bulk->nr)
+			break;
+		end = i + KEY_BULK_CHUNK;
+		if (end > bulk->nr)
+			end = bulk->nr;
+
+		for (; i < end; i++) {
+			if (bulk->op(bulk->ids[i], bulk->ringid) == 0) {
+				count++;
+				if (bulk->errors)
+					bulk->errors[i] = 0;
+			} else if (bulk->errors) {
+				bulk->errors[i] = errno;
+			}
+		}
+	}
+
+	__atomic_add_fetch(&bulk->count, count, __ATOMIC_RELAXED);
+	return NULL;
+}
+
+static int key_bulk(long (*op)(key_serial_t, key_serial_t),
+		    const key_serial_t *ids, unsigned nr, key_serial_t ringid,
+		    int *errors, unsigned nr_threads)
+{
+	struct key_bulk bulk = {
+		.op	= op,
+		.ids	= ids,
+		.ringid	= ringid,
+		.errors	= errors,
+		.nr	= nr,
+	};
+	pthread_t *threads = NULL;
+	unsigned i, nr_started = 0;
+	long ncpus;
+
+	if (nr > 0 && !ids) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (nr_threads == 0) {
+		ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+		nr_threads = ncpus > 0 ? ncpus : 1;
+	}
+	if (nr_threads > (nr + KEY_BULK_CHUNK - 1) / KEY_BULK_CHUNK)
+		nr_threads = (nr + KEY_BULK_CHUNK - 1) / KEY_BULK_CHUNK;
+
+	/* other threads have thread keyrings of their own */
+	if (nr_threads > 1 && ringid == KEY_SPEC_THREAD_KEYRING)
+		nr_threads = 1;
+	for (i = 0; nr_threads > 1 && i < nr; i++)
+		if (ids[i] == KEY_SPEC_THREAD_KEYRING)
+			nr_threads = 1;
+
+	if (nr_threads > 1)
+		threads = kalloc(nr_threads * sizeof(*threads));
+	if (threads) {
+		for (i = 1; i < nr_threads; i++) {
+			if (pthread_create(&threads[i], NULL, key_bulk_thread,
+					   &bulk) != 0)
+				break;
+			nr_started++;
+		}
+	}
+
+	key_bulk_thread(&bulk);
+
+	if (threads) {
+		for (i = 1; i <= nr_started; i++)
+			pthread_join(threads[i], NULL);
+		kfree(threads);
+	}
+	return bulk.count;
+}
+
+static long key_bulk_revoke(key_serial_t id, key_serial_t ringid)
+{
+	return keyctl_revoke(id);
+}
+
+static long key_bulk_invalidate(key_serial_t id, key_serial_t ringid)
+{
+	return keyctl_invalidate(id);
+}
+
+/*
+ * link a batch of keys into a keyring
+ * - returns the number of keys linked
+ */
+int keyctl_link_many(const key_serial_t *ids, unsigned nr, key_serial_t ringid,
+		     int *errors, unsigned nr_threads)
+{
+	return key_bulk(keyctl_link, ids, nr, ringid, errors, nr_threads);
+}
+
+/*
+ * unlink a batch of keys from a keyring
+ * - returns the number of keys unlinked
+ */
+int keyctl_unlink_many(const key_serial_t *ids, unsigned nr,
+		       key_serial_t ringid, int *errors, unsigned nr_threads)
+{
+	return key_bulk(keyctl_unlink, ids, nr, ringid, errors, nr_threads);
+}
+
+/*
+ * revoke a batch of keys
+ * - returns the number of keys revoked
+ */
+int keyctl_revoke_many(const key_serial_t *ids, unsigned nr, int *errors,
+		       unsigned nr_threads)
+{
+	return key_bulk(key_bulk_revoke, ids, nr, 0, errors, nr_threads);
+}
+
+/*
+ * invalidate a batch of keys
+ * - returns the number of keys invalidated
+ */
+int keyctl_invalidate_many(const key_serial_t *ids, unsigned nr, int *errors,
+			   unsigned nr_threads)
+{
+	return key_bulk(key_bulk_invalidate, ids, nr, 0, errors, nr_threads);
+}
+
+/*
+ * Set of key serial numbers, used to note the keyrings a scan has expanded
+ */
+struct key_serial_set {
+	key_serial_t	*slots;
+	size_t		mask;		/* number of slots - 1 */
+	size_t		nr;
+};
+
+/*
+ * add a serial number to a set
+ * - returns 1 if added, 0 if already present and -1 on error
+ */
+static int key_serial_set_add(struct key_serial_set *set, key_serial_t id)
+{
+	key_serial_t *slots, *old;
+	size_t i, size, old_size;
+
+	if (set->nr >= set->mask / 2) {
+		old = set->slots;
+		old_size = old ? set->mask + 1 : 0;
+		size = old ? old_size * 2 : 64;
+		slots = kalloc(size * sizeof(key_serial_t));
+		if (!slots)
+			return -1;
+		memset(slots, 0, size * sizeof(key_serial_t));
+
+		set->slots = slots;
+		set->mask = size - 1;
+		set->nr = 0;
+		for (i = 0; i < old_size; i++)
+			if (old[i])
+				key_serial_set_add(set, old[i]);
+		kfree(old);
+	}
+
+	i = ((uint32_t)id * 2654435761U) & set->mask;
+	while (set->slots[i]) {
+		if (set->slots[i] == id)
+			return 0;
+		i = (i + 1) & set->mask;
+	}
+	set->slots[i] = id;
+	set->nr++;
+	return 1;
+}
+
+/*
+ * Tree scan state
+ * - the stack holds the path from the starting key to the key being looked
+ *   at, along with the contents of any keyrings on that path
+ * - a scan that runs out of memory, or that goes deeper than
+ *   KEY_SCAN_MAX_DEPTH when revisiting keyrings, is abandoned and reported as
+ *   failed rather than passing back part of the tree as if it were the whole
+ */
+#define KEY_SCAN_MAX_DEPTH	800	/* recursive_key_scan() never went beyond */
+#define KEY_SCAN_SKIP_DEEP	0x80000000 /* internal: skip what's too deep and
+					    * ignore errors, as
+					    * recursive_key_scan() always has */
+
+struct key_scan_frame {
+	key_serial_t	parent;
+	key_serial_t	key;
+	char		*desc;
+	int		desc_len;
+	int		error;		/* error from describing the key */
+	key_serial_t	*ring;		/* contents if an expanded keyring */
+	unsigned	nr_keys;
+	unsigned	next;		/* next key in ring to visit */
+};
+
+struct key_scan {
+	struct key_scan_frame	*stack;
+	unsigned		depth;
+	unsigned		max_depth;
+	unsigned		flags;
+	int			stopped;	/* the filter asked us to stop */
+	int			error;		/* why the scan was abandoned */
+	key_scan_filter_t	filter;
+	void			*data;
+	struct key_serial_set	visited;
+};
+
+/*
+ * describe a key for a scan
+ * - the description is discarded and the error set to EINVAL if it can't be
+ *   parsed
+ * - returns 1 if the key is a keyring, 0 otherwise
+ */
+static int key_scan_describe(key_serial_t key, char **_desc, int *_desc_len,
+			     int *_error)
+{
+	struct keyctl_key_desc parsed;
+	char *desc = NULL;
+	int desc_len;
+
+	*_desc = NULL;
+	*_error = 0;
+
+	/* read the key description */
+	desc_len = keyctl_describe_alloc(key, &desc);
+	if (desc_len < 0) {
+		*_desc_len = -1;
+		*_error = errno;
+		return 0;
+	}
+
+	/* parse */
+	if (keyctl_parse_description(desc, desc_len, &parsed) < 0) {
+		kfree(desc);
+		*_desc_len = -1;
+		*_error = EINVAL;
+		return 0;
+	}
+
+	*_desc = desc;
+	*_desc_len = desc_len;
+	return parsed.type_id == KEY_TYPE_KEYRING;
+}
+
+/*
+ * describe a key and push it onto the scan stack, reading its contents if
+ * it's a keyring that wants expanding and the filter doesn't object
+ */
+static int key_scan_push(struct key_scan *scan, key_serial_t parent,
+			 key_serial_t key)
+{
+	struct key_scan_frame *f;
+	void *ring;
+	int ret, is_ring;
+
+	if (scan->depth >= scan->max_depth) {
+		unsigned max = scan->max_depth ? scan->max_depth * 2 : 16;
+
+		f = kalloc(max * sizeof(*f));
+		if (!f) {
+			scan->error = ENOMEM;
+			return -1;
+		}
+		if (scan->stack) {
+			memcpy(f, scan->stack, scan->depth * sizeof(*f));
+			kfree(scan->stack);
+		}
+		scan->stack = f;
+		scan->max_depth = max;
+	}
+
+	f = &scan->stack[scan->depth++];
+	f->parent = parent;
+	f->key = key;
+	f->ring = NULL;
+	f->nr_keys = 0;
+	f->next = 0;
+
+	/* if it's a keyring then we're going to want to search it if we can,
+	 * but only the first time we see it unless asked otherwise */
+	is_ring = key_scan_describe(key, &f->desc, &f->desc_len, &f->error);
+	if (f->error == ENOMEM) {
+		scan->error = ENOMEM;
+		return -1;
+	}
+
+	if (scan->filter) {
+		errno = f->error;
+		switch (scan->filter(parent, key, f->desc, f->desc_len,
+				     scan->data)) {
+		case KEY_SCAN_STOP:
+			scan->stopped = 1;
+			return 0;
+		case KEY_SCAN_SKIP_SUBTREE:
+			return 0;
+		default:
+			break;
+		}
+	}
+
+	if (!is_ring)
+		return 0;
+	if (!(scan->flags & KEY_SCAN_REVISIT)) {
+		ret = key_serial_set_add(&scan->visited, key);
+		if (ret == 0)
+			return 0;
+		if (ret < 0) {
+			scan->error = ENOMEM;
+			return -1;
+		}
+	}
+
+	/* a keyring we can't read is reported but not scanned */
+	ret = keyctl_read_alloc(key, &ring);
+	if (ret < 0) {
+		if (errno != ENOMEM)
+			return 0;
+		scan->error = ENOMEM;
+		return -1;
+	}
+	f->ring = ring;
+	f->nr_keys = ret / sizeof(key_serial_t);
+	return 0;
+}
+
+/*
+ * Depth-first apply a function over a keyring tree without recursion
+ * - the filter, if given, is applied to each link before the key is expanded
+ * - the function is applied to each link after the subtree below it
+ * - each keyring is expanded only once, no matter how many links there are to
+ *   it, unless KEY_SCAN_REVISIT is given
+ * - if the filter stops the scan, nothing further is passed to the function
+ * - the sum of the function's results is placed in *_kcount, even if the scan
+ *   fails
+ * - returns 0 if the scan was completed or stopped by the filter, and -1 with
+ *   errno set if it had to be abandoned
+ */
+static int key_scan_tree(key_serial_t key, unsigned flags,
+			 key_scan_filter_t filter,
+			 recursive_key_scanner_t func, void *data,
+			 int *_kcount)
+{
+	struct key_scan_frame *f;
+	struct key_scan scan = {
+		.flags	= flags,
+		.filter	= filter,
+		.data	= data,
+	};
+	key_serial_t parent;
+	int kcount = 0;
+
+	key_scan_push(&scan, 0, key);
+
+	while (scan.depth > 0 && !scan.stopped && !scan.error) {
+		f = &scan.stack[scan.depth - 1];
+
+		if (f->next < f->nr_keys) {
+			parent = f->key;
+			key = f->ring[f->next++];
+
+			/* only revisiting can take us round a loop */
+			if ((flags & KEY_SCAN_REVISIT) &&
+			    scan.depth > KEY_SCAN_MAX_DEPTH) {
+				if (flags & KEY_SCAN_SKIP_DEEP)
+					continue;
+				scan.error = ELOOP;
+				break;
+			}
+			key_scan_push(&scan, parent, key);
+			continue;
+		}
+
+		errno = f->error;
+		kcount += func(f->parent, f->key, f->desc, f->desc_len, data);
+		kfree(f->desc);
+		kfree(f->ring);
+		scan.depth--;
+	}
+
+	/* discard the path we were on if we were stopped */
+	for (; scan.depth > 0; scan.depth--) {
+		f = &scan.stack[scan.depth - 1];
+		kfree(f->desc);
+		kfree(f->ring);
+	}
+
+	kfree(scan.stack);
+	kfree(scan.visited.slots);
+	*_kcount = kcount;
+	if (scan.error && !(flags & KEY_SCAN_SKIP_DEEP)) {
+		errno = scan.error;
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Depth-first apply a function over a keyring tree, visiting shared keyrings
+ * once only
+ * - special keyring IDs are resolved first
+ */
+int keyctl_scan_tree(key_serial_t key, unsigned flags,
+		     recursive_key_scanner_t func, void *data)
+{
+	int kcount;
+
+	if (key < 0) {
+		key = keyctl_get_keyring_ID_cached(key, 0);
+		if (key < 0)
+			return 0;
+	}
+
+	if (key_scan_tree(key, flags, NULL, func, data, &kcount) < 0)
+		return -1;
+	return kcount;
+}
+
+/*
+ * Depth-first apply a function over a keyring tree, letting a filter prune
+ * the tree or stop the scan before each key is expanded
+ */
+int keyctl_scan_tree_filter(key_serial_t key, unsigned flags,
+			    key_scan_filter_t filter,
+			    recursive_key_scanner_t func, void *data)
+{
+	int kcount;
+
+	if (key < 0) {
+		key = keyctl_get_keyring_ID_cached(key, 0);
+		if (key < 0)
+			return 0;
+	}
+
+	if (key_scan_tree(key, flags, filter, func, data, &kcount) < 0)
+		return -1;
+	return kcount;
+}
+
+/*
+ * Depth-first apply a function over a keyring tree
+ */
+int recursive_key_scan(key_serial_t key, recursive_key_scanner_t func, void *data)
+{
+	int kcount;
+
+	key_scan_tree(key, KEY_SCAN_REVISIT | KEY_SCAN_SKIP_DEEP, NULL,
+		      func, data, &kcount);
+	return kcount;
+}
+
+/*
+ * Parallel tree scan state
+ * - each worker has a deque of keys to examine; it takes work from the tail of
+ *   its own and steals from the heads of the others' when that runs dry
+ * - for an ordered scan the examined keys are kept as a tree so that the
+ *   callback can be applied afterwards in the order keyctl_scan_tree() uses
+ * - which link to a shared keyring is reached first by the workers is down to
+ *   chance, so an ordered scan notes which node read each keyring and moves
+ *   the contents under the first link to it in tree order before delivery
+ * - a scan that fails is abandoned as keyctl_scan_tree() would, the workers
+ *   doing nothing more with the keys left in the queues
+ */
+struct key_pscan_node {
+	key_serial_t		parent;
+	key_serial_t		key;
+	unsigned		depth;
+	int			desc_len;
+	int			error;
+	char			*desc;
+	struct key_pscan_node	*up;		/* parent node (ordered only) */
+	struct key_pscan_node	**children;	/* child nodes (ordered only) */
+	unsigned		nr_children;
+	unsigned		next;		/* next child to deliver */
+	int			entered;	/* seen by the delivery walk */
+};
+
+struct key_pscan_owner {
+	key_serial_t		key;		/* keyring read */
+	int			taken;		/* contents delivered */
+	struct key_pscan_node	*node;		/* node that read it */
+};
+
+struct key_pscan_deque {
+	pthread_mutex_t		lock;
+	struct key_pscan_node	**items;
+	unsigned		head;
+	unsigned		tail;
+	unsigned		size;		/* power of 2 */
+};
+
+struct key_pscan {
+	struct key_pscan_deque	*deques;
+	unsigned		nr_workers;
+	unsigned		flags;
+	recursive_key_scanner_t	func;
+	void			*data;
+	pthread_mutex_t		func_lock;	/* serialises callbacks */
+	int			kcount;
+	pthread_mutex_t		lock;		/* guards the following */
+	pthread_cond_t		wake;
+	unsigned		pending;	/* nodes queued or in progress */
+	unsigned		nr_idle;
+	int			error;		/* why the scan was abandoned */
+	struct key_serial_set	visited;
+	struct key_pscan_owner	*owners;	/* ordered, not revisiting */
+	unsigned		nr_owners;
+	unsigned		max_owners;
+};
+
+struct key_pscan_worker {
+	struct key_pscan	*scan;
+	unsigned		self;
+};
+
+static int key_pscan_push(struct key_pscan_deque *q, struct key_pscan_node *node)
+{
+	struct key_pscan_node **items;
+	unsigned i, n;
+
+	pthread_mutex_lock(&q->lock);
+	n = q->tail - q->head;
+	if (n >= q->size) {
+		items = kalloc(q->size * 2 * sizeof(*items));
+		if (!items) {
+			pthread_mutex_unlock(&q->lock);
+			return -1;
+		}
+		for (i = 0; i < n; i++)
+			items[i] = q->items[(q->head + i) & (q->size - 1)];
+		kfree(q->items);
+		q->items = items;
+		q->size *= 2;
+		q->head = 0;
+		q->tail = n;
+	}
+	q->items[q->tail++ & (q->size - 1)] = node;
+	pthread_mutex_unlock(&q->lock);
+	return 0;
+}
+
+static struct key_pscan_node *key_pscan_take(struct key_pscan_deque *q,
+					     int steal)
+{
+	struct key_pscan_node *node = NULL;
+
+	pthread_mutex_lock(&q->lock);
+	if (q->head != q->tail) {
+		if (steal)
+			node = q->items[q->head++ & (q->size - 1)];
+		else
+			node = q->items[--q->tail & (q->size - 1)];
+	}
+	pthread_mutex_unlock(&q->lock);
+	return node;
+}
+
+/*
+ * find something to do, preferring the worker's own queue
+ */
+static struct key_pscan_node *key_pscan_find(struct key_pscan *scan,
+					     unsigned self)
+{
+	struct key_pscan_node *node;
+	unsigned i;
+
+	node = key_pscan_take(&scan->deques[self], 0);
+	for (i = 1; !node && i < scan->nr_workers; i++)
+		node = key_pscan_take(
+			&scan->deques[(self + i) % scan->nr_workers], 1);
+	return node;
+}
+
+/*
+ * abandon the scan
+ * - the caller must not hold scan->lock
+ */
+static void key_pscan_fail(struct key_pscan *scan, int error)
+{
+	pthread_mutex_lock(&scan->lock);
+	if (!scan->error)
+		__atomic_store_n(&scan->error, error, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&scan->lock);
+}
+
+/*
+ * note which node is reading a keyring
+ * - the caller must hold scan->lock
+ */
+static int key_pscan_add_owner(struct key_pscan *scan,
+			       struct key_pscan_node *node)
+{
+	struct key_pscan_owner *owners;
+	unsigned max;
+
+	if (scan->nr_owners >= scan->max_owners) {
+		max = scan->max_owners ? scan->max_owners * 2 : 64;
+		owners = kalloc(max * sizeof(*owners));
+		if (!owners)
+			return -1;
+		if (scan->owners) {
+			memcpy(owners, scan->owners,
+			       scan->nr_owners * sizeof(*owners));
+			kfree(scan->owners);
+		}
+		scan->owners = owners;
+		scan->max_owners = max;
+	}
+
+	owners = &scan->owners[scan->nr_owners++];
+	owners->key = node->key;
+	owners->taken = 0;
+	owners->node = node;
+	return 1;
+}
+
+/*
+ * describe a key, queue up the contents if it's a keyring and, if the scan
+ * isn't ordered, apply the callback to it
+ */
+static void key_pscan_examine(struct key_pscan *scan, unsigned self,
+			      struct key_pscan_node *node)
+{
+	struct key_pscan_node *child, **children = NULL;
+	key_serial_t *ring;
+	void *payload;
+	unsigned i, n = 0, ordered = scan->flags & KEY_SCAN_ORDERED;
+	int expand, ret;
+
+	/* don't bother with anything more once the scan has failed */
+	if (__atomic_load_n(&scan->error, __ATOMIC_RELAXED)) {
+		node->desc_len = -1;
+		goto done;
+	}
+
+	expand = key_scan_describe(node->key, &node->desc, &node->desc_len,
+				   &node->error);
+	if (node->error == ENOMEM) {
+		key_pscan_fail(scan, ENOMEM);
+		goto done;
+	}
+
+	if (expand && !(scan->flags & KEY_SCAN_REVISIT)) {
+		pthread_mutex_lock(&scan->lock);
+		ret = key_serial_set_add(&scan->visited, node->key);
+		if (ret > 0 && ordered)
+			ret = key_pscan_add_owner(scan, node);
+		pthread_mutex_unlock(&scan->lock);
+		if (ret < 0) {
+			key_pscan_fail(scan, ENOMEM);
+			goto done;
+		}
+		expand = ret > 0;
+	}
+
+	if (expand) {
+		ret = keyctl_read_alloc(node->key, &payload);
+		if (ret < 0 && errno == ENOMEM) {
+			key_pscan_fail(scan, ENOMEM);
+			goto done;
+		}
+		if (ret >= 0) {
+			ring = payload;
+			n = ret / sizeof(key_serial_t);
+
+			/* only revisiting can take us round a loop */
+			if (n > 0 && (scan->flags & KEY_SCAN_REVISIT) &&
+			    node->depth >= KEY_SCAN_MAX_DEPTH) {
+				kfree(payload);
+				key_pscan_fail(scan, ELOOP);
+				goto done;
+			}
+
+			if (ordered && n > 0) {
+				children = kalloc(n * sizeof(*children));
+				if (!children) {
+					kfree(payload);
+					key_pscan_fail(scan, ENOMEM);
+					goto done;
+				}
+			}
+
+			pthread_mutex_lock(&scan->lock);
+			scan->pending += n;
+			pthread_mutex_unlock(&scan->lock);
+
+			/* push in reverse so that we take them in order */
+			for (i = n; i > 0; i--) {
+				child = kalloc(sizeof(*child));
+				if (child) {
+					memset(child, 0, sizeof(*child));
+					child->parent = node->key;
+					child->key = ring[i - 1];
+					child->depth = node->depth + 1;
+					if (ordered)
+						child->up = node;
+				}
+				if (child &&
+				    key_pscan_push(&scan->deques[self], child) < 0) {
+					kfree(child);
+					child = NULL;
+				}
+				if (ordered)
+					children[i - 1] = child;
+				if (!child) {
+					key_pscan_fail(scan, ENOMEM);
+					pthread_mutex_lock(&scan->lock);
+					scan->pending--;
+					pthread_mutex_unlock(&scan->lock);
+				}
+			}
+			kfree(payload);
+
+			if (ordered) {
+				node->children = children;
+				node->nr_children = n;
+			}
+
+			pthread_mutex_lock(&scan->lock);
+			if (scan->nr_idle > 0)
+				pthread_cond_broadcast(&scan->wake);
+			pthread_mutex_unlock(&scan->lock);
+		}
+	}
+
+	if (!ordered && !__atomic_load_n(&scan->error, __ATOMIC_RELAXED)) {
+		pthread_mutex_lock(&scan->func_lock);
+		errno = node->error;
+		scan->kcount += scan->func(node->parent, node->key,
+					   node->desc, node->desc_len,
+					   scan->data);
+		pthread_mutex_unlock(&scan->func_lock);
+	}
+
+done:
+	if (!ordered) {
+		kfree(node->desc);
+		kfree(node);
+	}
+
+	pthread_mutex_lock(&scan->lock);
+	if (--scan->pending == 0)
+		pthread_cond_broadcast(&scan->wake);
+	pthread_mutex_unlock(&scan->lock);
+}
+
+static void *key_pscan_thread(void *_worker)
+{
+	struct key_pscan_worker *worker = _worker;
+	struct key_pscan *scan = worker->scan;
+	struct key_pscan_node *node;
+
+	for (;;) {
+		node = key_pscan_find(scan, worker->self);
+		if (!node) {
+			/* look again with the lock held so that we can't miss
+			 * the wake up from a push */
+			pthread_mutex_lock(&scan->lock);
+			for (;;) {
+				if (scan->pending == 0) {
+					pthread_mutex_unlock(&scan->lock);
+					return NULL;
+				}
+				node = key_pscan_find(scan, worker->self);
+				if (node)
+					break;
+				scan->nr_idle++;
+				pthread_cond_wait(&scan->wake, &scan->lock);
+				scan->nr_idle--;
+			}
+			pthread_mutex_unlock(&scan->lock);
+		}
+
+		key_pscan_examine(scan, worker->self, node);
+	}
+}
+
+static int key_pscan_owner_cmp(const void *_a, const void *_b)
+{
+	const struct key_pscan_owner *a = _a, *b = _b;
+
+	return a->key < b->key ? -1 : a->key > b->key;
+}
+
+/*
+ * give the contents of a keyring to the first link to it in tree order, as
+ * that's where keyctl_scan_tree() would have expanded it
+ */
+static void key_pscan_adopt(struct key_pscan *scan, struct key_pscan_node *node)
+{
+	struct key_pscan_owner *o, want = { .key = node->key };
+	struct key_pscan_node *owner;
+	unsigned i;
+
+	o = bsearch(&want, scan->owners, scan->nr_owners, sizeof(*o),
+		    key_pscan_owner_cmp);
+	if (!o || o->taken)
+		return;
+	o->taken = 1;
+	owner = o->node;
+	if (owner == node)
+		return;
+
+	node->children = owner->children;
+	node->nr_children = owner->nr_children;
+	owner->children = NULL;
+	owner->nr_children = 0;
+	for (i = 0; i < node->nr_children; i++)
+		if (node->children[i])
+			node->children[i]->up = node;
+}
+
+/*
+ * apply the callback to an ordered scan's tree, children before parents,
+ * freeing it as we go
+ * - if the scan failed, the tree is just freed
+ */
+static void key_pscan_deliver(struct key_pscan *scan, struct key_pscan_node *node)
+{
+	struct key_pscan_node *up;
+
+	if (scan->nr_owners)
+		qsort(scan->owners, scan->nr_owners, sizeof(*scan->owners),
+		      key_pscan_owner_cmp);
+
+	while (node) {
+		if (!node->entered) {
+			node->entered = 1;
+			if (scan->nr_owners)
+				key_pscan_adopt(scan, node);
+		}
+
+		if (node->next < node->nr_children) {
+			up = node->children[node->next++];
+			if (up)
+				node = up;
+			continue;
+		}
+
+		if (!scan->error) {
+			errno = node->error;
+			scan->kcount += scan->func(node->parent, node->key,
+						   node->desc, node->desc_len,
+						   scan->data);
+		}
+		up = node->up;
+		kfree(node->desc);
+		kfree(node->children);
+		kfree(node);
+		node = up;
+	}
+}
+
+/*
+ * Apply a function over a keyring tree, examining keys in parallel
+ * - special keyring IDs are resolved first
+ * - without KEY_SCAN_ORDERED, the function is applied to each link, one at a
+ *   time, as soon as the key it points to has been examined
+ */
+int keyctl_scan_tree_parallel(key_serial_t key, unsigned flags,
+			      unsigned nr_threads,
+			      recursive_key_scanner_t func, void *data)
+{
+	struct key_pscan_worker *workers;
+	struct key_pscan_node *root;
+	struct key_pscan scan;
+	pthread_t *threads;
+	unsigned i, nr_started = 0;
+	long ncpus;
+
+	if (key < 0) {
+		key = keyctl_get_keyring_ID_cached(key, 0);
+		if (key < 0)
+			return 0;
+	}
+
+	if (nr_threads == 0) {
+		ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+		nr_threads = ncpus > 0 ? ncpus : 1;
+	}
+	if (nr_threads <= 1)
+		return keyctl_scan_tree(key, flags, func, data);
+
+	memset(&scan, 0, sizeof(scan));
+	scan.nr_workers = nr_threads;
+	scan.flags = flags;
+	scan.func = func;
+	scan.data = data;
+	scan.pending = 1;
+	pthread_mutex_init(&scan.func_lock, NULL);
+	pthread_mutex_init(&scan.lock, NULL);
+	pthread_cond_init(&scan.wake, NULL);
+
+	scan.deques = kalloc(nr_threads * sizeof(*scan.deques));
+	workers = kalloc(nr_threads * sizeof(*workers));
+	threads = kalloc(nr_threads * sizeof(*threads));
+	root = kalloc(sizeof(*root));
+	if (!scan.deques || !workers || !threads || !root)
+		goto nomem;
+	memset(scan.deques, 0, nr_threads * sizeof(*scan.deques));
+	memset(root, 0, sizeof(*root));
+	root->key = key;
+
+	for (i = 0; i < nr_threads; i++)
+		pthread_mutex_init(&scan.deques[i].lock, NULL);
+	for (i = 0; i < nr_threads; i++) {
+		scan.deques[i].size = 16;
+		scan.deques[i].items =
+			kalloc(16 * sizeof(*scan.deques[i].items));
+		if (!scan.deques[i].items)
+			goto nomem_deques;
+		workers[i].scan = &scan;
+		workers[i].self = i;
+	}
+
+	key_pscan_push(&scan.deques[0], root);
+
+	/* the calling thread is worker 0 */
+	for (i = 1; i < nr_threads; i++) {
+		if (pthread_create(&threads[i], NULL, key_pscan_thread,
+				   &workers[i]) != 0)
+			break;
+		nr_started++;
+	}
+	key_pscan_thread(&workers[0]);
+	for (i = 1; i <= nr_started; i++)
+		pthread_join(threads[i], NULL);
+
+	if (flags & KEY_SCAN_ORDERED)
+		key_pscan_deliver(&scan, root);
+
+	for (i = 0; i < nr_threads; i++) {
+		kfree(scan.deques[i].items);
+		pthread_mutex_destroy(&scan.deques[i].lock);
+	}
+	kfree(scan.deques);
+	kfree(workers);
+	kfree(threads);
+	kfree(scan.visited.slots);
+	kfree(scan.owners);
+	pthread_cond_destroy(&scan.wake);
+	pthread_mutex_destroy(&scan.lock);
+	pthread_mutex_destroy(&scan.func_lock);
+	if (scan.error) {
+		errno = scan.error;
+		return -1;
+	}
+	return scan.kcount;
+
+nomem_deques:
+	for (i = 0; i < nr_threads; i++) {
+		kfree(scan.deques[i].items);
+		pthread_mutex_destroy(&scan.deques[i].lock);
+	}
+nomem:
+	/* fall back to doing it all in this thread */
+	kfree(scan.deques);
+	kfree(workers);
+	kfree(threads);
+	kfree(root);
+	pthread_cond_destroy(&scan.wake);
+	pthread_mutex_destroy(&scan.lock);
+	pthread_mutex_destroy(&scan.func_lock);
+	return keyctl_scan_tree(key, flags, func, data);
+}
+
+/*
+ * Depth-first apply a function over session keyring tree
+ */
+int recursive_session_key_scan(recursive_key_scanner_t func, void *data)
+{
+	key_serial_t session =
+		keyctl_get_keyring_ID_cached(KEY_SPEC_SESSION_KEYRING, 0);
+	if (session > 0)
+		return recursive_key_scan(session, func, data);
+	return 0;
+}
+
+/*
+ * skip to the next field in a /proc/keys line
+ */
+static char *proc_keys_next(char *p)
+{
+	while (*p && *p != ' ')
+		p++;
+	while (*p == ' ')
+		p++;
+	return p;
+}
+
+/*
+ * parse a line from /proc/keys
+ * - the line must be NUL-terminated
+ * - the type and description are NUL-terminated in place
+ * - returns 0 if successful, -1 if the line is malformed
+ */
+static int proc_keys_parse(char *line, char *end, struct keyctl_proc_key *k)
+{
+	unsigned long n;
+	char *p = line, *q;
+
+	memset(k, 0, sizeof(*k));
+
+	/* serial */
+	k->serial = strtoul(p, &q, 16);
+	if (q == p || *q != ' ')
+		return -1;
+	p = proc_keys_next(q);
+
+	/* flags */
+	for (; *p && *p != ' '; p++) {
+		switch (*p) {
+		case 'I': k->flags |= KEY_PROC_INSTANTIATED;	break;
+		case 'R': k->flags |= KEY_PROC_REVOKED;		break;
+		case 'D': k->flags |= KEY_PROC_DEAD;		break;
+		case 'Q': k->flags |= KEY_PROC_IN_QUOTA;	break;
+		case 'U': k->flags |= KEY_PROC_UNDER_CONSTRUCTION; break;
+		case 'N': k->flags |= KEY_PROC_NEGATIVE;	break;
+		case 'i': k->flags |= KEY_PROC_INVALIDATED;	break;
+		default: break;
+		}
+	}
+	p = proc_keys_next(p);
+
+	/* usage */
+	k->usage = strtol(p, &q, 10);
+	if (q == p || *q != ' ')
+		return -1;
+	p = proc_keys_next(q);
+
+	/* timeout - "perm", "expd" or a count of s, m, h, d or w remaining */
+	if (strncmp(p, "perm", 4) == 0) {
+		k->timeout = -1;
+	} else if (strncmp(p, "expd", 4) == 0) {
+		k->timeout = 0;
+	} else {
+		n = strtoul(p, &q, 10);
+		if (q == p)
+			return -1;
+		switch (*q) {
+		case 's': break;
+		case 'm': n *= 60;		break;
+		case 'h': n *= 60 * 60;		break;
+		case 'd': n *= 60 * 60 * 24;	break;
+		case 'w': n *= 60 * 60 * 24 * 7; break;
+		default: return -1;
+		}
+		k->timeout = n;
+	}
+	p = proc_keys_next(p);
+
+	/* permissions, owner and group */
+	k->perm = strtoul(p, &q, 16);
+	if (q == p || *q != ' ')
+		return -1;
+	p = proc_keys_next(q);
+	k->uid = strtol(p, &q, 10);
+	if (q == p || *q != ' ')
+		return -1;
+	p = proc_keys_next(q);
+	k->gid = strtol(p, &q, 10);
+	if (q == p || *q != ' ')
+		return -1;
+	p = proc_keys_next(q);
+
+	/* type, padded with spaces, and then the rest of the line */
+	q = memchr(p, ' ', end - p);
+	if (!q || q == p)
+		return -1;
+	k->type = p;
+	k->type_len = q - p;
+	*q++ = '\0';
+	while (*q == ' ')
+		q++;
+	k->desc = q;
+	k->desc_len = end - q;
+	return 0;
+}
+
+/*
+ * Iterate over the keys listed in /proc/keys
+ * - the file is read in large chunks and each line is parsed in place
+ * - lines that can't be parsed are skipped
+ * - iteration stops if the function returns non-zero and that value is
+ *   returned; the function should stop with a positive value, keeping
+ *   negative ones for its own errors, for which it sets errno
+ * - errno is preserved from the function and only set here if /proc/keys
+ *   can't be read
+ */
+int keyctl_proc_keys_iterate(keyctl_proc_keys_iterator_t func, void *data)
+{
+	struct keyctl_proc_key k;
+	size_t size = 65536, have = 0;
+	ssize_t n;
+	char *buf, *p, *nl, *tmp;
+	int fd, err, ret = 0;
+
+	fd = open("/proc/keys", O_RDONLY | O_CLOEXEC);
+	if (fd == -1)
+		return -1;
+
+	buf = kalloc(size);
+	if (!buf)
+		goto nomem;
+
+	for (;;) {
+		/* make room if a single line fills the buffer */
+		if (have == size) {
+			tmp = kalloc(size * 2);
+			if (!tmp)
+				goto nomem;
+			memcpy(tmp, buf, have);
+			kfree(buf);
+			buf = tmp;
+			size *= 2;
+		}
+
+		n = read(fd, buf + have, size - have);
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			goto error;
+		}
+
+		/* treat a partial last line as complete at EOF */
+		if (n == 0) {
+			if (have == 0)
+				break;
+			if (have == size)
+				continue;
+			buf[have++] = '\n';
+		} else {
+			have += n;
+		}
+
+		p = buf;
+		while ((nl = memchr(p, '\n', buf + have - p))) {
+			*nl = '\0';
+			if (proc_keys_parse(p, nl, &k) == 0) {
+				ret = func(&k, data);
+				if (ret != 0)
+					goto out;
+			}
+			p = nl + 1;
+		}
+
+		have = buf + have - p;
+		memmove(buf, p, have);
+		if (n == 0)
+			break;
+	}
+	goto out;
+
+nomem:
+	errno = ENOMEM;
+error:
+	ret = -1;
+out:
+	/* don't let the cleanup clobber an errno set by the function */
+	err = errno;
+	kfree(buf);
+	close(fd);
+	errno = err;
+	return ret;
+}
+
+struct find_key_data {
+	const char	*type;
+	const char	*desc;
+	size_t		dlen;
+	key_serial_t	id;
+	int		error;
+};
+
+/*
+ * check that a key, found by its description in /proc/keys, really has the
+ * given description
+ * - the key type appends extra stuff to the end of the description after a
+ *   colon in /proc/keys.  Colons, however, are allowed in descriptions, so we
+ *   need to make a further check
+ * - returns 1 if it matches, 0 if it doesn't and -1 if we should give up
+ * - *_error is updated with any error other than ENOKEY
+ */
+static int find_key_check_desc(key_serial_t id, const char *desc, int *_error)
+{
+	char rdesc[1024], *cp;
+	int n;
+
+	n = keyctl_describe(id, rdesc, sizeof(rdesc) - 1);
+	if (n == -1) {
+		if (errno != ENOKEY)
+			*_error = errno;
+		if (errno == ENOMEM)
+			return -1;
+	}
+	if (n >= sizeof(rdesc) - 1)
+		return 0;
+	rdesc[n] = '\0';
+
+	cp = strrchr(rdesc, ';');
+	if (!cp)
+		return 0;
+	cp++;
+	return strcmp(cp, desc) == 0;
+}
+
+/*
+ * check a key from /proc/keys against the one we're looking for
+ * - returns 1 if found and 2 if we should give up
+ */
+static int find_key_by_type_and_desc_func(const struct keyctl_proc_key *k,
+					  void *data)
+{
+	struct find_key_data *fk = data;
+
+	if (strcmp(k->type, fk->type) != 0)
+		return 0;
+	if (k->desc_len < fk->dlen ||
+	    memcmp(k->desc, fk->desc, fk->dlen) != 0)
+		return 0;
+	if (k->desc[fk->dlen] != ':' &&
+	    k->desc[fk->dlen] != '\0' &&
+	    k->desc[fk->dlen] != ' ')
+		return 0;
+
+	switch (find_key_check_desc(k->serial, fk->desc, &fk->error)) {
+	case 1:
+		fk->id = k->serial;
+		return 1;
+	case -1:
+		return 2;
+	default:
+		return 0;
+	}
+}
+
+/*
+ * Find a key by type and description
+ */
+key_serial_t find_key_by_type_and_desc(const char *type, const char *desc,
+				       key_serial_t destringid)
+{
+	struct find_key_data fk = {
+		.type	= type,
+		.desc	= desc,
+		.error	= ENOKEY,
+	};
+	key_serial_t id;
+	int ret;
+
+	id = request_key(type, desc, NULL, destringid);
+	if (id >= 0 || errno == ENOMEM)
+		return id;
+	if (errno != ENOKEY)
+		fk.error = errno;
+
+	fk.dlen = strlen(desc);
+
+	ret = keyctl_proc_keys_iterate(find_key_by_type_and_desc_func, &fk);
+	if (ret == -1) {
+		fprintf(stderr, "libkeyutils: Can't read /proc/keys: %m\n");
+		return -1;
+	}
+
+	if (ret == 1) {
+		if (destringid &&
+		    keyctl_link(fk.id, destringid) == -1)
+			return -1;
+		return fk.id;
+	}
+
+	errno = fk.error;
+	return -1;
+}
+
+/*
+ * Index of the keys in /proc/keys by type and description
+ * - each key is entered under every prefix of its /proc/keys description
+ *   that ends at a colon or a space, as well as under the whole thing, since
+ *   we can't tell where the description ends and the type's summary begins
+ * - the names are kept as "type\0desc\0" in the heap
+ */
+struct key_index_entry {
+	uint32_t	hash;
+	key_serial_t	serial;
+	size_t		name;		/* offset of name in heap */
+	unsigned	type_len;
+	unsigned	desc_len;	/* length of the description prefix */
+};
+
+struct keyctl_key_index {
+	unsigned		max_age;
+	unsigned		flags;
+	int			valid;
+	time_t			built;		/* when last built */
+	struct key_index_entry	*entries;
+	unsigned		nr_entries;
+	unsigned		max_entries;
+	unsigned		*slots;		/* entry number + 1 or 0 if empty */
+	unsigned		mask;		/* number of slots - 1 */
+	char			*heap;
+	size_t			heap_len;
+	size_t			heap_size;
+};
+
+static uint32_t key_index_hash(uint32_t hash, const char *p, size_t len)
+{
+	while (len--)
+		hash = (hash ^ (unsigned char)*p++) * 16777619U;
+	return hash;
+}
+
+static time_t key_index_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec;
+}
+
+/*
+ * grow an array allocated with kalloc() to hold at least n more bytes
+ */
+static int key_index_grow(void **_array, size_t *_size, size_t used, size_t n)
+{
+	size_t size = *_size;
+	void *p;
+
+	if (used + n <= size)
+		return 0;
+	while (used + n > size)
+		size = size ? size * 2 : 4096;
+	p = kalloc(size);
+	if (!p) {
+		errno = ENOMEM;
+		return -1;
+	}
+	if (*_array) {
+		memcpy(p, *_array, used);
+		kfree(*_array);
+	}
+	*_array = p;
+	*_size = size;
+	return 0;
+}
+
+static int key_index_add_entry(struct keyctl_key_index *index, uint32_t hash,
+			       key_serial_t serial, size_t name,
+			       unsigned type_len, unsigned desc_len)
+{
+	struct key_index_entry *e;
+	size_t size = index->max_entries * sizeof(*e);
+
+	if (key_index_grow((void **)&index->entries, &size,
+			   index->nr_entries * sizeof(*e), sizeof(*e)) < 0)
+		return -1;
+	index->max_entries = size / sizeof(*e);
+
+	e = &index->entries[index->nr_entries++];
+	e->hash = hash;
+	e->serial = serial;
+	e->name = name;
+	e->type_len = type_len;
+	e->desc_len = desc_len;
+	return 0;
+}
+
+/*
+ * enter a key from /proc/keys into the index
+ */
+static int key_index_add(const struct keyctl_proc_key *k, void *data)
+{
+	struct keyctl_key_index *index = data;
+	uint32_t hash;
+	size_t name, i;
+	char *p;
+
+	name = index->heap_len;
+	if (key_index_grow((void **)&index->heap, &index->heap_size,
+			   index->heap_len, k->type_len + k->desc_len + 2) < 0)
+		return -1;
+	p = index->heap + name;
+	memcpy(p, k->type, k->type_len + 1);
+	p += k->type_len + 1;
+	memcpy(p, k->desc, k->desc_len + 1);
+	index->heap_len += k->type_len + k->desc_len + 2;
+
+	hash = key_index_hash(2166136261U, k->type, k->type_len + 1);
+	for (i = 0; i < k->desc_len; i++) {
+		if ((p[i] == ':' || p[i] == ' ') &&
+		    key_index_add_entry(index, hash, k->serial, name,
+					k->type_len, i) < 0)
+			return -1;
+		hash = key_index_hash(hash, p + i, 1);
+	}
+	if (key_index_add_entry(index, hash, k->serial, name,
+				k->type_len, k->desc_len) < 0)
+		return -1;
+	return 0;
+}
+
+/*
+ * (re)build the index from /proc/keys
+ */
+static int key_index_build(struct keyctl_key_index *index)
+{
+	unsigned i, j, size;
+	int ret;
+
+	index->valid = 0;
+	index->nr_entries = 0;
+	index->heap_len = 0;
+
+	ret = keyctl_proc_keys_iterate(key_index_add, index);
+	if (ret != 0)
+		return -1;
+
+	for (size = 64; size < index->nr_entries * 2; size *= 2)
+		;
+	if (size != index->mask + 1) {
+		kfree(index->slots);
+		index->slots = kalloc(size * sizeof(unsigned));
+		if (!index->slots) {
+			index->mask = 0;
+			return -1;
+		}
+		index->mask = size - 1;
+	}
+	memset(index->slots, 0, size * sizeof(unsigned));
+
+	for (i = 0; i < index->nr_entries; i++) {
+		j = index->entries[i].hash & index->mask;
+		while (index->slots[j])
+			j = (j + 1) & index->mask;
+		index->slots[j] = i + 1;
+	}
+
+	index->built = key_index_now();
+	index->valid = 1;
+	return 0;
+}
+
+/*
+ * look a key up in the index, checking each candidate with the kernel
+ * - returns the key ID, 0 if not found or -1 if we should give up
+ */
+static key_serial_t key_index_lookup(struct keyctl_key_index *index,
+				     const char *type, const char *desc,
+				     int *_error)
+{
+	struct key_index_entry *e;
+	size_t type_len = strlen(type), desc_len = strlen(desc);
+	uint32_t hash;
+	unsigned i;
+	char *name;
+
+	hash = key_index_hash(2166136261U, type, type_len + 1);
+	hash = key_index_hash(hash, desc, desc_len);
+
+	for (i = hash & index->mask; index->slots[i]; i = (i + 1) & index->mask) {
+		e = &index->entries[index->slots[i] - 1];
+		if (e->hash != hash ||
+		    e->type_len != type_len ||
+		    e->desc_len != desc_len)
+			continue;
+		name = index->heap + e->name;
+		if (memcmp(name, type, type_len) != 0 ||
+		    memcmp(name + type_len + 1, desc, desc_len) != 0)
+			continue;
+
+		switch (find_key_check_desc(e->serial, desc, _error)) {
+		case 1:
+			return e->serial;
+		case -1:
+			return -1;
+		default:
+			break;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Create an index for finding keys by type and description
+ * - the index is rebuilt when it gets older than max_age seconds, if max_age
+ *   isn't 0
+ */
+struct keyctl_key_index *keyctl_key_index_create(unsigned max_age,
+						 unsigned flags)
+{
+	struct keyctl_key_index *index;
+
+	index = kalloc(sizeof(*index));
+	if (!index)
+		return NULL;
+	memset(index, 0, sizeof(*index));
+	index->max_age = max_age;
+	index->flags = flags;
+	return index;
+}
+
+/*
+ * Find a key by type and description, as find_key_by_type_and_desc() does,
+ * but use the index rather than scanning /proc/keys each time
+ */
+key_serial_t keyctl_key_index_find(struct keyctl_key_index *index,
+				   const char *type, const char *desc,
+				   key_serial_t destringid)
+{
+	key_serial_t id;
+	int error = ENOKEY, fresh = 0;
 
 	id = request_key(type, desc, NULL, destringid);
 	if (id >= 0 || errno == ENOMEM)
@@ -445,69 +3692,1090 @@ key_serial_t find_key_by_type_and_desc(const char *type, const char *desc,
 	if (errno != ENOKEY)
 		error = errno;
 
-	dlen = strlen(desc);
+	if (!index->valid ||
+	    (index->max_age &&
+	     key_index_now() - index->built >= index->max_age)) {
+		if (key_index_build(index) < 0)
+			return -1;
+		fresh = 1;
+	}
+
+	for (;;) {
+		id = key_index_lookup(index, type, desc, &error);
+		if (id > 0)
+			break;
+
+		/* the key may have been added since the index was built */
+		if (id < 0 || fresh || (index->flags & KEY_INDEX_NO_MISS_REBUILD)) {
+			errno = error;
+			return -1;
+		}
+		if (key_index_build(index) < 0)
+			return -1;
+		fresh = 1;
+	}
+
+	if (destringid &&
+	    keyctl_link(id, destringid) == -1)
+		return -1;
+	return id;
+}
+
+/*
+ * Destroy an index
+ */
+void keyctl_key_index_destroy(struct keyctl_key_index *index)
+{
+	if (index) {
+		kfree(index->entries);
+		kfree(index->slots);
+		kfree(index->heap);
+		kfree(index);
+	}
+}
+
+/*
+ * Coalesced key requests
+ * - concurrent keyctl_request_shared() calls in this process with the same
+ *   arguments share a single request_key() call, made by whichever arrived
+ *   first; the others sleep until it completes and then take its result
+ * - the request is only shared between threads that would make the same
+ *   search and put the key in the same place, so the credentials, the session
+ *   keyring and the default destination keyring are part of what must match,
+ *   and threads that have a thread keyring or whose default destination is
+ *   per-thread don't share at all
+ * - the strings belong to the thread making the call and may only be looked
+ *   at under request_flight_lock whilst the flight is in the table
+ * - the flights come from libc rather than the caller's allocator as they're
+ *   freed by whichever thread is last to look at them
+ */
+#define REQUEST_FLIGHT_SLOTS	64
+
+struct request_flight {
+	struct request_flight	*next;
+	uint32_t		hash;
+	const char		*type;
+	const char		*desc;
+	const char		*callout_info;
+	key_serial_t		destringid;
+	int			reqkey_defl;
+	uid_t			uid;
+	gid_t			gid;
+	key_serial_t		session;
+	unsigned		usage;
+	int			done;
+	key_serial_t		result;
+	int			error;
+	pthread_cond_t		landed;
+};
+
+static pthread_mutex_t request_flight_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t request_flight_once = PTHREAD_ONCE_INIT;
+static struct request_flight *request_flights[REQUEST_FLIGHT_SLOTS];
+
+static void request_flight_prepare(void)
+{
+	pthread_mutex_lock(&request_flight_lock);
+}
+
+static void request_flight_parent(void)
+{
+	pthread_mutex_unlock(&request_flight_lock);
+}
+
+/*
+ * the child of a fork only has the forking thread, so the flights it inherits
+ * will never land; forget about them
+ */
+static void request_flight_child(void)
+{
+	memset(request_flights, 0, sizeof(request_flights));
+	pthread_mutex_unlock(&request_flight_lock);
+}
+
+static void request_flight_init(void)
+{
+	pthread_atfork(request_flight_prepare, request_flight_parent,
+		       request_flight_child);
+}
+
+static int request_flight_match(const struct request_flight *f,
+				const struct request_flight *want)
+{
+	if (f->hash != want->hash ||
+	    f->destringid != want->destringid ||
+	    f->reqkey_defl != want->reqkey_defl ||
+	    f->uid != want->uid ||
+	    f->gid != want->gid ||
+	    f->session != want->session ||
+	    strcmp(f->type, want->type) != 0 ||
+	    strcmp(f->desc, want->desc) != 0)
+		return 0;
+	if (!f->callout_info || !want->callout_info)
+		return f->callout_info == want->callout_info;
+	return strcmp(f->callout_info, want->callout_info) == 0;
+}
+
+static void request_flight_put(struct request_flight *f)
+{
+	if (--f->usage == 0) {
+		pthread_cond_destroy(&f->landed);
+		free(f);
+	}
+}
+
+/*
+ * Request a key, sharing the request with any other threads in this process
+ * that are currently requesting the same key
+ */
+key_serial_t keyctl_request_shared(const char *type, const char *description,
+				   const char *callout_info,
+				   key_serial_t destringid)
+{
+	struct request_flight want, *f, **pp;
+	key_serial_t ret;
+	uint32_t hash;
+	int err;
+
+	/* each thread has a different thread keyring, which is searched first
+	 * if there is one */
+	if (destringid == KEY_SPEC_THREAD_KEYRING ||
+	    keyctl_get_keyring_ID_cached(KEY_SPEC_THREAD_KEYRING, 0) > 0)
+		goto unshared;
+
+	/* each thread has its own default destination, which is only the same
+	 * keyring for all of them if it isn't the thread's own */
+	memset(&want, 0, sizeof(want));
+	want.reqkey_defl = KEY_REQKEY_DEFL_NO_CHANGE;
+	if (destringid == 0) {
+		want.reqkey_defl =
+			keyctl_set_reqkey_keyring(KEY_REQKEY_DEFL_NO_CHANGE);
+		switch (want.reqkey_defl) {
+		case KEY_REQKEY_DEFL_DEFAULT:
+		case KEY_REQKEY_DEFL_PROCESS_KEYRING:
+		case KEY_REQKEY_DEFL_SESSION_KEYRING:
+		case KEY_REQKEY_DEFL_USER_KEYRING:
+		case KEY_REQKEY_DEFL_USER_SESSION_KEYRING:
+		case KEY_REQKEY_DEFL_GROUP_KEYRING:
+			break;
+		default:
+			goto unshared;
+		}
+	}
+
+	want.uid = geteuid();
+	want.gid = getegid();
+	want.session = keyctl_get_keyring_ID_cached(KEY_SPEC_SESSION_KEYRING, 0);
+	if (want.session < 0)
+		want.session = 0;
+
+	pthread_once(&request_flight_once, request_flight_init);
+
+	hash = key_index_hash(2166136261U, type, strlen(type) + 1);
+	hash = key_index_hash(hash, description, strlen(description) + 1);
+	if (callout_info)
+		hash = key_index_hash(hash, callout_info, strlen(callout_info));
+	hash = key_index_hash(hash, (const char *)&destringid, sizeof(destringid));
+	hash = key_index_hash(hash, (const char *)&want.session,
+			      sizeof(want.session));
+	want.hash		= hash;
+	want.type		= type;
+	want.desc		= description;
+	want.callout_info	= callout_info;
+	want.destringid		= destringid;
+	pp = &request_flights[hash % REQUEST_FLIGHT_SLOTS];
+
+	pthread_mutex_lock(&request_flight_lock);
+
+	for (f = *pp; f; f = f->next) {
+		if (request_flight_match(f, &want)) {
+			/* someone's already asking; wait for their answer */
+			f->usage++;
+			while (!f->done)
+				pthread_cond_wait(&f->landed, &request_flight_lock);
+			ret = f->result;
+			err = f->error;
+			request_flight_put(f);
+			pthread_mutex_unlock(&request_flight_lock);
+			errno = err;
+			return ret;
+		}
+	}
+
+	f = malloc(sizeof(*f));
+	if (!f) {
+		pthread_mutex_unlock(&request_flight_lock);
+		goto unshared;
+	}
+	*f = want;
+	f->usage = 1;
+	pthread_cond_init(&f->landed, NULL);
+	f->next = *pp;
+	*pp = f;
+
+	pthread_mutex_unlock(&request_flight_lock);
+
+	ret = request_key(type, description, callout_info, destringid);
+	err = errno;
+
+	pthread_mutex_lock(&request_flight_lock);
+	for (; *pp; pp = &(*pp)->next) {
+		if (*pp == f) {
+			*pp = f->next;
+			break;
+		}
+	}
+	f->result = ret;
+	f->error = err;
+	f->done = 1;
+	pthread_cond_broadcast(&f->landed);
+	request_flight_put(f);
+	pthread_mutex_unlock(&request_flight_lock);
+
+	errno = err;
+	return ret;
+
+unshared:
+	return request_key(type, description, callout_info, destringid);
+}
+
+/*
+ * Asynchronous key requests
+ * - requests are queued for a pool of worker threads, which make them with
+ *   keyctl_request_shared() so that identical requests are coalesced
+ * - completed requests are put on the done list and the eventfd is kicked;
+ *   the callbacks are then run by keyctl_async_dispatch() in whatever thread
+ *   the caller likes
+ * - each request is on exactly one of the queue, running and done lists
+ * - the pool and the requests come from libc rather than the caller's
+ *   allocator as the workers free requests concurrently with the caller's
+ *   threads
+ */
+enum async_state {
+	ASYNC_QUEUED,
+	ASYNC_RUNNING,
+	ASYNC_DONE,
+};
+
+struct async_req {
+	struct async_req	*next;
+	struct async_req	*prev;
+	long			id;
+	enum async_state	state;
+	int			cancelled;
+	const char		*type;
+	const char		*desc;
+	const char		*callout_info;
+	key_serial_t		destringid;
+	keyctl_async_func_t	func;
+	void			*data;
+	key_serial_t		result;
+	int			error;
+	char			strings[];
+};
+
+struct async_list {
+	struct async_req	*head;
+	struct async_req	*tail;
+	unsigned		nr;
+};
+
+struct keyctl_async {
+	pthread_mutex_t		lock;
+	pthread_cond_t		work;
+	struct async_list	queue;
+	struct async_list	running;
+	struct async_list	done;
+	unsigned		max_queued;
+	long			next_id;
+	int			stopping;
+	int			efd;
+	unsigned		nr_threads;
+	pthread_t		threads[];
+};
+
+static void async_list_add(struct async_list *list, struct async_req *req)
+{
+	req->next = NULL;
+	req->prev = list->tail;
+	if (list->tail)
+		list->tail->next = req;
+	else
+		list->head = req;
+	list->tail = req;
+	list->nr++;
+}
+
+static void async_list_del(struct async_list *list, struct async_req *req)
+{
+	if (req->prev)
+		req->prev->next = req->next;
+	else
+		list->head = req->next;
+	if (req->next)
+		req->next->prev = req->prev;
+	else
+		list->tail = req->prev;
+	list->nr--;
+}
+
+static void async_list_free(struct async_list *list)
+{
+	struct async_req *req;
 
-	f = fopen("/proc/keys", "r");
-	if (!f) {
-		fprintf(stderr, "libkeyutils: Can't open /proc/keys: %m\n");
+	while ((req = list->head)) {
+		async_list_del(list, req);
+		free(req);
+	}
+}
+
+/*
+ * worker thread
+ */
+static void *async_worker(void *_async)
+{
+	struct keyctl_async *async = _async;
+	struct async_req *req;
+	uint64_t one = 1;
+
+	pthread_mutex_lock(&async->lock);
+	for (;;) {
+		while (!async->queue.head && !async->stopping)
+			pthread_cond_wait(&async->work, &async->lock);
+		if (async->stopping)
+			break;
+
+		req = async->queue.head;
+		async_list_del(&async->queue, req);
+		req->state = ASYNC_RUNNING;
+		async_list_add(&async->running, req);
+		pthread_mutex_unlock(&async->lock);
+
+		req->result = keyctl_request_shared(req->type, req->desc,
+						    req->callout_info,
+						    req->destringid);
+		req->error = req->result == -1 ? errno : 0;
+
+		pthread_mutex_lock(&async->lock);
+		async_list_del(&async->running, req);
+		if (req->cancelled) {
+			free(req);
+			continue;
+		}
+		req->state = ASYNC_DONE;
+		async_list_add(&async->done, req);
+
+		/* this can only fail if the counter is saturated, in which
+		 * case the fd is readable anyway */
+		if (write(async->efd, &one, sizeof(one)) < 0) {}
+	}
+	pthread_mutex_unlock(&async->lock);
+	return NULL;
+}
+
+/*
+ * Create a pool of threads to make key requests asynchronously, with up to
+ * max_queued requests waiting for a thread
+ */
+struct keyctl_async *keyctl_async_create(unsigned nr_threads,
+					 unsigned max_queued)
+{
+	struct keyctl_async *async;
+	sigset_t all, old;
+	unsigned i;
+	int err;
+
+	if (nr_threads == 0 || max_queued == 0) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	async = malloc(sizeof(*async) + nr_threads * sizeof(pthread_t));
+	if (!async)
+		return NULL;
+	memset(async, 0, sizeof(*async));
+	async->max_queued = max_queued;
+	async->next_id = 1;
+
+	async->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (async->efd == -1) {
+		free(async);
+		return NULL;
+	}
+
+	pthread_mutex_init(&async->lock, NULL);
+	pthread_cond_init(&async->work, NULL);
+
+	/* the workers shouldn't take the caller's signals */
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &old);
+	for (i = 0; i < nr_threads; i++) {
+		err = pthread_create(&async->threads[i], NULL, async_worker, async);
+		if (err)
+			break;
+		async->nr_threads++;
+	}
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	if (async->nr_threads < nr_threads) {
+		keyctl_async_destroy(async);
+		errno = err;
+		return NULL;
+	}
+	return async;
+}
+
+/*
+ * Get the eventfd that becomes readable when requests have completed
+ */
+int keyctl_async_fd(struct keyctl_async *async)
+{
+	return async->efd;
+}
+
+/*
+ * Queue a key request, returning an ID by which it can be cancelled
+ */
+long keyctl_request_async(struct keyctl_async *async,
+			  const char *type, const char *description,
+			  const char *callout_info, key_serial_t destringid,
+			  keyctl_async_func_t func, void *data)
+{
+	struct async_req *req;
+	size_t tlen, dlen, clen;
+	char *p;
+	long id;
+
+	/* that would be the worker's thread keyring */
+	if (destringid == KEY_SPEC_THREAD_KEYRING || !func) {
+		errno = EINVAL;
 		return -1;
 	}
 
-	while (fgets(buf, sizeof(buf), f)) {
-		cp = strchr(buf, '\n');
-		if (*cp)
-			*cp = '\0';
+	tlen = strlen(type) + 1;
+	dlen = strlen(description) + 1;
+	clen = callout_info ? strlen(callout_info) + 1 : 0;
 
-		ndesc = 0;
-		n = sscanf(buf, "%x %*s %*u %*s %*x %*d %*d %s %n",
-			   &id, typebuf, &ndesc);
-		if (n == 2 && ndesc > 0 && ndesc <= cp - buf) {
-			if (strcmp(typebuf, type) != 0)
-				continue;
-			kdesc = buf + ndesc;
-			if (memcmp(kdesc, desc, dlen) != 0)
-				continue;
-			if (kdesc[dlen] != ':' &&
-			    kdesc[dlen] != '\0' &&
-			    kdesc[dlen] != ' ')
-				continue;
-			kdesc[dlen] = '\0';
-
-			/* The key type appends extra stuff to the end of the
-			 * description after a colon in /proc/keys.  Colons,
-			 * however, are allowed in descriptions, so we need to
-			 * make a further check. */
-			n = keyctl_describe(id, rdesc, sizeof(rdesc) - 1);
-			if (n == -1) {
-				if (errno != ENOKEY)
-					error = errno;
-				if (errno == ENOMEM)
-					break;
-			}
-			if (n >= sizeof(rdesc) - 1)
-				continue;
-			rdesc[n] = '\0';
+	req = malloc(sizeof(*req) + tlen + dlen + clen);
+	if (!req)
+		return -1;
+	memset(req, 0, sizeof(*req));
+	p = req->strings;
+	req->type = memcpy(p, type, tlen);
+	p += tlen;
+	req->desc = memcpy(p, description, dlen);
+	p += dlen;
+	if (callout_info)
+		req->callout_info = memcpy(p, callout_info, clen);
+	req->destringid = destringid;
+	req->func = func;
+	req->data = data;
 
-			cp = strrchr(rdesc, ';');
-			if (!cp)
-				continue;
-			cp++;
-			if (strcmp(cp, desc) != 0)
-				continue;
+	pthread_mutex_lock(&async->lock);
+	if (async->queue.nr >= async->max_queued) {
+		pthread_mutex_unlock(&async->lock);
+		free(req);
+		errno = EAGAIN;
+		return -1;
+	}
+	id = req->id = async->next_id++;
+	req->state = ASYNC_QUEUED;
+	async_list_add(&async->queue, req);
+	pthread_cond_signal(&async->work);
+	pthread_mutex_unlock(&async->lock);
+	return id;
+}
+
+static struct async_req *async_find(struct async_list *list, long id)
+{
+	struct async_req *req;
+
+	for (req = list->head; req; req = req->next)
+		if (req->id == id)
+			return req;
+	return NULL;
+}
+
+/*
+ * Cancel a request so that its callback won't be called
+ * - a request that a worker has already started can't be stopped, but its
+ *   result will be discarded
+ */
+int keyctl_async_cancel(struct keyctl_async *async, long id)
+{
+	struct async_req *req;
+	int ret = 0;
+
+	pthread_mutex_lock(&async->lock);
+	if ((req = async_find(&async->queue, id))) {
+		async_list_del(&async->queue, req);
+		free(req);
+	} else if ((req = async_find(&async->done, id))) {
+		async_list_del(&async->done, req);
+		free(req);
+	} else if ((req = async_find(&async->running, id)) && !req->cancelled) {
+		req->cancelled = 1;
+	} else {
+		errno = ENOENT;
+		ret = -1;
+	}
+	pthread_mutex_unlock(&async->lock);
+	return ret;
+}
+
+/*
+ * Call the callbacks for the requests that have completed, returning the
+ * number called
+ */
+int keyctl_async_dispatch(struct keyctl_async *async)
+{
+	struct async_req *req, *next;
+	uint64_t count;
+	int n = 0;
+
+	if (read(async->efd, &count, sizeof(count)) == -1 && errno != EAGAIN)
+		return -1;
+
+	pthread_mutex_lock(&async->lock);
+	req = async->done.head;
+	async->done.head = async->done.tail = NULL;
+	async->done.nr = 0;
+	pthread_mutex_unlock(&async->lock);
+
+	for (; req; req = next) {
+		next = req->next;
+		req->func(req->result, req->error, req->data);
+		free(req);
+		n++;
+	}
+	return n;
+}
+
+/*
+ * Destroy a pool, abandoning any requests that haven't completed and discarding
+ * the results of those that have but haven't been dispatched
+ * - this waits for requests that are in progress to finish
+ */
+void keyctl_async_destroy(struct keyctl_async *async)
+{
+	unsigned i;
+
+	if (!async)
+		return;
+
+	pthread_mutex_lock(&async->lock);
+	async->stopping = 1;
+	async_list_free(&async->queue);
+	pthread_cond_broadcast(&async->work);
+	pthread_mutex_unlock(&async->lock);
+
+	for (i = 0; i < async->nr_threads; i++)
+		pthread_join(async->threads[i], NULL);
+
+	async_list_free(&async->running);
+	async_list_free(&async->done);
+	pthread_cond_destroy(&async->work);
+	pthread_mutex_destroy(&async->lock);
+	close(async->efd);
+	free(async);
+}
+
+/*****************************************************************************/
+/*
+ * Columnar snapshot of a keyring tree
+ * - each attribute is held in an array of its own, indexed by entry, and the
+ *   descriptions are packed end to end in a single heap
+ * - the entries are in the order the links were found, so that the subtree
+ *   under an entry follows it directly and ends at next[]
+ * - the type names are held once each in a table
+ */
+struct snap_build {
+	struct keyctl_snapshot *snap;
+	unsigned	cap;		/* number of entries there's room for */
+	size_t		heap_used;
+	size_t		heap_cap;
+	unsigned	*stack;		/* entries on the path being scanned */
+	unsigned	depth;
+	unsigned	max_depth;
+	int		error;
+};
+
+/*
+ * replace an array with one of a different size, keeping the first nr elements
+ */
+static int snap_resize_col(void *_col, size_t elsize, size_t nr, size_t cap)
+{
+	void **col = _col, *p;
+
+	p = kalloc(cap * elsize);
+	if (!p)
+		return -1;
+	if (*col) {
+		memcpy(p, *col, nr * elsize);
+		kfree(*col);
+	}
+	*col = p;
+	return 0;
+}
+
+static int snap_resize(struct snap_build *b, unsigned cap)
+{
+	struct keyctl_snapshot *snap = b->snap;
+	unsigned nr = snap->nr;
+
+	if (snap_resize_col(&snap->serial, sizeof(*snap->serial), nr, cap) < 0 ||
+	    snap_resize_col(&snap->parent, sizeof(*snap->parent), nr, cap) < 0 ||
+	    snap_resize_col(&snap->next, sizeof(*snap->next), nr, cap) < 0 ||
+	    snap_resize_col(&snap->type, sizeof(*snap->type), nr, cap) < 0 ||
+	    snap_resize_col(&snap->uid, sizeof(*snap->uid), nr, cap) < 0 ||
+	    snap_resize_col(&snap->gid, sizeof(*snap->gid), nr, cap) < 0 ||
+	    snap_resize_col(&snap->perm, sizeof(*snap->perm), nr, cap) < 0 ||
+	    snap_resize_col(&snap->timeout, sizeof(*snap->timeout), nr, cap) < 0 ||
+	    snap_resize_col(&snap->desc_off, sizeof(*snap->desc_off),
+			    nr + 1, cap + 1) < 0)
+		return -1;
+	b->cap = cap;
+	return 0;
+}
+
+/*
+ * find or add a type in the snapshot's type table
+ */
+static int snap_type(struct keyctl_snapshot *snap,
+		     const struct keyctl_key_desc *parsed)
+{
+	struct keyctl_snapshot_type *t;
+	unsigned i;
+	char *name;
+
+	for (i = 0; i < snap->nr_types; i++)
+		if (strncmp(snap->types[i].name, parsed->type,
+			    parsed->type_len) == 0 &&
+		    !snap->types[i].name[parsed->type_len])
+			return i;
+
+	if (i >= KEY_SNAPSHOT_NO_TYPE) {
+		errno = E2BIG;
+		return -1;
+	}
+
+	name = kalloc(parsed->type_len + 1);
+	t = kalloc((i + 1) * sizeof(*t));
+	if (!name || !t) {
+		kfree(name);
+		kfree(t);
+		return -1;
+	}
+	memcpy(name, parsed->type, parsed->type_len);
+	name[parsed->type_len] = 0;
+	if (snap->types) {
+		memcpy(t, snap->types, i * sizeof(*t));
+		kfree(snap->types);
+	}
+	t[i].name = name;
+	t[i].type_id = parsed->type_id;
+	snap->types = t;
+	snap->nr_types++;
+	return i;
+}
+
+/*
+ * add an entry for each link as the scan comes to it
+ */
+static int snap_enter(key_serial_t parent, key_serial_t key,
+		      const char *desc, int desc_len, void *data)
+{
+	struct keyctl_key_desc parsed;
+	struct snap_build *b = data;
+	struct keyctl_snapshot *snap = b->snap;
+	const char *d = "";
+	size_t dlen = 0, need;
+	unsigned i, *stack;
+	char *heap;
+	int type;
+
+	if (snap->nr >= b->cap &&
+	    snap_resize(b, b->cap ? b->cap * 2 : 64) < 0)
+		goto error;
 
-			fclose(f);
+	if (b->depth >= b->max_depth) {
+		stack = kalloc((b->max_depth + 16) * sizeof(*stack));
+		if (!stack)
+			goto error;
+		if (b->stack) {
+			memcpy(stack, b->stack, b->depth * sizeof(*stack));
+			kfree(b->stack);
+		}
+		b->stack = stack;
+		b->max_depth += 16;
+	}
+
+	i = snap->nr;
+	if (desc && keyctl_parse_description(desc, desc_len, &parsed) == 0) {
+		type = snap_type(snap, &parsed);
+		if (type < 0)
+			goto error;
+		snap->type[i] = type;
+		snap->uid[i] = parsed.uid;
+		snap->gid[i] = parsed.gid;
+		snap->perm[i] = parsed.perm;
+		d = parsed.desc;
+		dlen = parsed.desc_len;
+	} else {
+		snap->type[i] = KEY_SNAPSHOT_NO_TYPE;
+		snap->uid[i] = -1;
+		snap->gid[i] = -1;
+		snap->perm[i] = 0;
+	}
 
-			if (destringid &&
-			    keyctl_link(id, destringid) == -1)
-				return -1;
+	need = b->heap_used + dlen + 1;
+	if (need > UINT32_MAX) {
+		errno = E2BIG;
+		goto error;
+	}
+	if (need > b->heap_cap) {
+		size_t cap = b->heap_cap ? b->heap_cap * 2 : 4096;
 
-			return id;
+		while (cap < need)
+			cap *= 2;
+		heap = kalloc(cap);
+		if (!heap)
+			goto error;
+		if (snap->desc_heap) {
+			memcpy(heap, snap->desc_heap, b->heap_used);
+			kfree(snap->desc_heap);
 		}
+		snap->desc_heap = heap;
+		b->heap_cap = cap;
 	}
+	memcpy(snap->desc_heap + b->heap_used, d, dlen);
+	snap->desc_heap[b->heap_used + dlen] = 0;
+	b->heap_used = need;
 
-	fclose(f);
-	errno = error;
-	return -1;
+	snap->serial[i] = key;
+	snap->parent[i] = b->depth ? b->stack[b->depth - 1] : KEY_SNAPSHOT_NONE;
+	snap->next[i] = KEY_SNAPSHOT_NONE;
+	snap->timeout[i] = KEY_SNAPSHOT_TIMEOUT_UNKNOWN;
+	snap->desc_off[i] = need - dlen - 1;
+	snap->desc_off[i + 1] = need;
+	snap->nr++;
+
+	b->stack[b->depth++] = i;
+	return KEY_SCAN_CONTINUE;
+
+error:
+	b->error = errno ?: ENOMEM;
+	return KEY_SCAN_STOP;
+}
+
+/*
+ * note where an entry's subtree ends as the scan leaves it
+ */
+static int snap_leave(key_serial_t parent, key_serial_t key,
+		      char *desc, int desc_len, void *data)
+{
+	struct snap_build *b = data;
+
+	b->snap->next[b->stack[--b->depth]] = b->snap->nr;
+	return 1;
+}
+
+/*
+ * stable sort of entry indices, merging runs between two arrays
+ */
+typedef int (*snap_cmp_t)(const struct keyctl_snapshot *snap,
+			  unsigned a, unsigned b);
+
+static int snap_sort(const struct keyctl_snapshot *snap, snap_cmp_t cmp,
+		     unsigned *order)
+{
+	unsigned *tmp, *from, *to, *swap;
+	unsigned nr = snap->nr, width, lo, mid, hi, i, j, k;
+
+	for (i = 0; i < nr; i++)
+		order[i] = i;
+	if (nr < 2)
+		return 0;
+
+	tmp = kalloc(nr * sizeof(*tmp));
+	if (!tmp)
+		return -1;
+
+	from = order;
+	to = tmp;
+	for (width = 1; width < nr; width *= 2) {
+		for (lo = 0; lo < nr; lo += 2 * width) {
+			mid = lo + width < nr ? lo + width : nr;
+			hi = mid + width < nr ? mid + width : nr;
+			i = lo;
+			j = mid;
+			for (k = lo; k < hi; k++) {
+				if (i < mid &&
+				    (j >= hi || cmp(snap, from[i], from[j]) <= 0))
+					to[k] = from[i++];
+				else
+					to[k] = from[j++];
+			}
+		}
+		swap = from;
+		from = to;
+		to = swap;
+	}
+
+	if (from != order)
+		memcpy(order, from, nr * sizeof(*order));
+	kfree(tmp);
+	return 0;
+}
+
+/*
+ * find the first place in the by-serial index at which a key would go
+ */
+static unsigned snap_lower_bound(const struct keyctl_snapshot *snap,
+				 key_serial_t serial)
+{
+	unsigned lo = 0, hi = snap->nr, mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (snap->serial[snap->by_serial[mid]] < serial)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+#define SNAP_CMP(a, b) ((a) < (b) ? -1 : (a) > (b) ? 1 : 0)
+
+static int snap_cmp_serial(const struct keyctl_snapshot *snap,
+			   unsigned a, unsigned b)
+{
+	return SNAP_CMP(snap->serial[a], snap->serial[b]);
+}
+
+static int snap_cmp_type(const struct keyctl_snapshot *snap,
+			 unsigned a, unsigned b)
+{
+	unsigned ta = snap->type[a], tb = snap->type[b];
+
+	if (ta == tb)
+		return 0;
+	if (ta == KEY_SNAPSHOT_NO_TYPE || tb == KEY_SNAPSHOT_NO_TYPE)
+		return SNAP_CMP(ta, tb);
+	return strcmp(snap->types[ta].name, snap->types[tb].name);
+}
+
+static int snap_cmp_uid(const struct keyctl_snapshot *snap,
+			unsigned a, unsigned b)
+{
+	return SNAP_CMP(snap->uid[a], snap->uid[b]);
+}
+
+static int snap_cmp_gid(const struct keyctl_snapshot *snap,
+			unsigned a, unsigned b)
+{
+	return SNAP_CMP(snap->gid[a], snap->gid[b]);
+}
+
+static int snap_cmp_perm(const struct keyctl_snapshot *snap,
+			 unsigned a, unsigned b)
+{
+	return SNAP_CMP(snap->perm[a], snap->perm[b]);
+}
+
+static int snap_cmp_timeout(const struct keyctl_snapshot *snap,
+			    unsigned a, unsigned b)
+{
+	return SNAP_CMP(snap->timeout[a], snap->timeout[b]);
+}
+
+static int snap_cmp_desc(const struct keyctl_snapshot *snap,
+			 unsigned a, unsigned b)
+{
+	return strcmp(snap->desc_heap + snap->desc_off[a],
+		      snap->desc_heap + snap->desc_off[b]);
+}
+
+static const snap_cmp_t snap_cmps[] = {
+	[KEY_SNAPSHOT_BY_SERIAL]	= snap_cmp_serial,
+	[KEY_SNAPSHOT_BY_TYPE]		= snap_cmp_type,
+	[KEY_SNAPSHOT_BY_UID]		= snap_cmp_uid,
+	[KEY_SNAPSHOT_BY_GID]		= snap_cmp_gid,
+	[KEY_SNAPSHOT_BY_PERM]		= snap_cmp_perm,
+	[KEY_SNAPSHOT_BY_TIMEOUT]	= snap_cmp_timeout,
+	[KEY_SNAPSHOT_BY_DESC]		= snap_cmp_desc,
+};
+
+/*
+ * fill in the timeouts of the keys that /proc/keys shows us
+ */
+static int snap_proc_key(const struct keyctl_proc_key *key, void *data)
+{
+	struct keyctl_snapshot *snap = data;
+	int32_t timeout;
+	unsigned i;
+
+	timeout = key->timeout > INT32_MAX ? INT32_MAX : key->timeout;
+	for (i = snap_lower_bound(snap, key->serial);
+	     i < snap->nr && snap->serial[snap->by_serial[i]] == key->serial;
+	     i++)
+		snap->timeout[snap->by_serial[i]] = timeout;
+	return 0;
+}
+
+/*
+ * Capture a keyring tree into a columnar snapshot
+ * - special keyring IDs are resolved first
+ * - KEY_SCAN_REVISIT may be given to expand a keyring under every link to it
+ * - keys that can't be described are included with no type
+ */
+struct keyctl_snapshot *keyctl_snapshot_tree(key_serial_t keyring,
+					     unsigned flags)
+{
+	struct keyctl_snapshot *snap;
+	struct snap_build b;
+	int kcount;
+
+	if (flags & ~KEY_SCAN_REVISIT) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	if (keyring < 0) {
+		keyring = keyctl_get_keyring_ID_cached(keyring, 0);
+		if (keyring < 0)
+			return NULL;
+	}
+
+	snap = kalloc(sizeof(*snap));
+	if (!snap)
+		return NULL;
+	memset(snap, 0, sizeof(*snap));
+	memset(&b, 0, sizeof(b));
+	b.snap = snap;
+
+	if (snap_resize(&b, 64) < 0)
+		goto error;
+	snap->desc_off[0] = 0;
+
+	if (key_scan_tree(keyring, flags, snap_enter, snap_leave, &b,
+			  &kcount) < 0 && !b.error)
+		b.error = errno;
+	kfree(b.stack);
+	if (b.error) {
+		errno = b.error;
+		goto error;
+	}
+
+	/* give back the room we didn't use */
+	if (snap_resize(&b, snap->nr ?: 1) < 0)
+		goto error;
+	if (b.heap_used < b.heap_cap) {
+		char *heap = kalloc(b.heap_used);
+
+		if (!heap)
+			goto error;
+		memcpy(heap, snap->desc_heap, b.heap_used);
+		kfree(snap->desc_heap);
+		snap->desc_heap = heap;
+	}
+
+	snap->by_serial = kalloc((snap->nr ?: 1) * sizeof(*snap->by_serial));
+	if (!snap->by_serial ||
+	    snap_sort(snap, snap_cmp_serial, snap->by_serial) < 0)
+		goto error;
+
+	/* the timeouts can only be had from /proc/keys, if it's there */
+	keyctl_proc_keys_iterate(snap_proc_key, snap);
+	return snap;
+
+error:
+	keyctl_snapshot_free(snap);
+	return NULL;
+}
+
+/*
+ * release a snapshot
+ */
+void keyctl_snapshot_free(struct keyctl_snapshot *snap)
+{
+	unsigned i;
+	int err = errno;
+
+	if (!snap)
+		return;
+	for (i = 0; i < snap->nr_types; i++)
+		kfree((char *)snap->types[i].name);
+	kfree(snap->types);
+	kfree(snap->serial);
+	kfree(snap->parent);
+	kfree(snap->next);
+	kfree(snap->type);
+	kfree(snap->uid);
+	kfree(snap->gid);
+	kfree(snap->perm);
+	kfree(snap->timeout);
+	kfree(snap->desc_off);
+	kfree(snap->desc_heap);
+	kfree(snap->by_serial);
+	kfree(snap);
+	errno = err;
+}
+
+/*
+ * get an entry's description
+ */
+const char *keyctl_snapshot_desc(const struct keyctl_snapshot *snap, unsigned i)
+{
+	return snap->desc_heap + snap->desc_off[i];
+}
+
+/*
+ * find the first entry, in tree order, for a key
+ */
+unsigned keyctl_snapshot_find(const struct keyctl_snapshot *snap,
+			      key_serial_t serial)
+{
+	unsigned i = snap_lower_bound(snap, serial);
+
+	if (i < snap->nr && snap->serial[snap->by_serial[i]] == serial)
+		return snap->by_serial[i];
+	return KEY_SNAPSHOT_NONE;
+}
+
+/*
+ * step through the entries for the contents of a keyring
+ */
+unsigned keyctl_snapshot_first_child(const struct keyctl_snapshot *snap,
+				     unsigned i)
+{
+	return i + 1 < snap->next[i] ? i + 1 : KEY_SNAPSHOT_NONE;
+}
+
+unsigned keyctl_snapshot_next_sibling(const struct keyctl_snapshot *snap,
+				      unsigned i)
+{
+	unsigned p = snap->parent[i];
+
+	if (p == KEY_SNAPSHOT_NONE || snap->next[i] >= snap->next[p])
+		return KEY_SNAPSHOT_NONE;
+	return snap->next[i];
+}
+
+/*
+ * get the order of the entries sorted on one of the columns
+ * - entries that compare the same are left in tree order
+ */
+int keyctl_snapshot_sort(const struct keyctl_snapshot *snap,
+			 enum keyctl_snapshot_order by, unsigned *order)
+{
+	if ((unsigned)by >= sizeof(snap_cmps) / sizeof(snap_cmps[0]) ||
+	    (snap->nr && !order)) {
+		errno = EINVAL;
+		return -1;
+	}
+	return snap_sort(snap, snap_cmps[by], order);
 }
 
 #ifdef NO_GLIBC_KEYERR
@@ -154,18 +154,308 @@ extern long keyctl_instantiate_iov(key_serial_t id,
 extern long keyctl_invalidate(key_serial_t id);
 extern long keyctl_get_persistent(uid_t uid, key_serial_t id);
 
+/*
+ * memory allocation hooks
+ */
+struct keyutils_allocator {
+	void	*(*alloc)(size_t size, void *data);
+	void	(*free)(void *p, void *data);
+	void	*data;
+};
+
+extern void keyutils_set_allocator(const struct keyutils_allocator *allocator);
+extern void keyutils_free(void *p);
+
+/*
+ * syscall statistics
+ * - ops 0 to KEYUTILS_STATS_NR_KEYCTL-1 are the keyctl commands of that number
+ * - latency bucket n counts calls that took [2^n, 2^(n+1)) ns, with the last
+ *   bucket also counting anything longer
+ */
+#define KEYUTILS_STATS_NR_KEYCTL	32
+#define KEYUTILS_STATS_KEYCTL_OTHER	32	/* higher keyctl commands */
+#define KEYUTILS_STATS_ADD_KEY		33
+#define KEYUTILS_STATS_REQUEST_KEY	34
+#define KEYUTILS_STATS_NR_OPS		35
+#define KEYUTILS_STATS_NR_BUCKETS	32
+
+struct keyutils_op_stats {
+	uint64_t	calls;
+	uint64_t	errors;
+	uint64_t	total_ns;
+	uint64_t	latency[KEYUTILS_STATS_NR_BUCKETS];
+};
+
+struct keyutils_stats {
+	struct keyutils_op_stats ops[KEYUTILS_STATS_NR_OPS];
+};
+
+extern int keyutils_stats_enable(int enable);
+extern int keyutils_stats_snapshot(struct keyutils_stats *stats);
+extern void keyutils_stats_reset(void);
+
+/*
+ * negative lookup cache for request_key() and keyctl_search()
+ */
+extern unsigned keyutils_negative_cache_enable(unsigned ttl);
+extern void keyutils_negative_cache_flush(void);
+
+/*
+ * cached resolution of the special keyring IDs
+ */
+extern key_serial_t keyctl_get_keyring_ID_cached(key_serial_t id, int create);
+extern void keyutils_keyring_ID_cache_flush(void);
+
+/*
+ * kernel feature probing
+ */
+#define KEYCTL_FEATURE(cmd)	(1ULL << (cmd))
+#define KEYCTL_FEATURES_ALL	(~0ULL)
+
+extern uint64_t keyutils_probe_features(uint64_t which);
+
+/*
+ * locked memory pool for key material
+ */
+extern const struct keyutils_allocator keyutils_secure_allocator;
+
+extern int keyutils_secure_pool_init(size_t size);
+extern void *keyutils_secure_alloc(size_t size);
+extern void keyutils_secure_free(void *p);
+
 /*
  * utilities
  */
 extern int keyctl_describe_alloc(key_serial_t id, char **_buffer);
 extern int keyctl_read_alloc(key_serial_t id, void **_buffer);
 extern int keyctl_get_security_alloc(key_serial_t id, char **_buffer);
+extern int keyctl_describe_reuse(key_serial_t id, char **_buffer, size_t *_buflen);
+extern int keyctl_read_reuse(key_serial_t id, void **_buffer, size_t *_buflen);
+extern int keyctl_get_security_reuse(key_serial_t id, char **_buffer,
+				     size_t *_buflen);
+extern int keyctl_read_secure(key_serial_t id, void **_buffer);
+extern key_serial_t add_key_from_fd(const char *type, const char *description,
+				    int fd, key_serial_t ringid);
+extern long keyctl_update_from_fd(key_serial_t id, int fd);
+extern long keyctl_instantiate_from_fd(key_serial_t id, int fd,
+				       key_serial_t ringid);
+
+/* keyctl_read_to_fd() flags */
+#define KEY_READ_SECURE		0x0001	/* read through the locked pool */
+
+extern long keyctl_read_to_fd(key_serial_t id, int fd, unsigned flags);
+
+/*
+ * parsed key description
+ */
+enum key_type_id {
+	KEY_TYPE_OTHER,			/* not one of the following */
+	KEY_TYPE_KEYRING,
+	KEY_TYPE_USER,
+	KEY_TYPE_LOGON,
+	KEY_TYPE_BIG_KEY,
+	KEY_TYPE_ASYMMETRIC,
+	KEY_TYPE_DNS_RESOLVER,
+	KEY_TYPE_ENCRYPTED,
+	KEY_TYPE_TRUSTED,
+	KEY_TYPE_REQUEST_KEY_AUTH,
+};
+
+struct keyctl_key_desc {
+	enum key_type_id type_id;
+	const char	*type;		/* type name in buffer (not NUL terminated) */
+	int		type_len;
+	uid_t		uid;
+	gid_t		gid;
+	key_perm_t	perm;
+	const char	*desc;		/* description in buffer */
+	int		desc_len;
+};
+
+extern int keyctl_parse_description(const char *buffer, size_t buflen,
+				    struct keyctl_key_desc *parsed);
+extern int keyctl_describe_parsed(key_serial_t id, char **_buffer, size_t *_buflen,
+				  struct keyctl_key_desc *parsed);
+
+/*
+ * batch fetch result
+ */
+struct keyctl_batch_result {
+	void	*data;		/* result in the arena or NULL */
+	int	len;		/* length of result or arena space needed */
+	int	error;		/* error from fetching result or 0 */
+};
+
+extern int keyctl_describe_many(const key_serial_t *ids, unsigned nr,
+				struct keyctl_batch_result *results,
+				void *arena, size_t arena_size);
+extern int keyctl_read_many(const key_serial_t *ids, unsigned nr,
+			    struct keyctl_batch_result *results,
+			    void *arena, size_t arena_size);
+
+/*
+ * batch operations with per-key errors
+ */
+extern int keyctl_link_many(const key_serial_t *ids, unsigned nr,
+			    key_serial_t ringid, int *errors,
+			    unsigned nr_threads);
+extern int keyctl_unlink_many(const key_serial_t *ids, unsigned nr,
+			      key_serial_t ringid, int *errors,
+			      unsigned nr_threads);
+extern int keyctl_revoke_many(const key_serial_t *ids, unsigned nr,
+			      int *errors, unsigned nr_threads);
+extern int keyctl_invalidate_many(const key_serial_t *ids, unsigned nr,
+				  int *errors, unsigned nr_threads);
 
 typedef int (*recursive_key_scanner_t)(key_serial_t parent, key_serial_t key,
 				       char *desc, int desc_len, void *data);
 extern int recursive_key_scan(key_serial_t key, recursive_key_scanner_t func, void *data);
 extern int recursive_session_key_scan(recursive_key_scanner_t func, void *data);
+
+/* keyctl_scan_tree() flags */
+#define KEY_SCAN_REVISIT	0x0001	/* expand a keyring once per path to it */
+#define KEY_SCAN_ORDERED	0x0002	/* parallel scan delivers in tree order */
+
+extern int keyctl_scan_tree(key_serial_t key, unsigned flags,
+			    recursive_key_scanner_t func, void *data);
+/* keyctl_scan_tree_filter() filter results */
+#define KEY_SCAN_CONTINUE	0	/* carry on, expanding the key if a keyring */
+#define KEY_SCAN_SKIP_SUBTREE	1	/* don't look inside this keyring */
+#define KEY_SCAN_STOP		2	/* abandon the scan */
+
+typedef int (*key_scan_filter_t)(key_serial_t parent, key_serial_t key,
+				 const char *desc, int desc_len, void *data);
+extern int keyctl_scan_tree_filter(key_serial_t key, unsigned flags,
+				   key_scan_filter_t filter,
+				   recursive_key_scanner_t func, void *data);
+extern int keyctl_scan_tree_parallel(key_serial_t key, unsigned flags,
+				     unsigned nr_threads,
+				     recursive_key_scanner_t func, void *data);
+/*
+ * /proc/keys iteration
+ */
+#define KEY_PROC_INSTANTIATED		0x0001	/* I - key is instantiated */
+#define KEY_PROC_REVOKED		0x0002	/* R - key has been revoked */
+#define KEY_PROC_DEAD			0x0004	/* D - key type has gone away */
+#define KEY_PROC_IN_QUOTA		0x0008	/* Q - key counts against quota */
+#define KEY_PROC_UNDER_CONSTRUCTION	0x0010	/* U - key is being constructed */
+#define KEY_PROC_NEGATIVE		0x0020	/* N - key is negatively instantiated */
+#define KEY_PROC_INVALIDATED		0x0040	/* i - key has been invalidated */
+
+struct keyctl_proc_key {
+	key_serial_t	serial;
+	unsigned	flags;		/* KEY_PROC_* */
+	int		usage;
+	long		timeout;	/* seconds remaining, -1 if none, 0 if expired */
+	key_perm_t	perm;
+	uid_t		uid;
+	gid_t		gid;
+	const char	*type;		/* NUL-terminated; may be truncated */
+	size_t		type_len;
+	const char	*desc;		/* NUL-terminated; includes type's summary */
+	size_t		desc_len;
+};
+
+typedef int (*keyctl_proc_keys_iterator_t)(const struct keyctl_proc_key *key,
+					   void *data);
+extern int keyctl_proc_keys_iterate(keyctl_proc_keys_iterator_t func, void *data);
+
 extern key_serial_t find_key_by_type_and_desc(const char *type, const char *desc,
 					      key_serial_t destringid);
 
+/*
+ * index for repeated find_key_by_type_and_desc() lookups
+ */
+#define KEY_INDEX_NO_MISS_REBUILD	0x0001	/* only rebuild when too old */
+
+struct keyctl_key_index;
+
+extern struct keyctl_key_index *keyctl_key_index_create(unsigned max_age,
+							unsigned flags);
+extern key_serial_t keyctl_key_index_find(struct keyctl_key_index *index,
+					  const char *type, const char *desc,
+					  key_serial_t destringid);
+extern void keyctl_key_index_destroy(struct keyctl_key_index *index);
+
+/*
+ * request_key() shared between concurrent callers in a process
+ */
+extern key_serial_t keyctl_request_shared(const char *type,
+					  const char *description,
+					  const char *callout_info,
+					  key_serial_t destringid);
+
+/*
+ * asynchronous key requests
+ */
+struct keyctl_async;
+
+typedef void (*keyctl_async_func_t)(key_serial_t key, int error, void *data);
+
+extern struct keyctl_async *keyctl_async_create(unsigned nr_threads,
+						unsigned max_queued);
+extern int keyctl_async_fd(struct keyctl_async *async);
+extern long keyctl_request_async(struct keyctl_async *async,
+				 const char *type, const char *description,
+				 const char *callout_info, key_serial_t destringid,
+				 keyctl_async_func_t func, void *data);
+extern int keyctl_async_cancel(struct keyctl_async *async, long id);
+extern int keyctl_async_dispatch(struct keyctl_async *async);
+extern void keyctl_async_destroy(struct keyctl_async *async);
+
+/*
+ * columnar snapshot of a keyring tree
+ */
+#define KEY_SNAPSHOT_NONE		(~0U)	/* no such entry */
+#define KEY_SNAPSHOT_NO_TYPE		0xffff	/* key couldn't be described */
+#define KEY_SNAPSHOT_NO_TIMEOUT		(-1)	/* key doesn't expire */
+#define KEY_SNAPSHOT_TIMEOUT_UNKNOWN	(-2)	/* key not in /proc/keys */
+
+struct keyctl_snapshot_type {
+	const char	*name;
+	enum key_type_id type_id;
+};
+
+struct keyctl_snapshot {
+	unsigned	nr;		/* number of entries, in tree order */
+	key_serial_t	*serial;
+	unsigned	*parent;	/* index of parent entry or KEY_SNAPSHOT_NONE */
+	unsigned	*next;		/* index of first entry after the subtree */
+	uint16_t	*type;		/* index into types[] or KEY_SNAPSHOT_NO_TYPE */
+	uid_t		*uid;
+	gid_t		*gid;
+	key_perm_t	*perm;
+	int32_t		*timeout;	/* seconds remaining, 0 if expired; rounded
+					 * down to the unit /proc/keys shows */
+	uint32_t	*desc_off;	/* nr + 1 offsets into desc_heap */
+	char		*desc_heap;	/* NUL-terminated descriptions */
+	unsigned	nr_types;
+	struct keyctl_snapshot_type *types;
+	unsigned	*by_serial;	/* entry indices sorted by serial */
+};
+
+enum keyctl_snapshot_order {
+	KEY_SNAPSHOT_BY_SERIAL,
+	KEY_SNAPSHOT_BY_TYPE,
+	KEY_SNAPSHOT_BY_UID,
+	KEY_SNAPSHOT_BY_GID,
+	KEY_SNAPSHOT_BY_PERM,
+	KEY_SNAPSHOT_BY_TIMEOUT,
+	KEY_SNAPSHOT_BY_DESC,
+};
+
+extern struct keyctl_snapshot *keyctl_snapshot_tree(key_serial_t keyring,
+						    unsigned flags);
+extern void keyctl_snapshot_free(struct keyctl_snapshot *snap);
+extern const char *keyctl_snapshot_desc(const struct keyctl_snapshot *snap,
+					unsigned i);
+extern unsigned keyctl_snapshot_find(const struct keyctl_snapshot *snap,
+				     key_serial_t serial);
+extern unsigned keyctl_snapshot_first_child(const struct keyctl_snapshot *snap,
+					    unsigned i);
+extern unsigned keyctl_snapshot_next_sibling(const struct keyctl_snapshot *snap,
+					     unsigned i);
+extern int keyctl_snapshot_sort(const struct keyctl_snapshot *snap,
+				enum keyctl_snapshot_order by, unsigned *order);
+
 #endif /* KEYUTILS_H */
@@ -130,9 +130,10 @@ static void oops(int x)
  */
 int main(int argc, char *argv[])
 {
+	struct keyctl_key_desc parsed;
 	key_serial_t key;
 	char *ktype, *kdesc, *buf, *callout_info;
-	int ret, ntype, dpos, n, fd;
+	int ret, fd;
 
 	if (argc == 2 && strcmp(argv[1], "--version") == 0) {
 		printf("request-key from %s (Built %s)\n",
@@ -205,16 +206,12 @@ int main(int argc, char *argv[])
 
 	/* extract the type and description from the key */
 	debug("Key descriptor: \"%s\"\n", buf);
-	ntype = -1;
-	dpos = -1;
-
-	n = sscanf(buf, "%*[^;]%n;%*d;%*d;%x;%n", &ntype, &n, &dpos);
-	if (n != 1)
+	if (keyctl_parse_description(buf, strlen(buf), &parsed) < 0)
 		error("Failed to parse key description\n");
 
 	ktype = buf;
-	ktype[ntype] = 0;
-	kdesc = buf + dpos;
+	ktype[parsed.type_len] = 0;
+	kdesc = (char *)parsed.desc;
 
 	debug("Key type: %s\n", ktype);
 	debug("Key desc: %s\n", kdesc);
@@ -0,0 +1,57 @@
+#!/bin/bash
+
+. ../../../prepare.inc.sh
+. ../../../toolbox.inc.sh
+
+
+# ---- do the actual testing ----
+
+result=PASS
+echo "++++ BEGINNING TEST" >$OUTPUTFILE
+
+# create a keyring and attach it to the session keyring
+marker "ADD KEYRING"
+create_keyring wibble @s
+expect_keyid keyringid
+
+# stick a pair of keys in the keyring
+marker "ADD KEYS"
+create_key user lizard gizzard $keyringid
+expect_keyid keyid
+create_key user snake skin $keyringid
+expect_keyid keyid2
+
+# describe everything into an arena big enough to hold it all
+marker "DESCRIBE ALL"
+libkeyctl describe_many 1024 $keyid $keyid2 $keyringid
+expect_payload payload "lizard snake wibble"
+
+# with no arena, nothing fits
+marker "DESCRIBE INTO NO ARENA"
+libkeyctl describe_many 0 $keyid $keyringid
+expect_payload payload "ENOBUFS ENOBUFS"
+
+# with an arena just big enough for the first key, the rest don't fit
+marker "DESCRIBE INTO SMALL ARENA"
+desc=`keyctl rdescribe $keyid`
+libkeyctl describe_many $((${#desc} + 1)) $keyid $keyid2 $keyringid
+expect_payload payload "lizard ENOBUFS ENOBUFS"
+
+# but a key that doesn't fit doesn't stop a smaller one after it
+libkeyctl describe_many $((${#desc} + 1)) $keyringid $keyid
+expect_payload payload "ENOBUFS lizard"
+
+# keys that can't be described get their own error without stopping the batch
+marker "DESCRIBE REVOKED KEY"
+revoke_key $keyid2
+libkeyctl describe_many 1024 $keyid2 $keyid
+expect_payload payload "EKEYREVOKED lizard"
+
+# remove the keyring we added
+marker "UNLINK KEYRING"
+unlink_key $keyringid @s
+
+echo "++++ FINISHED TEST: $result" >>$OUTPUTFILE
+
+# --- then report the results in the database ---
+toolbox_report_result $TEST $result
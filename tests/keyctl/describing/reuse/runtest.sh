@@ -0,0 +1,37 @@
+#!/bin/bash
+
+. ../../../prepare.inc.sh
+. ../../../toolbox.inc.sh
+
+
+# ---- do the actual testing ----
+
+result=PASS
+echo "++++ BEGINNING TEST" >$OUTPUTFILE
+
+# create a keyring and attach it to the session keyring
+marker "ADD KEYRING"
+create_keyring wibble @s
+expect_keyid keyringid
+
+# add keys with a short and a long description
+marker "ADD KEYS"
+create_key user lizard gizzard $keyringid
+expect_keyid keyid
+longdesc=`for ((i=0; i<1000; i++)); do echo -n a; done`
+create_key user $longdesc gizzard $keyringid
+expect_keyid longid
+
+# describe them through the same buffer, making it grow and then be reused
+marker "DESCRIBE SHORT THEN LONG"
+libkeyctl describe_reuse $keyid $longid $keyid $keyringid $longid
+expect_payload payload "6 1000 6 6 1000"
+
+# remove the keyring we added
+marker "UNLINK KEYRING"
+unlink_key $keyringid @s
+
+echo "++++ FINISHED TEST: $result" >>$OUTPUTFILE
+
+# --- then report the results in the database ---
+toolbox_report_result $TEST $result
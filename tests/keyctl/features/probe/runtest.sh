@@ -0,0 +1,22 @@
+#!/bin/bash
+
+. ../../../prepare.inc.sh
+. ../../../toolbox.inc.sh
+
+
+# ---- do the actual testing ----
+
+result=PASS
+echo "++++ BEGINNING TEST" >$OUTPUTFILE
+
+# probe the kernel's keyctl commands, checking that what was learnt from
+# calling a command is used, that the answers are kept and that they agree
+# with what the commands themselves do
+marker "PROBE FEATURES"
+libkeyctl features
+expect_payload payload "learnt preserved basic consistent cached"
+
+echo "++++ FINISHED TEST: $result" >>$OUTPUTFILE
+
+# --- then report the results in the database ---
+toolbox_report_result $TEST $result
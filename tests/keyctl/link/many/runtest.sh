@@ -0,0 +1,83 @@
+#!/bin/bash
+
+. ../../../prepare.inc.sh
+. ../../../toolbox.inc.sh
+
+
+# ---- do the actual testing ----
+
+result=PASS
+echo "++++ BEGINNING TEST" >$OUTPUTFILE
+
+# create a pair of keyrings and attach them to the session keyring
+marker "ADD KEYRINGS"
+create_keyring wibble @s
+expect_keyid keyringid
+create_keyring wobble @s
+expect_keyid keyring2id
+
+# add a few keys to the first
+marker "ADD KEYS"
+create_key user lizard gizzard $keyringid
+expect_keyid keyid
+create_key user snake venomous $keyringid
+expect_keyid keyid2
+create_key user toad warty $keyringid
+expect_keyid keyid3
+
+# link them into the second in one call, with a missing key amongst them
+marker "LINK BATCH"
+libkeyctl batch link 1 $keyring2id $keyid $keyid2 999999999 $keyid3
+expect_payload payload "3 ok ok ENOKEY ok"
+
+# unlink them, and then find they're no longer there
+marker "UNLINK BATCH"
+libkeyctl batch unlink 1 $keyring2id $keyid $keyid2 $keyid3
+expect_payload payload "3 ok ok ok"
+libkeyctl batch unlink 1 $keyring2id $keyid $keyid2 $keyid3
+expect_payload payload "0 ENOENT ENOENT ENOENT"
+
+# add enough keys to spread the work over several threads, and check that
+# each result still lines up with its key
+marker "LINK BATCH OVER THREADS"
+ids=
+expected=
+for ((i=0; i<100; i++))
+  do
+  create_key user key$i payload $keyringid
+  expect_keyid id
+  if [ $i = 50 ]
+  then
+      ids="$ids 999999999"
+      expected="$expected ENOKEY"
+  fi
+  ids="$ids $id"
+  expected="$expected ok"
+done
+libkeyctl batch link 4 $keyring2id $ids
+expect_payload payload "100$expected"
+libkeyctl batch unlink 4 $keyring2id $ids
+expect_payload payload "100$expected"
+
+# revoke and invalidate some keys, and then find they've gone
+marker "REVOKE BATCH"
+libkeyctl batch revoke 2 $keyid $keyid2
+expect_payload payload "2 ok ok"
+libkeyctl batch revoke 2 $keyid $keyid2
+expect_payload payload "0 EKEYREVOKED EKEYREVOKED"
+
+marker "INVALIDATE BATCH"
+libkeyctl batch invalidate 1 $keyid3 999999999
+expect_payload payload "1 ok ENOKEY"
+libkeyctl batch invalidate 1 $keyid3
+expect_payload payload "0 ENOKEY"
+
+# remove the keyrings we added
+marker "UNLINK KEYRINGS"
+unlink_key $keyringid @s
+unlink_key $keyring2id @s
+
+echo "++++ FINISHED TEST: $result" >>$OUTPUTFILE
+
+# --- then report the results in the database ---
+toolbox_report_result $TEST $result
@@ -0,0 +1,66 @@
+#!/bin/bash
+
+. ../../../prepare.inc.sh
+. ../../../toolbox.inc.sh
+
+
+# ---- do the actual testing ----
+
+result=PASS
+echo "++++ BEGINNING TEST" >$OUTPUTFILE
+
+# create a keyring and attach it to the session keyring
+marker "ADD KEYRING"
+create_keyring wibble @s
+expect_keyid keyringid
+
+# stick a key in the keyring
+marker "ADD KEY"
+create_key user lizard gizzard $keyringid
+expect_keyid keyid
+
+# check the parsed forms of the lines for the key and the keyring
+marker "PARSE KEY"
+libkeyctl proc_key $keyid
+expect_payload payload "I--Q--- user 3f010000 -1 lizard: 7"
+marker "PARSE KEYRING"
+libkeyctl proc_key $keyringid
+expect_payload payload "I--Q--- keyring 3f010000 -1 wibble: 1"
+
+# the kernel gives the expiry time to the largest whole unit, though the fake
+# keyring gives it to the second
+marker "PARSE TIMEOUT"
+timeout_key $keyid 7300
+libkeyctl proc_key $keyid
+expect_payload payload
+if ! expr "$payload" : "I--Q--- user 3f010000 7[23][0-9][0-9] lizard: 7$" >&/dev/null
+then
+    failed
+fi
+
+# changes to the key should show up
+# - what a revoked key's timeout and summary say depends on the kernel
+marker "PARSE REVOKED"
+set_key_perm $keyid 0x3d010000
+revoke_key $keyid
+libkeyctl proc_key $keyid
+expect_payload payload
+if ! expr "$payload" : "IR-Q--- user 3d010000 [-0-9]* lizard" >&/dev/null
+then
+    failed
+fi
+
+# an error from the iterator function should be passed back along with its
+# errno
+marker "ITERATOR ERROR"
+libkeyctl proc_keys_error
+expect_payload payload "-1 EDOM"
+
+# remove the keyring we added
+marker "UNLINK KEYRING"
+unlink_key $keyringid @s
+
+echo "++++ FINISHED TEST: $result" >>$OUTPUTFILE
+
+# --- then report the results in the database ---
+toolbox_report_result $TEST $result
@@ -0,0 +1,87 @@
+#!/bin/bash
+
+. ../../../prepare.inc.sh
+. ../../../toolbox.inc.sh
+
+
+# ---- do the actual testing ----
+
+result=PASS
+echo "++++ BEGINNING TEST" >$OUTPUTFILE
+
+# build a tree in which keyring "s" can be reached by two paths
+marker "BUILD TREE"
+create_keyring top @s
+expect_keyid topid
+create_keyring a $topid
+expect_keyid aid
+create_keyring b $topid
+expect_keyid bid
+create_keyring s $aid
+expect_keyid sid
+link_key $sid $bid
+create_key user k gizzard $sid
+expect_keyid keyid
+
+# the shared keyring should be reported under both parents, but only
+# expanded once
+marker "SCAN TREE"
+libkeyctl scan_tree $topid
+expect_payload payload "a b k s s top"
+
+# unless every path is to be followed
+marker "SCAN TREE REVISITING"
+libkeyctl scan_tree -r $topid
+expect_payload payload "a b k k s s top"
+
+# the parallel scan should find the same links
+marker "PARALLEL SCAN TREE"
+libkeyctl scan_tree -p 4 $topid
+expect_payload payload "a b k s s top"
+libkeyctl scan_tree -r -p 4 $topid
+expect_payload payload "a b k k s s top"
+
+# an ordered parallel scan should report the links in the same order as the
+# serial scan, with the shared keyring's contents under the first path to it
+marker "PARALLEL SCAN TREE IN ORDER"
+libkeyctl scan_tree -o $topid
+expect_payload payload "k s a s b top"
+libkeyctl scan_tree -o -p 4 $topid
+expect_payload payload "k s a s b top"
+
+# the kernel won't let a keyring be linked below itself, so the tree can't
+# be made into a cycle
+marker "CHECK NO CYCLE"
+link_key --fail $topid $sid
+expect_error EDEADLK
+libkeyctl scan_tree $topid
+expect_payload payload "a b k s s top"
+
+# running out of memory part way through must fail the scan rather than
+# quietly leave out part of the tree
+marker "SCAN TREE WITHOUT MEMORY"
+for allocs in 0 1 2 3 4 5 6
+do
+    libkeyctl scan_tree -m $allocs $topid
+    expect_payload payload "ENOMEM"
+    libkeyctl scan_tree -p 4 -m $allocs $topid
+    expect_payload payload "ENOMEM"
+    libkeyctl scan_tree -o -p 4 -m $allocs $topid
+    expect_payload payload "ENOMEM"
+done
+libkeyctl scan_tree -m 1000 $topid
+expect_payload payload "a b k s s top"
+
+# a key rather than a keyring is just reported
+marker "SCAN KEY"
+libkeyctl scan_tree $keyid
+expect_payload payload "k"
+
+# remove the tree we added
+marker "UNLINK TREE"
+unlink_key $topid @s
+
+echo "++++ FINISHED TEST: $result" >>$OUTPUTFILE
+
+# --- then report the results in the database ---
+toolbox_report_result $TEST $result
@@ -0,0 +1,41 @@
+#!/bin/bash
+
+. ../../../prepare.inc.sh
+. ../../../toolbox.inc.sh
+
+
+# ---- do the actual testing ----
+
+result=PASS
+echo "++++ BEGINNING TEST" >$OUTPUTFILE
+
+# create a keyring and attach it to the session keyring
+marker "ADD KEYRING"
+create_keyring wibble @s
+expect_keyid keyringid
+
+# add a key to it
+marker "ADD KEY"
+create_key user lizard gizzard $keyringid
+expect_keyid keyid
+
+# describe and read it through the application's allocator
+marker "ALLOCATE FROM HOOKS"
+libkeyctl alloc 10 $keyid
+expect_payload payload "lizard gizzard balanced"
+
+# make the allocator refuse, without it setting errno
+marker "ALLOCATOR FAILS"
+libkeyctl alloc 1 $keyid
+expect_payload payload "lizard ENOMEM balanced"
+libkeyctl alloc 0 $keyid
+expect_payload payload "ENOMEM ENOMEM balanced"
+
+# remove the keyring we added
+marker "UNLINK KEYRING"
+unlink_key $keyringid @s
+
+echo "++++ FINISHED TEST: $result" >>$OUTPUTFILE
+
+# --- then report the results in the database ---
+toolbox_report_result $TEST $result
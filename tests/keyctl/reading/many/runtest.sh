@@ -0,0 +1,57 @@
+#!/bin/bash
+
+. ../../../prepare.inc.sh
+. ../../../toolbox.inc.sh
+
+
+# ---- do the actual testing ----
+
+result=PASS
+echo "++++ BEGINNING TEST" >$OUTPUTFILE
+
+# create a keyring and attach it to the session keyring
+marker "ADD KEYRING"
+create_keyring wibble @s
+expect_keyid keyringid
+
+# stick a pair of keys in the keyring
+marker "ADD KEYS"
+create_key user lizard gizzard $keyringid
+expect_keyid keyid
+create_key user snake skin $keyringid
+expect_keyid keyid2
+
+# read everything into an arena big enough to hold it all
+marker "READ ALL"
+libkeyctl read_many 64 $keyid $keyid2 $keyringid
+expect_payload payload "7 4 8"
+
+# a keyring that doesn't fit should be told how much space it needs, even
+# when the space left isn't a whole number of serials
+marker "READ KEYRING INTO SMALL ARENA"
+libkeyctl read_many 6 $keyringid
+expect_payload payload "9:ENOBUFS"
+libkeyctl read_many 9 $keyringid
+expect_payload payload "8"
+
+# the space left after one key is read is offered to the next
+marker "READ KEY AND KEYRING INTO SMALL ARENA"
+libkeyctl read_many 16 $keyid $keyringid
+expect_payload payload "7 9:ENOBUFS"
+libkeyctl read_many 17 $keyid $keyringid
+expect_payload payload "7 8"
+
+# keys that can't be read get their own error without stopping the batch
+marker "READ REVOKED KEY"
+revoke_key $keyid2
+libkeyctl read_many 64 $keyid2 $keyid
+expect_payload payload "-1:EKEYREVOKED 7"
+
+# remove the keyring we added
+marker "UNLINK KEYRING"
+unlink_key $keyringid @s
+
+echo "++++ FINISHED TEST: $result" >>$OUTPUTFILE
+
+# --- then report the results in the database ---
+toolbox_report_result $TEST $result
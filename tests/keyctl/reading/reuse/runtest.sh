@@ -0,0 +1,43 @@
+#!/bin/bash
+
+. ../../../prepare.inc.sh
+. ../../../toolbox.inc.sh
+
+
+# ---- do the actual testing ----
+
+result=PASS
+echo "++++ BEGINNING TEST" >$OUTPUTFILE
+
+# create a keyring and attach it to the session keyring
+marker "ADD KEYRING"
+create_keyring wibble @s
+expect_keyid keyringid
+
+# stick a pair of keys in the keyring, one with an odd-sized payload
+marker "ADD KEYS"
+create_key user lizard gizzard $keyringid
+expect_keyid keyid
+create_key user snake skin $keyringid
+expect_keyid keyid2
+
+# read the user key and then the keyring through the same buffer
+# - the buffer left behind by the first read isn't a multiple of the serial
+#   size, which keyrings can't be read into
+marker "READ KEY THEN KEYRING"
+libkeyctl read_reuse $keyid $keyringid
+expect_payload payload "7 8"
+
+# and the other way round, making the buffer shrink and then grow again
+marker "READ KEYRING THEN KEYS"
+libkeyctl read_reuse $keyringid $keyid2 $keyid $keyringid
+expect_payload payload "8 4 7 8"
+
+# remove the keyring we added
+marker "UNLINK KEYRING"
+unlink_key $keyringid @s
+
+echo "++++ FINISHED TEST: $result" >>$OUTPUTFILE
+
+# --- then report the results in the database ---
+toolbox_report_result $TEST $result
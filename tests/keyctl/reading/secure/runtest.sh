@@ -0,0 +1,41 @@
+#!/bin/bash
+
+. ../../../prepare.inc.sh
+. ../../../toolbox.inc.sh
+
+
+# ---- do the actual testing ----
+
+result=PASS
+echo "++++ BEGINNING TEST" >$OUTPUTFILE
+
+# create a keyring and attach it to the session keyring
+marker "ADD KEYRING"
+create_keyring wibble @s
+expect_keyid keyringid
+
+# add keys to it
+marker "ADD KEYS"
+create_key user lizard gizzard $keyringid
+expect_keyid keyid
+create_key user snake venomous $keyringid
+expect_keyid keyid2
+
+# read them into the locked pool, checking the buffers are scrubbed on release
+marker "READ SECURE"
+libkeyctl secure $keyid $keyid2 $keyid
+expect_payload payload "gizzard venomous gizzard locked scrubbed"
+
+# read them with the pool as the library's allocator
+marker "READ THROUGH SECURE ALLOCATOR"
+libkeyctl secure -a $keyid $keyid2
+expect_payload payload "gizzard venomous locked scrubbed"
+
+# remove the keyring we added
+marker "UNLINK KEYRING"
+unlink_key $keyringid @s
+
+echo "++++ FINISHED TEST: $result" >>$OUTPUTFILE
+
+# --- then report the results in the database ---
+toolbox_report_result $TEST $result
@@ -0,0 +1,40 @@
+#!/bin/bash
+
+. ../../../prepare.inc.sh
+. ../../../toolbox.inc.sh
+
+
+# ---- do the actual testing ----
+
+result=PASS
+echo "++++ BEGINNING TEST" >$OUTPUTFILE
+
+# create a keyring and attach it to the session keyring
+marker "ADD KEYRING"
+create_keyring wibble @s
+expect_keyid keyringid
+
+marker "ADD KEYS"
+create_key user lizard gizzard $keyringid
+expect_keyid keyid
+create_key user snake skin $keyringid
+expect_keyid keyid2
+
+# the results come back to the right callbacks, and the worker threads don't
+# touch the caller's allocator, which the helper makes abort if they do
+marker "REQUEST KEYS ASYNCHRONOUSLY"
+libkeyctl async 3 user lizard user newt user snake user lizard user lizard
+expect_payload payload "$keyid ENOKEY $keyid2 $keyid $keyid"
+
+marker "REQUEST KEYS WITH ONE THREAD"
+libkeyctl async 1 user snake user newt
+expect_payload payload "$keyid2 ENOKEY"
+
+# remove the keyring we added
+marker "UNLINK KEYRING"
+unlink_key $keyringid @s
+
+echo "++++ FINISHED TEST: $result" >>$OUTPUTFILE
+
+# --- then report the results in the database ---
+toolbox_report_result $TEST $result
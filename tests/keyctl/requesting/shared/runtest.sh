@@ -0,0 +1,46 @@
+#!/bin/bash
+
+. ../../../prepare.inc.sh
+. ../../../toolbox.inc.sh
+
+
+# ---- do the actual testing ----
+
+result=PASS
+echo "++++ BEGINNING TEST" >$OUTPUTFILE
+
+# create a keyring and attach it to the session keyring
+marker "ADD KEYRING"
+create_keyring wibble @s
+expect_keyid keyringid
+
+marker "ADD KEY"
+create_key user lizard gizzard $keyringid
+expect_keyid keyid
+
+# many threads asking at once all get the same answer
+marker "REQUEST SHARED KEY"
+libkeyctl request_shared 16 user lizard
+expect_payload payload "$keyid"
+
+marker "REQUEST SHARED MISSING KEY"
+libkeyctl request_shared 16 user newt
+expect_payload payload "ENOKEY"
+
+# threads that have a key of their own in their thread keyrings must find it
+# rather than share a request with threads that don't
+marker "REQUEST KEY IN THREAD KEYRINGS"
+libkeyctl request_shared -t 16 user newt
+expect_payload payload "ENOKEY T"
+
+libkeyctl request_shared -t 16 user lizard
+expect_payload payload "$keyid T"
+
+# remove the keyring we added
+marker "UNLINK KEYRING"
+unlink_key $keyringid @s
+
+echo "++++ FINISHED TEST: $result" >>$OUTPUTFILE
+
+# --- then report the results in the database ---
+toolbox_report_result $TEST $result
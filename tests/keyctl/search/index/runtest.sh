@@ -0,0 +1,50 @@
+#!/bin/bash
+
+. ../../../prepare.inc.sh
+. ../../../toolbox.inc.sh
+
+
+# ---- do the actual testing ----
+
+result=PASS
+echo "++++ BEGINNING TEST" >$OUTPUTFILE
+
+# create a keyring and attach it to the session keyring
+marker "ADD KEYRING"
+create_keyring wibble @s
+expect_keyid keyringid
+
+# stick a pair of keys in the keyring
+marker "ADD KEYS"
+create_key user lizard gizzard $keyringid
+expect_keyid keyid
+create_key user snake skin $keyringid
+expect_keyid keyid2
+
+# the keys can be found directly, without the index
+marker "FIND KEYS"
+libkeyctl index_find user lizard user snake
+expect_payload payload "$keyid $keyid2"
+
+# make one key unsearchable so that request_key() can't find it and the
+# index has to
+# - the kernel fails the search with EACCES and the fake keyring with ENOKEY
+marker "FIND UNSEARCHABLE KEY"
+set_key_perm $keyid 0x37370000
+search_for_key --fail $keyringid user lizard
+libkeyctl index_find user lizard user snake user lizard
+expect_payload payload "$keyid $keyid2 $keyid"
+
+# keys that don't exist aren't found, before or after a hit
+marker "FIND MISSING KEY"
+libkeyctl index_find user newt user lizard user newt
+expect_payload payload "ENOKEY $keyid ENOKEY"
+
+# remove the keyring we added
+marker "UNLINK KEYRING"
+unlink_key $keyringid @s
+
+echo "++++ FINISHED TEST: $result" >>$OUTPUTFILE
+
+# --- then report the results in the database ---
+toolbox_report_result $TEST $result
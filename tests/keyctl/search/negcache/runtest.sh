@@ -0,0 +1,51 @@
+#!/bin/bash
+
+. ../../../prepare.inc.sh
+. ../../../toolbox.inc.sh
+
+
+# ---- do the actual testing ----
+
+result=PASS
+echo "++++ BEGINNING TEST" >$OUTPUTFILE
+
+# create a keyring to search and a keyring holding a key that isn't yet
+# reachable from it
+marker "ADD KEYRINGS"
+create_keyring wibble @s
+expect_keyid keyringid
+create_keyring inner @s
+expect_keyid innerid
+
+marker "ADD KEY"
+create_key user lizard gizzard $innerid
+expect_keyid keyid
+
+# the search fails and is cached, but linking in the keyring that holds the
+# key must make the next search go to the kernel
+marker "LINK KEYRING"
+libkeyctl neg_cache $keyringid user lizard link $innerid $keyringid
+expect_payload payload "ENOKEY $keyid"
+
+# a keyring that can't be searched hides what it holds until its permissions
+# are changed
+marker "ADD UNSEARCHABLE KEYRING"
+create_keyring inner2 $keyringid
+expect_keyid inner2id
+create_key user snake skin $inner2id
+expect_keyid keyid2
+set_key_perm $inner2id 0x37373737
+
+marker "SETPERM KEYRING"
+libkeyctl neg_cache $keyringid user snake setperm $inner2id 0x3f3f3f3f
+expect_payload payload "ENOKEY $keyid2"
+
+# remove the keyrings we added
+marker "UNLINK KEYRINGS"
+unlink_key $innerid @s
+unlink_key $keyringid @s
+
+echo "++++ FINISHED TEST: $result" >>$OUTPUTFILE
+
+# --- then report the results in the database ---
+toolbox_report_result $TEST $result
@@ -0,0 +1,22 @@
+#!/bin/bash
+
+. ../../../prepare.inc.sh
+. ../../../toolbox.inc.sh
+
+
+# ---- do the actual testing ----
+
+result=PASS
+echo "++++ BEGINNING TEST" >$OUTPUTFILE
+
+# a thread that has cached the ID of its session keyring must not go on
+# being given it after another thread, which has cached nothing itself,
+# revokes that keyring
+marker "REVOKE CACHED KEYRING"
+libkeyctl id_cache
+expect_payload payload "EKEYREVOKED"
+
+echo "++++ FINISHED TEST: $result" >>$OUTPUTFILE
+
+# --- then report the results in the database ---
+toolbox_report_result $TEST $result
@@ -0,0 +1,65 @@
+#!/bin/bash
+
+. ../../../prepare.inc.sh
+. ../../../toolbox.inc.sh
+
+
+# ---- do the actual testing ----
+
+result=PASS
+echo "++++ BEGINNING TEST" >$OUTPUTFILE
+
+# build a tree in which keyring "s" can be reached by two paths
+marker "BUILD TREE"
+create_keyring top @s
+expect_keyid topid
+create_keyring a $topid
+expect_keyid aid
+create_keyring b $topid
+expect_keyid bid
+create_keyring s $aid
+expect_keyid sid
+link_key $sid $bid
+create_key user k gizzard $sid
+expect_keyid keyid
+timeout_key $keyid 7300
+
+# the shared keyring gets an entry under each parent, but its contents are
+# only captured once
+# - the timeout comes from /proc/keys, which the kernel gives to the largest
+#   whole unit and the fake keyring to the second
+marker "SNAPSHOT TREE"
+libkeyctl snapshot $topid
+expect_payload payload
+if ! expr "$payload" : "2 a:keyring:top:-1 b:keyring:top:-1 k:user:s:7[23][0-9][0-9] s:keyring:a:-1 s:keyring:b:-1 top:keyring:-:-1$" >&/dev/null
+then
+    failed
+fi
+
+# unless every path is to be followed
+marker "SNAPSHOT TREE REVISITING"
+libkeyctl snapshot -r $topid
+expect_payload payload
+if ! expr "$payload" : "2 a:keyring:top:-1 b:keyring:top:-1 k:user:s:7[23][0-9][0-9] k:user:s:7[23][0-9][0-9] s:keyring:a:-1 s:keyring:b:-1 top:keyring:-:-1$" >&/dev/null
+then
+    failed
+fi
+
+# a key that can't be viewed is still included, without its details or an
+# entry in /proc/keys
+marker "SNAPSHOT UNVIEWABLE KEY"
+create_keyring c $topid
+expect_keyid cid
+link_key $keyid $cid
+set_key_perm $keyid 0x3e000000
+libkeyctl snapshot $cid
+expect_payload payload "1 :?:c:-2 c:keyring:-:-1"
+
+# remove the tree we added
+marker "UNLINK TREE"
+unlink_key $topid @s
+
+echo "++++ FINISHED TEST: $result" >>$OUTPUTFILE
+
+# --- then report the results in the database ---
+toolbox_report_result $TEST $result
@@ -0,0 +1,1167 @@
+/* libkeyctl.c: drive library functions that keyctl doesn't expose directly
+ *
+ * Copyright (C) 2026 Red Hat, Inc. All Rights Reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version
+ * 2 of the License, or (at your option) any later version.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include "keyutils.h"
+
+struct command {
+	const char	*name;
+	void		(*action)(int argc, char *argv[]);
+	int		min_args;
+	const char	*format;
+};
+
+static void act_read_reuse(int argc, char *argv[]);
+static void act_read_many(int argc, char *argv[]);
+static void act_read_to_fd(int argc, char *argv[]);
+static void act_describe_reuse(int argc, char *argv[]);
+static void act_describe_many(int argc, char *argv[]);
+static void act_alloc(int argc, char *argv[]);
+static void act_secure(int argc, char *argv[]);
+static void act_scan_tree(int argc, char *argv[]);
+static void act_proc_key(int argc, char *argv[]);
+static void act_proc_keys_error(int argc, char *argv[]);
+static void act_index_find(int argc, char *argv[]);
+static void act_snapshot(int argc, char *argv[]);
+static void act_neg_cache(int argc, char *argv[]);
+static void act_request_shared(int argc, char *argv[]);
+static void act_async(int argc, char *argv[]);
+static void act_id_cache(int argc, char *argv[]);
+static void act_batch(int argc, char *argv[]);
+static void act_features(int argc, char *argv[]);
+
+static const struct command commands[] = {
+	{ "read_reuse",	act_read_reuse,	1, "<key>..." },
+	{ "read_many",	act_read_many,	2, "<arenasize> <key>..." },
+	{ "read_to_fd",	act_read_to_fd,	1, "<key>..." },
+	{ "describe_reuse", act_describe_reuse, 1, "<key>..." },
+	{ "describe_many", act_describe_many, 2, "<arenasize> <key>..." },
+	{ "alloc",	act_alloc,	2, "<allocs> <key>" },
+	{ "secure",	act_secure,	1, "[-a] <key>..." },
+	{ "scan_tree",	act_scan_tree,	1,
+	  "[-r] [-o] [-p <threads>] [-m <allocs>] <keyring>" },
+	{ "proc_key",	act_proc_key,	1, "<key>" },
+	{ "proc_keys_error", act_proc_keys_error, 0, "" },
+	{ "index_find",	act_index_find,	2, "<type> <desc> [<type> <desc>...]" },
+	{ "snapshot",	act_snapshot,	1, "[-r] <keyring>" },
+	{ "neg_cache",	act_neg_cache,	4,
+	  "<keyring> <type> <desc> link <key> <keyring>|setperm <key> <perm>" },
+	{ "request_shared", act_request_shared, 3, "[-t] <threads> <type> <desc>" },
+	{ "async",	act_async,	3, "<threads> <type> <desc>..." },
+	{ "id_cache",	act_id_cache,	0, "" },
+	{ "batch",	act_batch,	3,
+	  "link|unlink|revoke|invalidate <threads> [<keyring>] <key>..." },
+	{ "features",	act_features,	0, "" },
+	{ NULL,		NULL,		0, NULL }
+};
+
+/*****************************************************************************/
+/*
+ * handle an error
+ */
+static void error(const char *msg) __attribute__((noreturn));
+static void error(const char *msg)
+{
+	perror(msg);
+	exit(1);
+}
+
+/*****************************************************************************/
+/*
+ * name the errors that per-key results are expected to carry
+ */
+static const char *errno_name(int err)
+{
+	static char buf[16];
+
+	switch (err) {
+	case ENOBUFS:	return "ENOBUFS";
+	case ENOKEY:	return "ENOKEY";
+	case EINVAL:	return "EINVAL";
+	case EACCES:	return "EACCES";
+	case EKEYREVOKED: return "EKEYREVOKED";
+	case EDOM:	return "EDOM";
+	case ENOMEM:	return "ENOMEM";
+	case ENOENT:	return "ENOENT";
+	default:
+		sprintf(buf, "E%d", err);
+		return buf;
+	}
+}
+
+/*****************************************************************************/
+/*
+ * convert a key ID argument, as keyctl does for the special keyrings
+ */
+static key_serial_t get_key_id(const char *arg)
+{
+	key_serial_t id;
+	char *end;
+
+	if (strcmp(arg, "@s") == 0)
+		return KEY_SPEC_SESSION_KEYRING;
+	if (strcmp(arg, "@u") == 0)
+		return KEY_SPEC_USER_KEYRING;
+	if (strcmp(arg, "@t") == 0)
+		return KEY_SPEC_THREAD_KEYRING;
+	if (strcmp(arg, "@p") == 0)
+		return KEY_SPEC_PROCESS_KEYRING;
+
+	id = strtol(arg, &end, 0);
+	if (*end) {
+		fprintf(stderr, "Unparsable key: '%s'\n", arg);
+		exit(2);
+	}
+	return id;
+}
+
+/*****************************************************************************/
+/*
+ * read a sequence of keys through a single reusable buffer, printing the
+ * payload length of each
+ */
+static void act_read_reuse(int argc, char *argv[])
+{
+	size_t buflen = 0;
+	void *buf = NULL;
+	int i, ret;
+
+	for (i = 1; i < argc; i++) {
+		ret = keyctl_read_reuse(get_key_id(argv[i]), &buf, &buflen);
+		if (ret < 0)
+			error("keyctl_read_reuse");
+		printf("%s%d", i > 1 ? " " : "", ret);
+	}
+	printf("\n");
+	free(buf);
+}
+
+/*****************************************************************************/
+/*
+ * read a batch of keys into an arena of the given size, printing the length
+ * of each result and the error for any that failed
+ */
+static void act_read_many(int argc, char *argv[])
+{
+	struct keyctl_batch_result *results;
+	key_serial_t *ids;
+	size_t arena_size;
+	void *arena;
+	int nr, i;
+
+	arena_size = strtoul(argv[1], NULL, 0);
+	nr = argc - 2;
+	ids = calloc(nr, sizeof(*ids));
+	results = calloc(nr, sizeof(*results));
+	arena = malloc(arena_size + 1);
+	if (!ids || !results || !arena)
+		error("malloc");
+	for (i = 0; i < nr; i++)
+		ids[i] = get_key_id(argv[i + 2]);
+
+	if (keyctl_read_many(ids, nr, results, arena, arena_size) < 0)
+		error("keyctl_read_many");
+
+	for (i = 0; i < nr; i++) {
+		printf("%s%d", i > 0 ? " " : "", results[i].len);
+		if (results[i].error)
+			printf(":%s", errno_name(results[i].error));
+	}
+	printf("\n");
+	free(arena);
+	free(results);
+	free(ids);
+}
+
+/*****************************************************************************/
+/*
+ * pipe a sequence of keys to /dev/null in one process, printing the payload
+ * length of each
+ */
+static void act_read_to_fd(int argc, char *argv[])
+{
+	long ret;
+	int fd, i;
+
+	fd = open("/dev/null", O_WRONLY);
+	if (fd < 0)
+		error("/dev/null");
+
+	for (i = 1; i < argc; i++) {
+		ret = keyctl_read_to_fd(get_key_id(argv[i]), fd, 0);
+		if (ret < 0)
+			error("keyctl_read_to_fd");
+		printf("%s%ld", i > 1 ? " " : "", ret);
+	}
+	printf("\n");
+	close(fd);
+}
+
+/*****************************************************************************/
+/*
+ * extract the name from the end of a raw key description
+ */
+static const char *desc_name(const char *desc)
+{
+	const char *p;
+
+	if (!desc)
+		return "?";
+	p = strrchr(desc, ';');
+	return p ? p + 1 : desc;
+}
+
+/*
+ * accumulate names and print them in sorted order, as the order of the links
+ * in a keyring isn't defined
+ */
+struct names {
+	char		**v;
+	unsigned	nr, max;
+};
+
+static void names_add(struct names *names, const char *name)
+{
+	if (names->nr >= names->max) {
+		names->max = names->max ? names->max * 2 : 16;
+		names->v = realloc(names->v, names->max * sizeof(char *));
+		if (!names->v)
+			error("realloc");
+	}
+	names->v[names->nr] = strdup(name);
+	if (!names->v[names->nr])
+		error("strdup");
+	names->nr++;
+}
+
+static int names_cmp(const void *a, const void *b)
+{
+	return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+static void names_print(struct names *names, int sorted)
+{
+	unsigned i;
+
+	if (sorted)
+		qsort(names->v, names->nr, sizeof(char *), names_cmp);
+	for (i = 0; i < names->nr; i++) {
+		printf("%s%s", i > 0 ? " " : "", names->v[i]);
+		free(names->v[i]);
+	}
+	printf("\n");
+	free(names->v);
+}
+
+/*****************************************************************************/
+/*
+ * describe a sequence of keys through a single reusable buffer, printing the
+ * length of each key's name
+ */
+static void act_describe_reuse(int argc, char *argv[])
+{
+	size_t buflen = 0;
+	char *buf = NULL;
+	int i, ret;
+
+	for (i = 1; i < argc; i++) {
+		ret = keyctl_describe_reuse(get_key_id(argv[i]), &buf, &buflen);
+		if (ret < 0)
+			error("keyctl_describe_reuse");
+		if (ret != strlen(buf)) {
+			fprintf(stderr, "Length %d doesn't match description\n", ret);
+			exit(1);
+		}
+		printf("%s%zu", i > 1 ? " " : "", strlen(desc_name(buf)));
+	}
+	printf("\n");
+	free(buf);
+}
+
+/*****************************************************************************/
+/*
+ * describe a batch of keys into an arena of the given size, printing the name
+ * of each key or the error it got
+ * - the space needed isn't printed as it depends on the caller's IDs
+ */
+static void act_describe_many(int argc, char *argv[])
+{
+	struct keyctl_batch_result *results;
+	key_serial_t *ids;
+	size_t arena_size;
+	void *arena;
+	int nr, i;
+
+	arena_size = strtoul(argv[1], NULL, 0);
+	nr = argc - 2;
+	ids = calloc(nr, sizeof(*ids));
+	results = calloc(nr, sizeof(*results));
+	arena = malloc(arena_size + 1);
+	if (!ids || !results || !arena)
+		error("malloc");
+	for (i = 0; i < nr; i++)
+		ids[i] = get_key_id(argv[i + 2]);
+
+	if (keyctl_describe_many(ids, nr, results, arena, arena_size) < 0)
+		error("keyctl_describe_many");
+
+	for (i = 0; i < nr; i++) {
+		if (results[i].error)
+			printf("%s%s", i > 0 ? " " : "",
+			       errno_name(results[i].error));
+		else
+			printf("%s%s", i > 0 ? " " : "",
+			       desc_name(results[i].data));
+	}
+	printf("\n");
+	free(arena);
+	free(results);
+	free(ids);
+}
+
+/*****************************************************************************/
+/*
+ * an allocator that counts the blocks it hands out and refuses to hand out
+ * more than a given number, without setting errno when it refuses
+ */
+struct counted {
+	int		allocs, frees, left;
+};
+
+static void *counted_alloc(size_t size, void *data)
+{
+	struct counted *c = data;
+
+	if (c->left <= 0)
+		return NULL;
+	c->left--;
+	c->allocs++;
+	return malloc(size);
+}
+
+static void counted_free(void *p, void *data)
+{
+	struct counted *c = data;
+
+	c->frees++;
+	free(p);
+}
+
+/*
+ * describe and read a key with the library allocating from the counted
+ * allocator, printing the name and payload or the errors got, then whether
+ * everything handed out went back through the allocator
+ */
+static void act_alloc(int argc, char *argv[])
+{
+	struct keyutils_allocator allocator = {
+		.alloc	= counted_alloc,
+		.free	= counted_free,
+	};
+	struct counted counted = {};
+	key_serial_t id;
+	void *payload;
+	char *desc;
+
+	counted.left = atoi(argv[1]);
+	id = get_key_id(argv[2]);
+	allocator.data = &counted;
+	keyutils_set_allocator(&allocator);
+
+	errno = 0;
+	if (keyctl_describe_alloc(id, &desc) < 0) {
+		printf("%s", errno_name(errno));
+	} else {
+		printf("%s", desc_name(desc));
+		keyutils_free(desc);
+	}
+
+	errno = 0;
+	if (keyctl_read_alloc(id, &payload) < 0) {
+		printf(" %s", errno_name(errno));
+	} else {
+		printf(" %s", (char *)payload);
+		keyutils_free(payload);
+	}
+
+	keyutils_set_allocator(NULL);
+	printf(" %s\n", counted.allocs == counted.frees ? "balanced" : "leaked");
+}
+
+/*****************************************************************************/
+/*
+ * get the amount of memory the process has locked, in kB
+ */
+static long vm_locked(void)
+{
+	char line[128];
+	long kb = -1;
+	FILE *f;
+
+	f = fopen("/proc/self/status", "r");
+	if (!f)
+		error("/proc/self/status");
+	while (fgets(line, sizeof(line), f))
+		if (sscanf(line, "VmLck: %ld kB", &kb) == 1)
+			break;
+	fclose(f);
+	return kb;
+}
+
+static int is_scrubbed(const char *p, int len)
+{
+	while (len-- > 0)
+		if (*p++)
+			return 0;
+	return 1;
+}
+
+/*
+ * read a sequence of keys into the secure pool, printing each payload, then
+ * whether the pool is locked into memory and whether every buffer was
+ * scrubbed when it was released
+ * - with -a, the pool is installed as the allocator and the keys are read
+ *   with keyctl_read_alloc()
+ * - freed buffers stay mapped in the pool, so they can be looked at
+ */
+static void act_secure(int argc, char *argv[])
+{
+	int use_allocator = 0, scrubbed = 1, opt, ret, i;
+	void *buf;
+
+	while ((opt = getopt(argc, argv, "a")) != -1) {
+		switch (opt) {
+		case 'a':
+			use_allocator = 1;
+			break;
+		default:
+			exit(2);
+		}
+	}
+
+	if (keyutils_secure_pool_init(4096) < 0)
+		error("keyutils_secure_pool_init");
+	if (use_allocator)
+		keyutils_set_allocator(&keyutils_secure_allocator);
+
+	for (i = optind; i < argc; i++) {
+		if (use_allocator)
+			ret = keyctl_read_alloc(get_key_id(argv[i]), &buf);
+		else
+			ret = keyctl_read_secure(get_key_id(argv[i]), &buf);
+		if (ret < 0)
+			error("keyctl_read_secure");
+		printf("%s ", (char *)buf);
+
+		if (use_allocator)
+			keyutils_free(buf);
+		else
+			keyutils_secure_free(buf);
+		if (!is_scrubbed(buf, ret + 1))
+			scrubbed = 0;
+	}
+
+	keyutils_set_allocator(NULL);
+	printf("%s %s\n",
+	       vm_locked() > 0 ? "locked" : "unlocked",
+	       scrubbed ? "scrubbed" : "unscrubbed");
+}
+
+/*****************************************************************************/
+/*
+ * an allocator that fails once it has handed out a given number of blocks
+ */
+static int allocs_left;
+
+static void *limited_alloc(size_t size, void *data)
+{
+	if (__atomic_sub_fetch(&allocs_left, 1, __ATOMIC_RELAXED) < 0) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	return malloc(size);
+}
+
+static void limited_free(void *p, void *data)
+{
+	free(p);
+}
+
+static const struct keyutils_allocator limited_allocator = {
+	.alloc	= limited_alloc,
+	.free	= limited_free,
+};
+
+/*****************************************************************************/
+/*
+ * walk a keyring tree, printing the name of every link visited or the error
+ * if the scan couldn't be completed
+ * - with -m, the library may only allocate that many blocks
+ * - with -o, the scan is ordered and the names are printed in the order
+ *   they're reported rather than sorted
+ */
+static int scan_tree_func(key_serial_t parent, key_serial_t key,
+			  char *desc, int desc_len, void *data)
+{
+	names_add(data, desc_name(desc));
+	return 1;
+}
+
+static void act_scan_tree(int argc, char *argv[])
+{
+	struct names names = {};
+	unsigned flags = 0, nr_threads = 0;
+	int opt, ret;
+
+	while ((opt = getopt(argc, argv, "rop:m:")) != -1) {
+		switch (opt) {
+		case 'r':
+			flags |= KEY_SCAN_REVISIT;
+			break;
+		case 'o':
+			flags |= KEY_SCAN_ORDERED;
+			break;
+		case 'p':
+			nr_threads = strtoul(optarg, NULL, 0);
+			break;
+		case 'm':
+			allocs_left = atoi(optarg);
+			keyutils_set_allocator(&limited_allocator);
+			break;
+		default:
+			exit(2);
+		}
+	}
+	if (optind != argc - 1)
+		exit(2);
+
+	if (nr_threads)
+		ret = keyctl_scan_tree_parallel(get_key_id(argv[optind]), flags,
+						nr_threads, scan_tree_func,
+						&names);
+	else
+		ret = keyctl_scan_tree(get_key_id(argv[optind]), flags,
+				       scan_tree_func, &names);
+	if (ret < 0) {
+		printf("%s\n", errno_name(errno));
+		while (names.nr > 0)
+			free(names.v[--names.nr]);
+		free(names.v);
+		return;
+	}
+	if (ret != names.nr) {
+		fprintf(stderr, "Scan returned %d for %u links\n", ret, names.nr);
+		exit(1);
+	}
+	names_print(&names, !(flags & KEY_SCAN_ORDERED));
+}
+
+/*****************************************************************************/
+/*
+ * find a key in /proc/keys and print what the parser made of its line
+ */
+struct proc_key_search {
+	key_serial_t	serial;
+	char		line[256];
+};
+
+static int proc_key_func(const struct keyctl_proc_key *k, void *data)
+{
+	static const char flag_chars[] = "IRDQUNi";
+	struct proc_key_search *search = data;
+	char flags[8];
+	int i;
+
+	if (k->serial != search->serial)
+		return 0;
+
+	for (i = 0; i < 7; i++)
+		flags[i] = k->flags & (1 << i) ? flag_chars[i] : '-';
+	flags[7] = 0;
+
+	if (strlen(k->type) != k->type_len || strlen(k->desc) != k->desc_len)
+		return -1;
+	snprintf(search->line, sizeof(search->line), "%s %s %08x %ld %s",
+		 flags, k->type, k->perm, k->timeout, k->desc);
+	return 1;
+}
+
+static void act_proc_key(int argc, char *argv[])
+{
+	struct proc_key_search search;
+	int ret;
+
+	search.serial = get_key_id(argv[1]);
+	if (search.serial < 0) {
+		search.serial = keyctl_get_keyring_ID(search.serial, 0);
+		if (search.serial == -1)
+			error("keyctl_get_keyring_ID");
+	}
+
+	ret = keyctl_proc_keys_iterate(proc_key_func, &search);
+	if (ret < 0)
+		error("keyctl_proc_keys_iterate");
+	if (ret == 0) {
+		printf("missing\n");
+		exit(1);
+	}
+	printf("%s\n", search.line);
+}
+
+/*****************************************************************************/
+/*
+ * check that an error from the iterator function is passed back with its
+ * errno intact
+ */
+static int proc_keys_error_func(const struct keyctl_proc_key *k, void *data)
+{
+	errno = EDOM;
+	return -1;
+}
+
+static void act_proc_keys_error(int argc, char *argv[])
+{
+	int ret;
+
+	errno = 0;
+	ret = keyctl_proc_keys_iterate(proc_keys_error_func, NULL);
+	printf("%d %s\n", ret, errno_name(errno));
+}
+
+/*****************************************************************************/
+/*
+ * look up keys through an index of /proc/keys, printing the ID of each or
+ * the error
+ */
+static void act_index_find(int argc, char *argv[])
+{
+	struct keyctl_key_index *index;
+	key_serial_t id;
+	int i;
+
+	index = keyctl_key_index_create(0, 0);
+	if (!index)
+		error("keyctl_key_index_create");
+
+	for (i = 1; i + 1 < argc; i += 2) {
+		id = keyctl_key_index_find(index, argv[i], argv[i + 1], 0);
+		if (id < 0)
+			printf("%s%s", i > 1 ? " " : "", errno_name(errno));
+		else
+			printf("%s%d", i > 1 ? " " : "", id);
+	}
+	printf("\n");
+	keyctl_key_index_destroy(index);
+}
+
+/*****************************************************************************/
+/*
+ * snapshot a keyring tree, printing the number of entries directly under the
+ * top keyring and then each entry sorted by description as
+ * "name:type:parent:timeout"
+ */
+static void act_snapshot(int argc, char *argv[])
+{
+	struct keyctl_snapshot *snap;
+	unsigned flags = 0, *order, i, j, n;
+	const char *type, *parent;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "r")) != -1) {
+		switch (opt) {
+		case 'r':
+			flags |= KEY_SCAN_REVISIT;
+			break;
+		default:
+			exit(2);
+		}
+	}
+	if (optind != argc - 1)
+		exit(2);
+
+	snap = keyctl_snapshot_tree(get_key_id(argv[optind]), flags);
+	if (!snap)
+		error("keyctl_snapshot_tree");
+
+	if (snap->nr == 0 ||
+	    keyctl_snapshot_find(snap, snap->serial[0]) != 0 ||
+	    snap->parent[0] != KEY_SNAPSHOT_NONE ||
+	    snap->next[0] != snap->nr) {
+		fprintf(stderr, "Bad top entry\n");
+		exit(1);
+	}
+
+	n = 0;
+	for (i = keyctl_snapshot_first_child(snap, 0);
+	     i != KEY_SNAPSHOT_NONE;
+	     i = keyctl_snapshot_next_sibling(snap, i)) {
+		if (snap->parent[i] != 0) {
+			fprintf(stderr, "Child %u has parent %u\n",
+				i, snap->parent[i]);
+			exit(1);
+		}
+		n++;
+	}
+	printf("%u", n);
+
+	order = malloc(snap->nr * sizeof(*order));
+	if (!order)
+		error("malloc");
+	if (keyctl_snapshot_sort(snap, KEY_SNAPSHOT_BY_DESC, order) < 0)
+		error("keyctl_snapshot_sort");
+
+	for (i = 0; i < snap->nr; i++) {
+		j = order[i];
+		type = snap->type[j] == KEY_SNAPSHOT_NO_TYPE ?
+			"?" : snap->types[snap->type[j]].name;
+		parent = snap->parent[j] == KEY_SNAPSHOT_NONE ?
+			"-" : keyctl_snapshot_desc(snap, snap->parent[j]);
+		printf(" %s:%s:%s:%d", keyctl_snapshot_desc(snap, j), type,
+		       parent, snap->timeout[j]);
+	}
+	printf("\n");
+	free(order);
+	keyctl_snapshot_free(snap);
+}
+
+/*****************************************************************************/
+/*
+ * search a keyring with the negative lookup cache on, then do something that
+ * might make the key findable and search again, printing the result of each
+ * search as the key ID or the error
+ */
+static void neg_cache_search(key_serial_t ring, const char *type,
+			     const char *desc)
+{
+	long ret;
+
+	ret = keyctl_search(ring, type, desc, 0);
+	if (ret < 0)
+		printf("%s", errno_name(errno));
+	else
+		printf("%ld", ret);
+}
+
+static void act_neg_cache(int argc, char *argv[])
+{
+	key_serial_t ring = get_key_id(argv[1]);
+	long ret;
+
+	keyutils_negative_cache_enable(60 * 1000);
+
+	neg_cache_search(ring, argv[2], argv[3]);
+	printf(" ");
+
+	if (strcmp(argv[4], "link") == 0 && argc == 7)
+		ret = keyctl_link(get_key_id(argv[5]), get_key_id(argv[6]));
+	else if (strcmp(argv[4], "setperm") == 0 && argc == 7)
+		ret = keyctl_setperm(get_key_id(argv[5]),
+				     strtoul(argv[6], NULL, 0));
+	else
+		exit(2);
+	if (ret < 0)
+		error(argv[4]);
+
+	neg_cache_search(ring, argv[2], argv[3]);
+	printf("\n");
+}
+
+/*****************************************************************************/
+/*
+ * request a key from many threads at once, printing each different result as
+ * the key ID or the error
+ * - with -t, every other thread first puts a key of its own with that type and
+ *   description in its thread keyring, and finding that key is printed as "T"
+ */
+struct shared_thread {
+	pthread_t	thread;
+	const char	*type;
+	const char	*desc;
+	int		own;
+	key_serial_t	result;
+	int		error;
+};
+
+static pthread_barrier_t shared_barrier;
+
+static void *request_shared_thread(void *_t)
+{
+	struct shared_thread *t = _t;
+	key_serial_t own = 0;
+
+	if (t->own) {
+		own = add_key(t->type, t->desc, "own", 3,
+			      KEY_SPEC_THREAD_KEYRING);
+		if (own < 0)
+			error("add_key");
+	}
+
+	pthread_barrier_wait(&shared_barrier);
+	t->result = keyctl_request_shared(t->type, t->desc, NULL, 0);
+	t->error = errno;
+	if (own && t->result == own)
+		t->result = 0;
+	return NULL;
+}
+
+static void act_request_shared(int argc, char *argv[])
+{
+	struct shared_thread *threads;
+	struct names names = {};
+	char buf[16];
+	unsigned j;
+	int nr, i, own = 0, opt;
+
+	while ((opt = getopt(argc, argv, "t")) != -1) {
+		switch (opt) {
+		case 't':
+			own = 1;
+			break;
+		default:
+			exit(2);
+		}
+	}
+	if (optind != argc - 3)
+		exit(2);
+
+	nr = atoi(argv[optind]);
+	threads = calloc(nr, sizeof(*threads));
+	if (!threads)
+		error("calloc");
+	pthread_barrier_init(&shared_barrier, NULL, nr);
+
+	for (i = 0; i < nr; i++) {
+		threads[i].type = argv[optind + 1];
+		threads[i].desc = argv[optind + 2];
+		threads[i].own = own && (i & 1);
+		if (pthread_create(&threads[i].thread, NULL,
+				   request_shared_thread, &threads[i]) != 0)
+			error("pthread_create");
+	}
+
+	for (i = 0; i < nr; i++) {
+		pthread_join(threads[i].thread, NULL);
+		if (threads[i].result == 0)
+			strcpy(buf, "T");
+		else if (threads[i].result < 0)
+			strcpy(buf, errno_name(threads[i].error));
+		else
+			sprintf(buf, "%d", threads[i].result);
+		for (j = 0; j < names.nr; j++)
+			if (strcmp(names.v[j], buf) == 0)
+				break;
+		if (j == names.nr)
+			names_add(&names, buf);
+	}
+	names_print(&names, 1);
+	pthread_barrier_destroy(&shared_barrier);
+	free(threads);
+}
+
+/*****************************************************************************/
+/*
+ * request keys through a pool of worker threads, printing the ID of each or
+ * the error in the order asked for
+ * - the allocator refuses to be used by any thread but the main one, as only
+ *   that thread calls into the library
+ */
+static pthread_t main_thread;
+
+static void *main_thread_alloc(size_t size, void *data)
+{
+	if (!pthread_equal(pthread_self(), main_thread)) {
+		fprintf(stderr, "Allocator called from a worker thread\n");
+		abort();
+	}
+	return malloc(size);
+}
+
+static void main_thread_free(void *p, void *data)
+{
+	if (!pthread_equal(pthread_self(), main_thread)) {
+		fprintf(stderr, "Allocator called from a worker thread\n");
+		abort();
+	}
+	free(p);
+}
+
+static const struct keyutils_allocator main_thread_allocator = {
+	.alloc	= main_thread_alloc,
+	.free	= main_thread_free,
+};
+
+struct async_result {
+	key_serial_t	key;
+	int		error;
+	int		done;
+};
+
+static void async_done(key_serial_t key, int error, void *data)
+{
+	struct async_result *r = data;
+
+	r->key = key;
+	r->error = error;
+	r->done = 1;
+}
+
+static void act_async(int argc, char *argv[])
+{
+	struct keyctl_async *async;
+	struct async_result *results;
+	struct pollfd pfd;
+	int nr, i, left;
+
+	main_thread = pthread_self();
+	keyutils_set_allocator(&main_thread_allocator);
+
+	nr = (argc - 2) / 2;
+	results = calloc(nr, sizeof(*results));
+	if (!results)
+		error("calloc");
+
+	async = keyctl_async_create(atoi(argv[1]), nr);
+	if (!async)
+		error("keyctl_async_create");
+
+	for (i = 0; i < nr; i++)
+		if (keyctl_request_async(async, argv[2 + i * 2], argv[3 + i * 2],
+					 NULL, 0, async_done, &results[i]) < 0)
+			error("keyctl_request_async");
+
+	pfd.fd = keyctl_async_fd(async);
+	pfd.events = POLLIN;
+	for (left = nr; left > 0; left -= i) {
+		if (poll(&pfd, 1, 10 * 1000) != 1) {
+			fprintf(stderr, "Requests didn't complete\n");
+			exit(1);
+		}
+		i = keyctl_async_dispatch(async);
+		if (i < 0)
+			error("keyctl_async_dispatch");
+	}
+	keyctl_async_destroy(async);
+
+	for (i = 0; i < nr; i++) {
+		if (results[i].key < 0)
+			printf("%s%s", i ? " " : "",
+			       errno_name(results[i].error));
+		else
+			printf("%s%d", i ? " " : "", results[i].key);
+	}
+	printf("\n");
+	free(results);
+}
+
+/*****************************************************************************/
+/*
+ * have one thread cache the session keyring's ID, have another thread that
+ * has cached nothing revoke it and then print what the first thread gets when
+ * it asks again
+ * - a new session keyring is joined first so that the caller's isn't revoked
+ */
+static pthread_barrier_t id_cache_barrier;
+static key_serial_t id_cache_ring;
+
+static void *id_cache_thread(void *data)
+{
+	key_serial_t id;
+
+	id_cache_ring = keyctl_get_keyring_ID_cached(KEY_SPEC_SESSION_KEYRING, 1);
+	if (id_cache_ring < 0)
+		error("keyctl_get_keyring_ID_cached");
+	pthread_barrier_wait(&id_cache_barrier);
+	pthread_barrier_wait(&id_cache_barrier);
+
+	id = keyctl_get_keyring_ID_cached(KEY_SPEC_SESSION_KEYRING, 0);
+	if (id < 0)
+		printf("%s\n", errno_name(errno));
+	else if (id == id_cache_ring)
+		printf("STALE\n");
+	else
+		printf("%d\n", id);
+	return NULL;
+}
+
+static void *id_revoke_thread(void *data)
+{
+	if (keyctl_revoke(KEY_SPEC_SESSION_KEYRING) < 0)
+		error("keyctl_revoke");
+	return NULL;
+}
+
+static void act_id_cache(int argc, char *argv[])
+{
+	pthread_t cacher, revoker;
+
+	if (keyctl_join_session_keyring(NULL) < 0)
+		error("keyctl_join_session_keyring");
+
+	pthread_barrier_init(&id_cache_barrier, NULL, 2);
+	if (pthread_create(&cacher, NULL, id_cache_thread, NULL) != 0)
+		error("pthread_create");
+	pthread_barrier_wait(&id_cache_barrier);
+
+	if (pthread_create(&revoker, NULL, id_revoke_thread, NULL) != 0)
+		error("pthread_create");
+	pthread_join(revoker, NULL);
+
+	pthread_barrier_wait(&id_cache_barrier);
+	pthread_join(cacher, NULL);
+	pthread_barrier_destroy(&id_cache_barrier);
+}
+
+/*****************************************************************************/
+/*
+ * apply an operation to a batch of keys spread over a number of threads,
+ * printing the number it succeeded on and then the result for each key
+ */
+static void act_batch(int argc, char *argv[])
+{
+	key_serial_t *ids, ringid = 0;
+	unsigned nr_threads;
+	int *errors, nr, first, ret, i;
+
+	nr_threads = strtoul(argv[2], NULL, 0);
+	first = 3;
+	if (strcmp(argv[1], "link") == 0 || strcmp(argv[1], "unlink") == 0) {
+		if (argc < 5)
+			exit(2);
+		ringid = get_key_id(argv[3]);
+		first = 4;
+	}
+
+	nr = argc - first;
+	ids = calloc(nr, sizeof(*ids));
+	errors = calloc(nr, sizeof(*errors));
+	if (!ids || !errors)
+		error("calloc");
+	for (i = 0; i < nr; i++)
+		ids[i] = get_key_id(argv[first + i]);
+
+	if (strcmp(argv[1], "link") == 0)
+		ret = keyctl_link_many(ids, nr, ringid, errors, nr_threads);
+	else if (strcmp(argv[1], "unlink") == 0)
+		ret = keyctl_unlink_many(ids, nr, ringid, errors, nr_threads);
+	else if (strcmp(argv[1], "revoke") == 0)
+		ret = keyctl_revoke_many(ids, nr, errors, nr_threads);
+	else if (strcmp(argv[1], "invalidate") == 0)
+		ret = keyctl_invalidate_many(ids, nr, errors, nr_threads);
+	else
+		exit(2);
+	if (ret < 0)
+		error(argv[1]);
+
+	printf("%d", ret);
+	for (i = 0; i < nr; i++)
+		printf(" %s", errors[i] ? errno_name(errors[i]) : "ok");
+	printf("\n");
+	free(errors);
+	free(ids);
+}
+
+/*****************************************************************************/
+/*
+ * count the keyctl() calls the library has made since statistics were
+ * enabled
+ * - a preloaded keyctl() bypasses the library's, so the count stays at zero
+ */
+static uint64_t keyctl_calls(void)
+{
+	struct keyutils_stats stats;
+	uint64_t calls = 0;
+	unsigned op;
+
+	if (keyutils_stats_snapshot(&stats) < 0)
+		error("keyutils_stats_snapshot");
+	for (op = 0; op <= KEYUTILS_STATS_KEYCTL_OTHER; op++)
+		calls += stats.ops[op].calls;
+	return calls;
+}
+
+/*
+ * probe the kernel's features, printing whether:
+ * - a command whose presence was learnt from calling it isn't probed again
+ * - errno is left alone by probing
+ * - the commands that came with the original keyrings support are present
+ * - the commands that fail early when known to be missing agree with the
+ *   probe
+ * - asking again doesn't call the kernel
+ */
+static void act_features(int argc, char *argv[])
+{
+	uint64_t present, basic, calls;
+	int consistent = 1;
+
+	keyutils_stats_enable(1);
+
+	keyctl_invalidate(0);
+	calls = keyctl_calls();
+	keyutils_probe_features(KEYCTL_FEATURE(KEYCTL_INVALIDATE));
+	printf("%s", keyctl_calls() == calls ? "learnt" : "reprobed");
+
+	errno = EDOM;
+	present = keyutils_probe_features(KEYCTL_FEATURES_ALL);
+	printf(" %s", errno == EDOM ? "preserved" : "clobbered");
+
+	basic = (KEYCTL_FEATURE(KEYCTL_NEGATE) << 1) - 1;
+	printf(" %s", (present & basic) == basic ? "basic" : "nobasic");
+
+	if (keyctl_invalidate(0) == -1 &&
+	    (errno == EOPNOTSUPP) != !(present & KEYCTL_FEATURE(KEYCTL_INVALIDATE)))
+		consistent = 0;
+	if (keyctl_get_persistent(-1, 0) == -1 &&
+	    (errno == EOPNOTSUPP) != !(present & KEYCTL_FEATURE(KEYCTL_GET_PERSISTENT)))
+		consistent = 0;
+	printf(" %s", consistent ? "consistent" : "inconsistent");
+
+	calls = keyctl_calls();
+	if (keyutils_probe_features(KEYCTL_FEATURES_ALL) != present)
+		error("keyutils_probe_features");
+	printf(" %s\n", keyctl_calls() == calls ? "cached" : "uncached");
+}
+
+/*****************************************************************************/
+/*
+ * execute the appropriate subcommand
+ */
+int main(int argc, char *argv[])
+{
+	const struct command *cmd;
+
+	if (argc < 2)
+		goto format;
+
+	for (cmd = commands; cmd->name; cmd++) {
+		if (strcmp(cmd->name, argv[1]) != 0)
+			continue;
+		if (argc - 2 < cmd->min_args) {
+			fprintf(stderr, "Format: libkeyctl %s %s\n",
+				cmd->name, cmd->format);
+			exit(2);
+		}
+		cmd->action(argc - 1, argv + 1);
+		exit(0);
+	}
+
+format:
+	fprintf(stderr, "Format:\n");
+	for (cmd = commands; cmd->name; cmd++)
+		fprintf(stderr, "  libkeyctl %s %s\n", cmd->name, cmd->format);
+	exit(2);
+}
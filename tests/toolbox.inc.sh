@@ -1051,6 +1051,32 @@ function invalidate_key ()
     fi
 }
 
+###############################################################################
+#
+# exercise a library function through the libkeyctl test helper
+# - the helper is linked against the library in the source tree, so that a
+#   preloaded fake library takes effect for it as it does for keyctl
+#
+###############################################################################
+function libkeyctl ()
+{
+    my_libdir=`cd ${includes}.. && pwd`
+    my_exitval=0
+    if [ "x$1" = "x--fail" ]
+    then
+	my_exitval=1
+	shift
+    fi
+
+    echo libkeyctl $* >>$OUTPUTFILE
+    LD_LIBRARY_PATH=$my_libdir${LD_LIBRARY_PATH:+:$LD_LIBRARY_PATH} \
+	${includes}libkeyctl "$@" >>$OUTPUTFILE 2>&1
+    if [ $? != $my_exitval ]
+    then
+	failed
+    fi
+}
+
 ###############################################################################
 #
 # Make sure we sleep at least N seconds